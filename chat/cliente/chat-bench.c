@@ -0,0 +1,819 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+/* Generador de carga para server-chat. Abre muchas conexiones repartidas
+ * entre threads con epoll, las registra con CONNECT_EXT y manda mensajes a
+ * una tasa fija con el formato de cable del servidor (v1 o v2). Cada
+ * cuerpo lleva el instante de envío, así el receptor mide la latencia de
+ * punta a punta: lo escribe y lo compara el mismo proceso, así que el
+ * servidor puede estar en cualquier máquina. */
+
+// opcodes y códigos, los mismos de servidor/protocol.h
+#define OPCODE_CONNECT_EXT 10
+#define OPCODE_SENDMSG 3
+#define OPCODE_ROOM_JOIN 4
+#define OPCODE_ROOM_MSG 11
+#define OPCODE_ERROR 6
+#define OPCODE_ACK 7
+#define OPCODE_USER_EVENT 8
+#define OPCODE_USER_LIST 9
+#define CAP_USER_LIST 0x0001
+#define NAME_LEN 32
+#define V1_MAX_BODY 1023
+#define MAX_PREFIX 16 // más el número de conexión tiene que entrar en NAME_LEN
+
+#define PATTERN_PAIR 0   // cada conexión le escribe a su par
+#define PATTERN_RANDOM 1 // destino al azar
+#define PATTERN_ROOM 2   // salas de -g miembros; cada post llega a todos los demás
+
+#define MAX_THREADS 64
+#define RX_CHUNK 65536
+#define MAX_TX_BACKLOG (1 << 20) // más pendiente que esto y la conexión no manda
+#define MAX_BURST 4096           // frames por vuelta del loop, por thread
+#define MAX_BATCH 64
+#define SETUP_TIMEOUT_MS 30000
+#define JOIN_SETTLE_MS 300
+#define DRAIN_MS 1000
+#define TS_DIGITS 16
+
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS 368
+
+typedef struct
+{
+    unsigned char *data;
+    size_t len, off, cap;
+} buf_t;
+
+typedef struct
+{
+    int fd;
+    int id; // global: define el nombre
+    int acked; // 1 con el ACK, -1 si el servidor la rechazó o la cerró
+    char error[64]; // por qué, para el reporte
+    buf_t rx, tx;
+} conn_t;
+
+typedef struct
+{
+    int id;
+    pthread_t thread;
+    int epfd;
+    conn_t *conns;
+    int nconns;
+    unsigned char *frame; // para armar lo que se manda, de frame_cap bytes
+    uint64_t rng;
+    uint64_t sent, received, skipped, errors;
+    uint64_t expected; // entregas que deberían llegar por lo enviado
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t max_ns;
+} worker_t;
+
+static const char *host = "127.0.0.1";
+static int port = 6969;
+static int nconns = 100;
+static int nthreads = 1;
+static double rate = 10000; // mensajes por segundo, entre todos
+static double duration = 10;
+static size_t body_size = 64;
+static int pattern = PATTERN_PAIR;
+static int group_size = 10;
+static int version = 1;
+static int batch = 1; // mensajes por sendmsg, sólo v2
+static uint64_t seed = 1;
+static const char *prefix = "bench"; // de los nombres de usuario y de sala
+static size_t frame_cap;             // el frame más grande que se manda o se recibe
+
+static pthread_barrier_t setup_done;
+static uint64_t start_ns, stop_ns;
+static volatile int setup_failed = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*: reproducible con la misma semilla
+static uint64_t next_rand(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ull;
+}
+
+static int hist_index(uint64_t v)
+{
+    if (v < (1u << HIST_SUB_BITS))
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    int shift = e - HIST_SUB_BITS;
+    int idx = (shift + 1) * (1 << HIST_SUB_BITS) + (int)((v >> shift) & ((1 << HIST_SUB_BITS) - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_upper(int idx)
+{
+    int sub = 1 << HIST_SUB_BITS;
+    if (idx < sub)
+        return idx;
+    int shift = idx / sub - 1;
+    uint64_t lower = (uint64_t)(sub + idx % sub) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+// en ms; el tope del bucket puede pasarse del máximo visto, se recorta
+static double hist_quantile(const uint64_t *hist, uint64_t count, uint64_t max_ns, double q)
+{
+    if (count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * count);
+    if (rank >= count)
+        rank = count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist[i];
+        if (seen > rank)
+            return (hist_upper(i) < max_ns ? hist_upper(i) : max_ns) / 1e6;
+    }
+    return max_ns / 1e6;
+}
+
+static int buf_put(buf_t *b, const void *data, size_t len)
+{
+    if (b->len + len > b->cap)
+    {
+        // primero se recupera lo ya consumido
+        if (b->off > 0)
+        {
+            memmove(b->data, b->data + b->off, b->len - b->off);
+            b->len -= b->off;
+            b->off = 0;
+        }
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len)
+            cap *= 2;
+        if (cap != b->cap)
+        {
+            unsigned char *tmp = realloc(b->data, cap);
+            if (tmp == NULL)
+                return -1;
+            b->data = tmp;
+            b->cap = cap;
+        }
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static void conn_name(int id, char name[NAME_LEN])
+{
+    snprintf(name, NAME_LEN, "%s%d", prefix, id);
+}
+
+static void room_name(int id, char name[NAME_LEN])
+{
+    snprintf(name, NAME_LEN, "%s-g%d", prefix, id / group_size);
+}
+
+// cuántas conexiones hay en la sala de id; la última queda corta si nconns no es múltiplo de -g
+static int room_size(int id)
+{
+    int first = id / group_size * group_size;
+    return nconns - first < group_size ? nconns - first : group_size;
+}
+
+// manda todo lo posible de tx; -1 si el socket falló
+static int conn_flush(conn_t *c)
+{
+    while (c->tx.off < c->tx.len)
+    {
+        ssize_t w = send(c->fd, c->tx.data + c->tx.off, c->tx.len - c->tx.off, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (w < 0)
+            return -1;
+        c->tx.off += w;
+    }
+    c->tx.off = c->tx.len = 0;
+    return 0;
+}
+
+static void put_u16(unsigned char **p, uint16_t v)
+{
+    v = htons(v);
+    memcpy(*p, &v, 2);
+    *p += 2;
+}
+
+static void put_u32(unsigned char **p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(*p, &v, 4);
+    *p += 4;
+}
+
+static void put_str(unsigned char **p, const char *s)
+{
+    size_t n = strlen(s);
+    if (version >= 2)
+        *(*p)++ = n;
+    memcpy(*p, s, n);
+    *p += n;
+    if (version < 2)
+        *(*p)++ = '\0';
+}
+
+// cuerpo: instante de envío en hex y relleno hasta body_size
+static void put_body(unsigned char **p, uint64_t ts)
+{
+    if (version >= 2)
+        put_u32(p, body_size);
+    char hex[TS_DIGITS + 1];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)ts);
+    memcpy(*p, hex, TS_DIGITS);
+    memset(*p + TS_DIGITS, 'x', body_size - TS_DIGITS);
+    *p += body_size;
+    if (version < 2)
+        *(*p)++ = '\0';
+}
+
+// cierra un frame v2 que empieza en start: escribe su prefijo de largo
+static void end_frame(unsigned char *start, unsigned char *end)
+{
+    if (version < 2)
+        return;
+    unsigned char *p = start;
+    put_u32(&p, end - start - 4);
+}
+
+static unsigned char *begin_frame(unsigned char *p, uint16_t opcode)
+{
+    if (version >= 2)
+        p += 4;
+    put_u16(&p, opcode);
+    return p;
+}
+
+static int send_connect(conn_t *c)
+{
+    char name[NAME_LEN];
+    conn_name(c->id, name);
+    unsigned char frame[6 + NAME_LEN + 1], *p = frame;
+    put_u16(&p, OPCODE_CONNECT_EXT);
+    put_u16(&p, version);
+    put_u16(&p, CAP_USER_LIST);
+    memcpy(p, name, strlen(name) + 1);
+    p += strlen(name) + 1;
+    return buf_put(&c->tx, frame, p - frame) < 0 ? -1 : conn_flush(c);
+}
+
+static int send_join(conn_t *c)
+{
+    char room[NAME_LEN];
+    room_name(c->id, room);
+    unsigned char frame[8 + NAME_LEN + 1];
+    unsigned char *p = begin_frame(frame, OPCODE_ROOM_JOIN);
+    put_str(&p, room);
+    end_frame(frame, p);
+    return buf_put(&c->tx, frame, p - frame) < 0 ? -1 : conn_flush(c);
+}
+
+static int pick_dest(worker_t *w, int from)
+{
+    if (pattern == PATTERN_RANDOM)
+        return next_rand(&w->rng) % nconns;
+    int peer = from ^ 1;
+    return peer < nconns ? peer : 0;
+}
+
+// un sendmsg (con batch mensajes en v2) o un room_msg desde c
+static int send_messages(worker_t *w, conn_t *c, int count)
+{
+    unsigned char *frame = w->frame;
+    char orig[NAME_LEN], dest[NAME_LEN];
+    conn_name(c->id, orig);
+    uint64_t ts = now_ns();
+
+    if (pattern == PATTERN_ROOM)
+    {
+        room_name(c->id, dest);
+        unsigned char *p = begin_frame(frame, OPCODE_ROOM_MSG);
+        put_str(&p, orig);
+        put_str(&p, dest);
+        put_body(&p, ts);
+        end_frame(frame, p);
+        w->sent++;
+        w->expected += room_size(c->id) - 1;
+        return buf_put(&c->tx, frame, p - frame) < 0 ? -1 : conn_flush(c);
+    }
+
+    unsigned char *start = frame, *p = frame;
+    for (int i = 0; i < count; i++)
+    {
+        conn_name(pick_dest(w, c->id), dest);
+        // v1 no tiene lotes: un frame por mensaje, todos en el mismo send
+        if (version < 2 || i == 0)
+        {
+            start = p;
+            p = begin_frame(p, OPCODE_SENDMSG);
+            put_str(&p, orig);
+            if (version >= 2)
+                put_u16(&p, count);
+        }
+        put_str(&p, dest);
+        put_body(&p, ts);
+    }
+    end_frame(start, p);
+    w->sent += count;
+    w->expected += count;
+    return buf_put(&c->tx, frame, p - frame) < 0 ? -1 : conn_flush(c);
+}
+
+static void record_latency(worker_t *w, const unsigned char *body, size_t len)
+{
+    if (len < TS_DIGITS)
+        return;
+    char hex[TS_DIGITS + 1];
+    memcpy(hex, body, TS_DIGITS);
+    hex[TS_DIGITS] = '\0';
+    uint64_t sent = strtoull(hex, NULL, 16);
+    uint64_t now = now_ns();
+    if (sent == 0 || sent > now)
+        return;
+    uint64_t lat = now - sent;
+    w->hist[hist_index(lat)]++;
+    if (lat > w->max_ns)
+        w->max_ns = lat;
+    w->received++;
+}
+
+// largo del string terminado en '\0' en [p, end), -1 si no llegó entero
+static ssize_t cstr_len(const unsigned char *p, const unsigned char *end)
+{
+    const unsigned char *nul = memchr(p, '\0', end - p);
+    return nul ? nul - p : -1;
+}
+
+/* Procesa un frame del servidor al comienzo de [p, end). Devuelve los bytes
+ * consumidos o 0 si todavía no llegó entero. */
+static size_t handle_frame(worker_t *w, conn_t *c, const unsigned char *p, const unsigned char *end)
+{
+    const unsigned char *start = p;
+    if (version >= 2)
+    {
+        if (end - p < 6)
+            return 0;
+        uint32_t len;
+        memcpy(&len, p, 4);
+        len = ntohl(len);
+        if ((size_t)(end - p) < 4 + (size_t)len)
+            return 0;
+        end = p + 4 + len;
+        p += 4;
+    }
+    if (end - p < 2)
+        return 0;
+    uint16_t opcode;
+    memcpy(&opcode, p, 2);
+    opcode = ntohs(opcode);
+    p += 2;
+
+    ssize_t n;
+    switch (opcode)
+    {
+    case OPCODE_ACK:
+        if (end - p < 2)
+            return 0;
+        c->acked = 1;
+        p += 2;
+        break;
+    case OPCODE_ERROR:
+        if (end - p < 2 || (n = cstr_len(p + 2, end)) < 0)
+            return 0;
+        w->errors++;
+        snprintf(c->error, sizeof(c->error), "%s", (const char *)p + 2);
+        // antes del ACK es un rechazo y el servidor cierra; después, un mensaje descartado
+        if (c->acked == 0)
+            c->acked = -1;
+        p += 2 + n + 1;
+        break;
+    case OPCODE_USER_EVENT:
+        if (end - p < 2 || (n = cstr_len(p + 2, end)) < 0)
+            return 0;
+        p += 2 + n + 1;
+        break;
+    case OPCODE_USER_LIST:
+    {
+        if (end - p < 2)
+            return 0;
+        uint16_t count;
+        memcpy(&count, p, 2);
+        p += 2;
+        for (int i = 0; i < ntohs(count); i++)
+        {
+            if (p >= end || (n = cstr_len(p + 1, end)) < 0)
+                return 0;
+            p += 1 + n + 1;
+        }
+        break;
+    }
+    case OPCODE_SENDMSG:
+    case OPCODE_ROOM_MSG:
+        if (version >= 2)
+        {
+            // orig, (count), dest o sala, cuerpo; el frame ya está completo
+            p += 1 + *p;
+            if (opcode == OPCODE_SENDMSG)
+                p += 2;
+            p += 1 + *p;
+            uint32_t blen;
+            memcpy(&blen, p, 4);
+            record_latency(w, p + 4, ntohl(blen));
+            p = end;
+            break;
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            if ((n = cstr_len(p, end)) < 0)
+                return 0;
+            p += n + 1;
+        }
+        if ((n = cstr_len(p, end)) < 0)
+            return 0;
+        record_latency(w, p, n);
+        p += n + 1;
+        break;
+    default:
+        // en v2 se puede saltear; en v1 no se sabe dónde termina
+        if (version < 2)
+        {
+            fprintf(stderr, "chat-bench: unexpected opcode %u\n", opcode);
+            exit(1);
+        }
+        p = end;
+        break;
+    }
+    return version >= 2 ? (size_t)(end - start) : (size_t)(p - start);
+}
+
+// lee todo lo disponible y procesa los frames completos; -1 si se cerró
+static int conn_read(worker_t *w, conn_t *c)
+{
+    while (1)
+    {
+        // lugar para un frame entero, así uno grande no se lee de a RX_CHUNK
+        if (c->rx.cap - c->rx.len < RX_CHUNK)
+        {
+            size_t cap = c->rx.len + (frame_cap > RX_CHUNK ? frame_cap : RX_CHUNK);
+            unsigned char *tmp = realloc(c->rx.data, cap);
+            if (tmp == NULL)
+                return -1;
+            c->rx.data = tmp;
+            c->rx.cap = cap;
+        }
+        ssize_t n = recv(c->fd, c->rx.data + c->rx.len, c->rx.cap - c->rx.len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        c->rx.len += n;
+
+        size_t off = 0, k;
+        while ((k = handle_frame(w, c, c->rx.data + off, c->rx.data + c->rx.len)) > 0)
+            off += k;
+        memmove(c->rx.data, c->rx.data + off, c->rx.len - off);
+        c->rx.len -= off;
+    }
+}
+
+static int conn_open(conn_t *c, int epfd)
+{
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+        return -1;
+    if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        return -1;
+    fcntl(c->fd, F_SETFL, O_NONBLOCK);
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+// la saca del epoll y la marca; si el servidor no mandó un ERROR antes, el motivo es el cierre
+static void conn_fail(worker_t *w, conn_t *c)
+{
+    if (c->error[0] == '\0')
+        snprintf(c->error, sizeof(c->error), "%s", errno ? strerror(errno) : "closed by server");
+    c->acked = -1;
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* Atiende los eventos de hasta timeout_ms. Devuelve -1 si alguna
+ * conexión se cerró; las demás se atienden igual. */
+static int poll_events(worker_t *w, int timeout_ms)
+{
+    struct epoll_event events[256];
+    int n = epoll_wait(w->epfd, events, 256, timeout_ms);
+    int res = 0;
+    for (int i = 0; i < n; i++)
+    {
+        conn_t *c = events[i].data.ptr;
+        if (c->fd < 0)
+            continue; // se cerró con un evento anterior de esta misma tanda
+        errno = 0;
+        if (((events[i].events & EPOLLIN) && conn_read(w, c) < 0) ||
+            ((events[i].events & EPOLLOUT) && conn_flush(c) < 0))
+        {
+            conn_fail(w, c);
+            res = -1;
+        }
+    }
+    return res;
+}
+
+static int setup(worker_t *w)
+{
+    for (int i = 0; i < w->nconns; i++)
+    {
+        if (conn_open(&w->conns[i], w->epfd) < 0 || send_connect(&w->conns[i]) < 0)
+        {
+            perror("chat-bench: connect");
+            return -1;
+        }
+    }
+    uint64_t deadline = now_ns() + (uint64_t)SETUP_TIMEOUT_MS * 1000000;
+    int acked = 0;
+    while (acked < w->nconns)
+    {
+        if (now_ns() > deadline)
+        {
+            fprintf(stderr, "chat-bench: thread %d: only %d/%d connections registered\n", w->id, acked,
+                    w->nconns);
+            return -1;
+        }
+        poll_events(w, 10);
+        acked = 0;
+        for (int i = 0; i < w->nconns; i++)
+        {
+            conn_t *c = &w->conns[i];
+            if (c->acked < 0)
+            {
+                char name[NAME_LEN];
+                conn_name(c->id, name);
+                fprintf(stderr, "chat-bench: %s rejected: %s\n", name, c->error);
+                return -1;
+            }
+            acked += c->acked;
+        }
+    }
+    if (pattern == PATTERN_ROOM)
+    {
+        for (int i = 0; i < w->nconns; i++)
+        {
+            if (send_join(&w->conns[i]) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = arg;
+    if (setup(w) < 0)
+        setup_failed = 1;
+    pthread_barrier_wait(&setup_done);
+    // main fija start_ns y vuelve a esperar
+    pthread_barrier_wait(&setup_done);
+    if (setup_failed)
+        return NULL;
+
+    double my_rate = rate / nthreads;
+    uint64_t frames = 0; // frames (o lotes) enviados por este thread
+    int next = 0;
+    while (1)
+    {
+        uint64_t now = now_ns();
+        if (now >= stop_ns)
+            break;
+        // los que tocan según la tasa hasta ahora; sin tasa, una ráfaga por vuelta
+        uint64_t due = my_rate > 0 ? (uint64_t)((now - start_ns) / 1e9 * my_rate / batch) : frames + MAX_BURST;
+        int burst = 0;
+        while (frames < due && burst < MAX_BURST)
+        {
+            conn_t *c = &w->conns[next];
+            next = (next + 1) % w->nconns;
+            if (c->tx.len - c->tx.off > MAX_TX_BACKLOG)
+                w->skipped += batch;
+            else if (send_messages(w, c, batch) < 0)
+                return NULL;
+            frames++;
+            burst++;
+        }
+        if (poll_events(w, burst == MAX_BURST ? 0 : 1) < 0)
+            return NULL;
+    }
+
+    // lo que todavía está en vuelo
+    uint64_t drain_end = now_ns() + (uint64_t)DRAIN_MS * 1000000;
+    while (now_ns() < drain_end)
+    {
+        if (poll_events(w, 10) < 0)
+            break;
+    }
+    return NULL;
+}
+
+static const char *pattern_name(int p)
+{
+    return p == PATTERN_PAIR ? "pair" : p == PATTERN_RANDOM ? "random" : "room";
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-H host] [-p port] [-c connections] [-T threads] [-r msgs_per_sec] [-d seconds]\n"
+            "          [-s body_bytes] [-f pair|random|room] [-g room_size] [-v 1|2] [-b batch] [-S seed]\n"
+            "          [-n name_prefix]\n"
+            "  body_bytes: %d to %d with -v 1; with -v 2 up to the server's -m max_body_bytes\n"
+            "  name_prefix: up to %d characters (default bench); scenarios that share a server\n"
+            "               need different prefixes, or the server rejects the repeated names\n",
+            prog, TS_DIGITS, V1_MAX_BODY, MAX_PREFIX);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:T:r:d:s:f:g:v:b:S:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'T':
+            nthreads = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 's':
+            body_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            if (strcmp(optarg, "pair") == 0)
+                pattern = PATTERN_PAIR;
+            else if (strcmp(optarg, "random") == 0)
+                pattern = PATTERN_RANDOM;
+            else if (strcmp(optarg, "room") == 0)
+                pattern = PATTERN_ROOM;
+            else
+                usage(argv[0]);
+            break;
+        case 'g':
+            group_size = atoi(optarg);
+            break;
+        case 'v':
+            version = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            prefix = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || nconns < 2 || nthreads < 1 || nthreads > MAX_THREADS || nthreads > nconns ||
+        (version != 1 && version != 2) || batch < 1 || batch > MAX_BATCH || (version < 2 && batch > 1) ||
+        body_size < TS_DIGITS || (version < 2 && body_size > V1_MAX_BODY) || group_size < 2 ||
+        (pattern == PATTERN_ROOM && batch > 1) || strlen(prefix) > MAX_PREFIX || body_size > UINT32_MAX)
+        usage(argv[0]);
+    // un sendmsg con batch mensajes: prefijo, opcode, orig, count y cada destino con su cuerpo
+    frame_cap = 16 + 2 * NAME_LEN + batch * (NAME_LEN + 8 + body_size + 1);
+
+    // miles de conexiones: subir el límite de descriptores hasta el máximo
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    conn_t *conns = calloc(nconns, sizeof(conn_t));
+    if (workers == NULL || conns == NULL)
+    {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < nconns; i++)
+        conns[i].id = i;
+
+    pthread_barrier_init(&setup_done, NULL, nthreads + 1);
+    int first = 0;
+    for (int t = 0; t < nthreads; t++)
+    {
+        worker_t *w = &workers[t];
+        w->id = t;
+        w->conns = &conns[first];
+        w->nconns = nconns / nthreads + (t < nconns % nthreads);
+        first += w->nconns;
+        w->rng = seed * 0x9E3779B97F4A7C15ull + t + 1;
+        if ((w->frame = malloc(frame_cap)) == NULL || (w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            pthread_create(&w->thread, NULL, worker_main, w) != 0)
+        {
+            perror("chat-bench: worker");
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&setup_done);
+    if (!setup_failed && pattern == PATTERN_ROOM)
+        usleep(JOIN_SETTLE_MS * 1000); // que el servidor procese los room_join
+    start_ns = now_ns();
+    stop_ns = start_ns + (uint64_t)(duration * 1e9);
+    pthread_barrier_wait(&setup_done);
+
+    uint64_t sent = 0, expected = 0, received = 0, skipped = 0, errors = 0, max_ns = 0;
+    uint64_t hist[HIST_BUCKETS] = {0};
+    for (int t = 0; t < nthreads; t++)
+    {
+        worker_t *w = &workers[t];
+        pthread_join(w->thread, NULL);
+        sent += w->sent;
+        expected += w->expected;
+        received += w->received;
+        skipped += w->skipped;
+        errors += w->errors;
+        if (w->max_ns > max_ns)
+            max_ns = w->max_ns;
+        for (int i = 0; i < HIST_BUCKETS; i++)
+            hist[i] += w->hist[i];
+    }
+    if (setup_failed)
+        exit(1);
+
+    printf("chat-bench: %d connections, %d thread(s), pattern %s", nconns, nthreads, pattern_name(pattern));
+    if (pattern == PATTERN_ROOM)
+        printf(" (rooms of %d)", group_size);
+    printf(", protocol v%d, batch %d, body %zu B, target %.0f msgs/s, %.1f s\n", version, batch, body_size, rate,
+           duration);
+    printf("sent      %llu msgs (%.0f msgs/s), %llu skipped for backlog\n", (unsigned long long)sent,
+           sent / duration, (unsigned long long)skipped);
+    printf("received  %llu of %llu deliveries (%.0f msgs/s)\n", (unsigned long long)received,
+           (unsigned long long)expected, received / duration);
+    printf("latency   p50 %.3f ms  p99 %.3f ms  p999 %.3f ms  max %.3f ms\n", hist_quantile(hist, received, max_ns, 0.5),
+           hist_quantile(hist, received, max_ns, 0.99), hist_quantile(hist, received, max_ns, 0.999), max_ns / 1e6);
+    if (errors)
+        printf("errors    %llu\n", (unsigned long long)errors);
+    return 0;
+}
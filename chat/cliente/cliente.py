@@ -45,8 +45,11 @@ def cerrar_conexion(mensaje):
     ventana.destroy()
 
 def construir_trama_conexion(usuario):
-    opcode = 1
-    return struct.pack('!H', opcode) + formatear_string(usuario, MAX_USERNAME_LEN) + b'\x00'
+    # connect_request extendido: version 1, acepta USER_LIST
+    opcode = 10
+    version = 1
+    caps = 0x0001
+    return struct.pack('!HHH', opcode, version, caps) + formatear_string(usuario, MAX_USERNAME_LEN) + b'\x00'
 
 def construir_trama_sendmsg(remitente, destinatario, mensaje):
     opcode = 3
@@ -86,68 +89,119 @@ def enviar_trama_desconexion():
 
 # === Recibir mensajes ===
 def recibir():
+    # TCP no respeta los límites de las tramas: un recv puede traer varias
+    # juntas o una a medias, lo que sobra queda para la próxima vuelta
+    pendiente = b''
     while True:
         try:
             data = cliente.recv(BUFFER_SIZE)
             if not data:
                 cerrar_conexion("El servidor cerró la conexión.")
                 break
-            interpretar_mensaje(data)
+            pendiente += data
+            while True:
+                consumidos = interpretar_mensaje(pendiente)
+                if consumidos == 0:
+                    break
+                pendiente = pendiente[consumidos:]
         except ConnectionResetError:
             cerrar_conexion("Conexión perdida con el servidor.")
             break
         except OSError:
             break
 
-def interpretar_mensaje(data):
+def leer_string(data, offset):
+    """Devuelve (string, offset siguiente) o (None, offset) si falta el '\\0'."""
+    fin = data.find(b'\x00', offset)
+    if fin == -1:
+        return None, offset
+    return data[offset:fin].decode(), fin + 1
+
+def aplicar_evento_usuario(accion, usuario):
     global usuario_seleccionado
+    if usuario == MI_USUARIO:
+        return  # ignorar si soy yo
+
+    if accion == 0:  # conexión
+        if usuario not in usuarios_conectados:
+            usuarios_conectados.append(usuario)
+            mensajes_por_usuario.setdefault(usuario, [])
+            actualizar_lista_usuarios()
+    elif accion == 1:  # desconexión
+        if usuario in usuarios_conectados:
+            usuarios_conectados.remove(usuario)
+            mensajes_por_usuario.pop(usuario, None)
+            if usuario == usuario_seleccionado:
+                limpiar_chat()
+                usuario_seleccionado = None
+            actualizar_lista_usuarios()
+
+def interpretar_mensaje(data):
+    """Procesa la primera trama completa de data y devuelve cuántos bytes
+    ocupaba, o 0 si todavía no llegó entera."""
     if len(data) < 2:
-        return
+        return 0
     opcode = struct.unpack('!H', data[:2])[0]
 
     if opcode == 3:  # mensaje
-        offset = 2
-        fin_rem = data.find(b'\x00', offset)
-        remitente = data[offset:fin_rem].decode()
-        offset = fin_rem + 1
-
-        fin_dest = data.find(b'\x00', offset)
-        destinatario = data[offset:fin_dest].decode()
-        offset = fin_dest + 1
-
-        fin_mensaje = data.find(b'\x00', offset)
-        mensaje = data[offset:fin_mensaje].decode()
+        remitente, offset = leer_string(data, 2)
+        if remitente is None:
+            return 0
+        destinatario, offset = leer_string(data, offset)
+        if destinatario is None:
+            return 0
+        mensaje, offset = leer_string(data, offset)
+        if mensaje is None:
+            return 0
 
         mensajes_por_usuario.setdefault(remitente, []).append(f"{remitente}: {mensaje}")
         if remitente == usuario_seleccionado:
             actualizar_chat()
+        return offset
 
     elif opcode == 8:  # notificación de conexión/desconexión
         if len(data) < 5:
-            return
+            return 0
         accion = struct.unpack('!H', data[2:4])[0]
+        usuario, offset = leer_string(data, 4)
+        if usuario is None:
+            return 0
+        aplicar_evento_usuario(accion, usuario)
+        return offset
+
+    elif opcode == 9:  # lista de eventos de usuario
+        if len(data) < 4:
+            return 0
+        cantidad = struct.unpack('!H', data[2:4])[0]
         offset = 4
-        fin_usuario = data.find(b'\x00', offset)
-        if fin_usuario == -1:
-            return
-        usuario = data[offset:fin_usuario].decode()
-
-        if usuario == MI_USUARIO:
-            return  # ignorar si soy yo
-
-        if accion == 0:  # conexión
-            if usuario not in usuarios_conectados:
-                usuarios_conectados.append(usuario)
-                mensajes_por_usuario.setdefault(usuario, [])
-                actualizar_lista_usuarios()
-        elif accion == 1:  # desconexión
-            if usuario in usuarios_conectados:
-                usuarios_conectados.remove(usuario)
-                mensajes_por_usuario.pop(usuario, None)
-                if usuario == usuario_seleccionado:
-                    limpiar_chat()
-                    usuario_seleccionado = None
-                actualizar_lista_usuarios()
+        eventos = []
+        for _ in range(cantidad):
+            if offset >= len(data):
+                return 0
+            accion = data[offset]
+            usuario, offset = leer_string(data, offset + 1)
+            if usuario is None:
+                return 0
+            eventos.append((accion, usuario))
+        for accion, usuario in eventos:
+            aplicar_evento_usuario(accion, usuario)
+        return offset
+
+    elif opcode == 6:  # error: tras un nombre repetido el servidor cierra; un mensaje descartado no
+        if len(data) < 5:
+            return 0
+        texto, offset = leer_string(data, 4)
+        if texto is None:
+            return 0
+        return offset
+
+    elif opcode == 7:  # ack
+        if len(data) < 4:
+            return 0
+        return 4
+
+    # opcode desconocido: se descarta el opcode
+    return 2
 
 # === GUI ===
 def seleccionar_usuario(evt):
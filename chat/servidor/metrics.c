@@ -0,0 +1,324 @@
+#define _GNU_SOURCE // open_memstream
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+#include "protocol.h"
+#include "registry.h"
+#include "log.h"
+
+#define ADMIN_READ_TIMEOUT_MS 100
+#define ADMIN_BACKOFF_MS 100 // espera antes de reintentar si faltan descriptores o memoria
+
+static _Atomic(metrics_t *) all_metrics = NULL;
+static __thread metrics_t *my_metrics = NULL;
+
+static int admin_fd = -1;
+
+metrics_t *metrics_new(void)
+{
+    metrics_t *m = calloc(1, sizeof(metrics_t));
+    if (m == NULL)
+        return NULL;
+    m->next = atomic_load_explicit(&all_metrics, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&all_metrics, &m->next, m, memory_order_release,
+                                                  memory_order_relaxed))
+        ;
+    return m;
+}
+
+void metrics_bind(metrics_t *m)
+{
+    my_metrics = m;
+}
+
+metrics_t *metrics_self(void)
+{
+    return my_metrics;
+}
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v)
+{
+    if (v < (1u << HIST_SUB_BITS))
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    int shift = e - HIST_SUB_BITS;
+    int idx = (shift + 1) * (1 << HIST_SUB_BITS) + (int)((v >> shift) & ((1 << HIST_SUB_BITS) - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// mayor valor que cae en el bucket idx
+static uint64_t hist_upper(int idx)
+{
+    int sub = 1 << HIST_SUB_BITS;
+    if (idx < sub)
+        return idx;
+    int shift = idx / sub - 1;
+    uint64_t lower = (uint64_t)(sub + idx % sub) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+void hist_record(hist_t *h, uint64_t ns)
+{
+    counter_add(&h->buckets[hist_index(ns)], 1);
+    counter_add(&h->count, 1);
+    counter_add(&h->sum, ns);
+}
+
+static void add(_Atomic uint64_t *dst, _Atomic uint64_t *src)
+{
+    counter_add(dst, atomic_load_explicit(src, memory_order_relaxed));
+}
+
+static void hist_add(hist_t *dst, hist_t *src)
+{
+    add(&dst->count, &src->count);
+    add(&dst->sum, &src->sum);
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        add(&dst->buckets[i], &src->buckets[i]);
+}
+
+static void metrics_add(metrics_t *dst, metrics_t *src)
+{
+    for (int i = 0; i < METRICS_OPCODES; i++)
+        add(&dst->frames_in[i], &src->frames_in[i]);
+    add(&dst->bytes_in, &src->bytes_in);
+    add(&dst->bytes_out, &src->bytes_out);
+    add(&dst->forwarded, &src->forwarded);
+    add(&dst->stored, &src->stored);
+    add(&dst->dropped, &src->dropped);
+    add(&dst->room_posts, &src->room_posts);
+    add(&dst->slow_consumers, &src->slow_consumers);
+    hist_add(&dst->forward_latency, &src->forward_latency);
+    for (int i = RWLOCK_READ; i <= RWLOCK_WRITE; i++)
+    {
+        hist_add(&dst->lock_wait[i], &src->lock_wait[i]);
+        hist_add(&dst->lock_hold[i], &src->lock_hold[i]);
+    }
+}
+
+// foto de la suma de todos los threads; cada valor se lee sin frenar a nadie
+static void aggregate(metrics_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    for (metrics_t *m = atomic_load_explicit(&all_metrics, memory_order_acquire); m; m = m->next)
+        metrics_add(out, m);
+}
+
+static double hist_quantile(hist_t *h, double q)
+{
+    uint64_t count = atomic_load(&h->count);
+    if (count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * count);
+    if (rank >= count)
+        rank = count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += atomic_load(&h->buckets[i]);
+        if (seen > rank)
+            return hist_upper(i) / 1e9;
+    }
+    return hist_upper(HIST_BUCKETS - 1) / 1e9;
+}
+
+static void write_summary(FILE *f, const char *name, const char *labels, hist_t *h)
+{
+    static const double qs[] = {0.5, 0.9, 0.99, 0.999};
+    const char *sep = labels[0] ? "," : "";
+    for (size_t i = 0; i < sizeof(qs) / sizeof(qs[0]); i++)
+        fprintf(f, "%s{%s%squantile=\"%g\"} %.9g\n", name, labels, sep, qs[i], hist_quantile(h, qs[i]));
+    fprintf(f, "%s_sum%s%s%s %.9g\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+            atomic_load(&h->sum) / 1e9);
+    fprintf(f, "%s_count%s%s%s %llu\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+            (unsigned long long)atomic_load(&h->count));
+}
+
+static void write_counter(FILE *f, const char *name, const char *help, uint64_t v)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long)v);
+}
+
+static const char *opcode_name(int op)
+{
+    switch (op)
+    {
+    case OPCODE_CONNECT:
+        return "connect";
+    case OPCODE_SENDMSG:
+        return "sendmsg";
+    case OPCODE_ROOM_JOIN:
+        return "room_join";
+    case OPCODE_ROOM_LEAVE:
+        return "room_leave";
+    case OPCODE_USER_EVENT:
+        return "user_event";
+    case OPCODE_CONNECT_EXT:
+        return "connect_ext";
+    case OPCODE_ROOM_MSG:
+        return "room_msg";
+    case 0:
+        return "unknown";
+    default:
+        return NULL; // opcodes que sólo manda el servidor
+    }
+}
+
+static void render(FILE *f, metrics_t *m)
+{
+    fprintf(f, "# HELP chat_frames_received_total Frames received from clients, by opcode.\n"
+               "# TYPE chat_frames_received_total counter\n");
+    for (int op = 0; op < METRICS_OPCODES; op++)
+    {
+        const char *name = opcode_name(op);
+        if (name)
+            fprintf(f, "chat_frames_received_total{opcode=\"%s\"} %llu\n", name,
+                    (unsigned long long)m->frames_in[op]);
+    }
+
+    fprintf(f, "# HELP chat_connected_users Users currently registered.\n"
+               "# TYPE chat_connected_users gauge\nchat_connected_users %zu\n", registry_count());
+    write_counter(f, "chat_received_bytes_total", "Bytes read from client sockets.", m->bytes_in);
+    write_counter(f, "chat_sent_bytes_total", "Bytes written to client sockets.", m->bytes_out);
+    write_counter(f, "chat_messages_forwarded_total", "Direct messages handed to a connected user.",
+                  m->forwarded);
+    write_counter(f, "chat_messages_stored_total", "Direct messages stored for an offline user.", m->stored);
+    write_counter(f, "chat_messages_dropped_total",
+                  "Direct messages dropped: unknown user, store failure or too large for v1.", m->dropped);
+    write_counter(f, "chat_room_posts_total", "Room messages fanned out.", m->room_posts);
+    write_counter(f, "chat_slow_consumer_disconnects_total", "Clients dropped for exceeding their queue budget.",
+                  m->slow_consumers);
+    write_counter(f, "chat_log_records_dropped_total", "Log records dropped because a ring was full.",
+                  log_dropped());
+
+    fprintf(f, "# HELP chat_forward_latency_seconds Time from recv() to handing a message to its destination.\n"
+               "# TYPE chat_forward_latency_seconds summary\n");
+    write_summary(f, "chat_forward_latency_seconds", "", &m->forward_latency);
+
+    static const char *modes[] = {"mode=\"read\"", "mode=\"write\""};
+    fprintf(f, "# HELP chat_registry_lock_wait_seconds Time spent waiting for the registry lock.\n"
+               "# TYPE chat_registry_lock_wait_seconds summary\n");
+    for (int i = RWLOCK_READ; i <= RWLOCK_WRITE; i++)
+        write_summary(f, "chat_registry_lock_wait_seconds", modes[i], &m->lock_wait[i]);
+    fprintf(f, "# HELP chat_registry_lock_hold_seconds Time the registry lock was held.\n"
+               "# TYPE chat_registry_lock_hold_seconds summary\n");
+    for (int i = RWLOCK_READ; i <= RWLOCK_WRITE; i++)
+        write_summary(f, "chat_registry_lock_hold_seconds", modes[i], &m->lock_hold[i]);
+}
+
+static void write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t w = send(fd, data, len, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return;
+        data += w;
+        len -= w;
+    }
+}
+
+static void serve_one(int fd)
+{
+    // un scraper HTTP manda su pedido primero; un socat no manda nada
+    char req[4] = {0};
+    struct pollfd p = {fd, POLLIN, 0};
+    int http = poll(&p, 1, ADMIN_READ_TIMEOUT_MS) > 0 && recv(fd, req, sizeof(req), 0) == 4 &&
+               memcmp(req, "GET ", 4) == 0;
+
+    metrics_t *snap = malloc(sizeof(metrics_t));
+    char *body = NULL;
+    size_t len = 0;
+    FILE *f = snap ? open_memstream(&body, &len) : NULL;
+    if (f == NULL)
+    {
+        free(snap);
+        return;
+    }
+    aggregate(snap);
+    render(f, snap);
+    fclose(f);
+    free(snap);
+
+    if (http)
+    {
+        char hdr[128];
+        int n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                           "Content-Length: %zu\r\n\r\n", len);
+        write_all(fd, hdr, n);
+    }
+    write_all(fd, body, len);
+    free(body);
+}
+
+static void *admin_thread(void *arg)
+{
+    metrics_bind(arg); // registry_count toma el lock del registro
+    while (1)
+    {
+        int fd = accept4(admin_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            log_error("admin accept: %s", strerror(errno));
+            /* Sin descriptores la conexión sigue en la cola y accept vuelve a
+             * fallar enseguida: se espera un poco en vez de girar. */
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                poll(NULL, 0, ADMIN_BACKOFF_MS);
+            continue;
+        }
+        serve_one(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_serve(const char *path)
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    // el de una corrida anterior; cualquier otra cosa en path hace fallar el bind
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    if ((admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (bind(admin_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(admin_fd, 16) < 0)
+        return -1;
+
+    metrics_t *m = metrics_new();
+    if (m == NULL)
+        return -1;
+    pthread_t t;
+    if (pthread_create(&t, NULL, admin_thread, m) != 0)
+        return -1;
+    pthread_detach(t);
+    return 0;
+}
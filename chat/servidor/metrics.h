@@ -0,0 +1,67 @@
+#ifndef CHAT_METRICS_H
+#define CHAT_METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Métricas del servidor. Cada thread escribe en su propio metrics_t, sin
+ * locks ni operaciones atómicas de lectura-modificación: un load y un store
+ * relaxed, porque hay un solo escritor. El thread de administración suma
+ * los de todos al leer y los sirve en formato de texto de Prometheus por un
+ * socket Unix, sin tocar el camino de los datos. */
+
+#define METRICS_OPCODES 16 // índice = opcode; 0 junta los desconocidos
+
+/* Histograma log-lineal estilo HDR: 8 sub-buckets por potencia de 2, o sea
+ * ~12% de error relativo, de 1 ns a ~78 horas (2^48 ns). */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS 368
+
+typedef struct
+{
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum; // ns
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+#define RWLOCK_READ 0
+#define RWLOCK_WRITE 1
+
+typedef struct metrics
+{
+    struct metrics *next; // lista de todos los threads; sólo se agregan
+    _Atomic uint64_t frames_in[METRICS_OPCODES];
+    _Atomic uint64_t bytes_in, bytes_out;
+    _Atomic uint64_t forwarded, stored, dropped;
+    _Atomic uint64_t room_posts;
+    _Atomic uint64_t slow_consumers;
+    hist_t forward_latency; // del recv a entregar el mensaje al destino
+    hist_t lock_wait[2];    // registro, por modo (RWLOCK_READ/RWLOCK_WRITE)
+    hist_t lock_hold[2];
+} metrics_t;
+
+/* Crea las métricas de un thread y las suma a la lista; NULL si no hay
+ * memoria. Se piden al arrancar, para que el servidor no empiece sin ellas, y
+ * el thread las adopta con metrics_bind antes de tocar cualquier contador. */
+metrics_t *metrics_new(void);
+void metrics_bind(metrics_t *m);
+
+// las métricas del thread que llama, las que adoptó con metrics_bind
+metrics_t *metrics_self(void);
+
+static inline void counter_add(_Atomic uint64_t *c, uint64_t n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void hist_record(hist_t *h, uint64_t ns);
+
+uint64_t metrics_now_ns(void);
+
+/* Abre el socket de administración en path y arranca el thread que lo
+ * atiende. Cada conexión recibe una foto de las métricas y se cierra; si
+ * empieza con "GET " la respuesta va como HTTP, para scrapear con
+ * curl --unix-socket. */
+int metrics_serve(const char *path);
+
+#endif
@@ -0,0 +1,36 @@
+#include <stddef.h>
+
+#include "mpsc.h"
+
+void mpsc_init(mpsc_queue_t *q)
+{
+    atomic_init(&q->head, NULL);
+}
+
+int mpsc_push(mpsc_queue_t *q, mpsc_node_t *n)
+{
+    mpsc_node_t *old = atomic_load_explicit(&q->head, memory_order_relaxed);
+    do
+    {
+        n->next = old;
+    } while (!atomic_compare_exchange_weak_explicit(&q->head, &old, n,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    return old == NULL;
+}
+
+mpsc_node_t *mpsc_take_all(mpsc_queue_t *q)
+{
+    mpsc_node_t *n = atomic_exchange_explicit(&q->head, NULL, memory_order_acquire);
+
+    // la pila está en orden inverso al de llegada
+    mpsc_node_t *fifo = NULL;
+    while (n)
+    {
+        mpsc_node_t *next = n->next;
+        n->next = fifo;
+        fifo = n;
+        n = next;
+    }
+    return fifo;
+}
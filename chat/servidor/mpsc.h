@@ -0,0 +1,29 @@
+#ifndef CHAT_MPSC_H
+#define CHAT_MPSC_H
+
+#include <stdatomic.h>
+
+/* Cola lock-free de muchos productores y un consumidor. Los productores
+ * apilan con CAS; el consumidor se lleva toda la pila de una vez con un
+ * exchange y la invierte para recuperar el orden de llegada. */
+
+typedef struct mpsc_node
+{
+    struct mpsc_node *next;
+} mpsc_node_t;
+
+typedef struct
+{
+    _Atomic(mpsc_node_t *) head;
+} mpsc_queue_t;
+
+void mpsc_init(mpsc_queue_t *q);
+
+/* Devuelve 1 si la cola estaba vacía: el productor que la llenó es el que
+ * tiene que despertar al consumidor. */
+int mpsc_push(mpsc_queue_t *q, mpsc_node_t *n);
+
+// saca todos los nodos en orden FIFO, NULL si no había ninguno
+mpsc_node_t *mpsc_take_all(mpsc_queue_t *q);
+
+#endif
@@ -0,0 +1,739 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "offline.h"
+#include "log.h"
+
+#define OFFLINE_MAGIC 0x4e4c464fu // "OFLN"
+#define COMPACT_INTERVAL_MS 1000
+#define COMPACT_LIVE_RATIO 4 // se compacta si lo vivo es menos de 1/4
+#define PENDING_BUCKETS_MIN 16
+#define EXPIRE_INTERVAL_S 60
+
+/* Registro en el log: cabecera + frame, alineado a 8. magic se escribe
+ * último, así un registro a medias no se lee al recuperar. consumed es lo
+ * único que se modifica en el lugar, al entregarlo. version es la del
+ * frame guardado; los logs anteriores a v2 la tienen en 0. */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t len; // largo del frame
+    uint64_t seq; // orden de llegada; se conserva al compactar
+    uint32_t consumed;
+    char dest[NAME_LEN];
+    uint32_t version;
+} record_hdr_t;
+
+typedef struct
+{
+    uint32_t id;
+    int fd;
+    unsigned char *map;
+    size_t size; // OFFLINE_SEGMENT_SIZE, o más si lo abrió un mensaje que no entraba
+    size_t used;
+    size_t live;       // registros sin entregar
+    size_t live_bytes;
+    int sealed;        // lleno, ya no se escribe
+} segment_t;
+
+typedef struct
+{
+    segment_t *seg;
+    size_t off;
+    /* Cuándo vence, en segundos de CLOCK_MONOTONIC. No está en el log: al
+     * recuperarlo el plazo empieza de nuevo. */
+    uint64_t expires_s;
+} loc_t;
+
+// mensajes pendientes de un usuario, en orden de llegada
+typedef struct pending
+{
+    struct pending *next;
+    char name[NAME_LEN];
+    loc_t *locs;
+    size_t count, cap;
+    size_t bytes; // lo que ocupan en el log, para OFFLINE_USER_BYTES
+} pending_t;
+
+// mensajes sacados por offline_take que esperan que el reenvío se escriba
+struct offline_ticket
+{
+    char name[NAME_LEN];
+    loc_t *locs;
+    size_t count;
+};
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+
+static char store_dir[PATH_MAX];
+
+static segment_t **segs = NULL; // por id creciente, el último es el activo
+static size_t nsegs = 0, segs_cap = 0;
+static uint64_t next_seq = 1;
+
+static pending_t **buckets = NULL;
+static size_t nbuckets = 0, nusers = 0;
+static size_t stored_bytes = 0; // registros sin entregar, para OFFLINE_MAX_BYTES
+
+static uint64_t now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// FNV-1a
+static uint32_t hash_name(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static size_t record_size(size_t len)
+{
+    return (sizeof(record_hdr_t) + len + 7) & ~(size_t)7;
+}
+
+static record_hdr_t *record_at(loc_t l)
+{
+    return (record_hdr_t *)(l.seg->map + l.off);
+}
+
+static void segment_path(char *out, size_t n, uint32_t id)
+{
+    snprintf(out, n, "%s/seg-%08u.log", store_dir, id);
+}
+
+// size sólo se usa al crearlo; uno existente se abre con el tamaño que tiene
+static segment_t *segment_open(uint32_t id, int create, size_t size)
+{
+    char path[PATH_MAX + 32];
+    segment_path(path, sizeof(path), id);
+
+    segment_t *s = calloc(1, sizeof(segment_t));
+    if (s == NULL)
+        return NULL;
+    s->id = id;
+    s->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0600);
+    if (s->fd < 0)
+        goto fail;
+    // lo no escrito son ceros
+    struct stat st;
+    if (create ? ftruncate(s->fd, size) < 0 : fstat(s->fd, &st) < 0)
+        goto fail;
+    s->size = create ? size : (size_t)st.st_size;
+    s->map = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (s->map == MAP_FAILED)
+        goto fail;
+    return s;
+
+fail:
+    if (s->fd >= 0)
+        close(s->fd);
+    free(s);
+    return NULL;
+}
+
+static void segment_destroy(segment_t *s)
+{
+    char path[PATH_MAX + 32];
+    segment_path(path, sizeof(path), s->id);
+    munmap(s->map, s->size);
+    close(s->fd);
+    unlink(path);
+    free(s);
+}
+
+static int segs_push(segment_t *s)
+{
+    if (nsegs == segs_cap)
+    {
+        size_t cap = segs_cap ? segs_cap * 2 : 8;
+        segment_t **tmp = realloc(segs, cap * sizeof(segment_t *));
+        if (tmp == NULL)
+            return -1;
+        segs = tmp;
+        segs_cap = cap;
+    }
+    segs[nsegs++] = s;
+    return 0;
+}
+
+/* Segmento con lugar para need bytes; sella el activo si no le entra. Un
+ * registro más grande que OFFLINE_SEGMENT_SIZE abre uno a su medida, así el
+ * límite es el de los frames (-m) y no el del log. */
+static segment_t *active_segment(size_t need)
+{
+    segment_t *s = nsegs ? segs[nsegs - 1] : NULL;
+    if (s && s->used + need <= s->size)
+        return s;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = need > OFFLINE_SEGMENT_SIZE ? (need + page - 1) & ~(page - 1) : OFFLINE_SEGMENT_SIZE;
+    segment_t *n = segment_open(s ? s->id + 1 : 1, 1, size);
+    if (n == NULL)
+        return NULL;
+    if (segs_push(n) < 0)
+    {
+        segment_destroy(n);
+        return NULL;
+    }
+    if (s)
+    {
+        // que el kernel empiece a escribirlo, sin esperar
+        msync(s->map, s->used, MS_ASYNC);
+        s->sealed = 1;
+        if (s->live == 0)
+            pthread_cond_signal(&compact_cond);
+    }
+    return n;
+}
+
+static int write_record(const char *dest, uint64_t seq, const void *frame, size_t len, int version,
+                        loc_t *out)
+{
+    size_t size = record_size(len);
+    segment_t *s = active_segment(size);
+    if (s == NULL)
+        return -1;
+
+    record_hdr_t *h = (record_hdr_t *)(s->map + s->used);
+    h->len = len;
+    h->seq = seq;
+    h->consumed = 0;
+    h->version = version;
+    strncpy(h->dest, dest, NAME_LEN - 1);
+    memcpy(h + 1, frame, len);
+    __atomic_store_n(&h->magic, OFFLINE_MAGIC, __ATOMIC_RELEASE);
+
+    out->seg = s;
+    out->off = s->used;
+    s->used += size;
+    s->live++;
+    s->live_bytes += size;
+    stored_bytes += size;
+    return 0;
+}
+
+// marca el registro como entregado
+static void consume(loc_t l)
+{
+    record_hdr_t *h = record_at(l);
+    h->consumed = 1;
+    l.seg->live--;
+    l.seg->live_bytes -= record_size(h->len);
+    stored_bytes -= record_size(h->len);
+    if (l.seg->sealed && l.seg->live == 0)
+        pthread_cond_signal(&compact_cond);
+}
+
+static pending_t *pending_find(const char *name, pending_t ***link_out)
+{
+    if (nbuckets == 0)
+        return NULL;
+    pending_t **link = &buckets[hash_name(name) & (nbuckets - 1)];
+    for (; *link; link = &(*link)->next)
+    {
+        if (strcmp((*link)->name, name) == 0)
+        {
+            if (link_out)
+                *link_out = link;
+            return *link;
+        }
+    }
+    return NULL;
+}
+
+static int rehash(size_t n)
+{
+    pending_t **tmp = calloc(n, sizeof(pending_t *));
+    if (tmp == NULL)
+        return -1;
+    for (size_t i = 0; i < nbuckets; i++)
+    {
+        pending_t *p = buckets[i];
+        while (p)
+        {
+            pending_t *next = p->next;
+            size_t b = hash_name(p->name) & (n - 1);
+            p->next = tmp[b];
+            tmp[b] = p;
+            p = next;
+        }
+    }
+    free(buckets);
+    buckets = tmp;
+    nbuckets = n;
+    return 0;
+}
+
+static pending_t *pending_get(const char *name)
+{
+    pending_t *p = pending_find(name, NULL);
+    if (p)
+        return p;
+    if (nusers >= nbuckets && rehash(nbuckets ? nbuckets * 2 : PENDING_BUCKETS_MIN) < 0)
+        return NULL;
+    if ((p = calloc(1, sizeof(pending_t))) == NULL)
+        return NULL;
+    strncpy(p->name, name, NAME_LEN - 1);
+    size_t b = hash_name(p->name) & (nbuckets - 1);
+    p->next = buckets[b];
+    buckets[b] = p;
+    nusers++;
+    return p;
+}
+
+static int pending_push(pending_t *p, loc_t l)
+{
+    if (p->count == p->cap)
+    {
+        size_t cap = p->cap ? p->cap * 2 : 8;
+        loc_t *tmp = realloc(p->locs, cap * sizeof(loc_t));
+        if (tmp == NULL)
+            return -1;
+        p->locs = tmp;
+        p->cap = cap;
+    }
+    p->locs[p->count++] = l;
+    p->bytes += record_size(record_at(l)->len);
+    return 0;
+}
+
+static void pending_drop(pending_t **link)
+{
+    pending_t *p = *link;
+    *link = p->next;
+    nusers--;
+    free(p->locs);
+    free(p);
+}
+
+int offline_append(const char *dest, const void *frame, size_t len, int version, conn_ref_t *online)
+{
+    pthread_mutex_lock(&store_lock);
+    /* Se vuelve a mirar el registro con el lock tomado: offline_take corre
+     * después de registry_add, así que o lo ve conectado acá o el take
+     * encuentra este mensaje. */
+    if (registry_lookup(dest, online) == 0)
+    {
+        pthread_mutex_unlock(&store_lock);
+        return 1;
+    }
+
+    int res = -1;
+    loc_t l;
+    pending_t *p = pending_find(dest, NULL);
+    size_t size = record_size(len);
+    if ((p ? p->bytes : 0) + size > OFFLINE_USER_BYTES || stored_bytes + size > OFFLINE_MAX_BYTES)
+        res = OFFLINE_FULL;
+    else if ((p = pending_get(dest)) != NULL && write_record(dest, next_seq, frame, len, version, &l) == 0)
+    {
+        next_seq++;
+        l.expires_s = now_s() + OFFLINE_TTL_S;
+        if (pending_push(p, l) == 0)
+            res = 0;
+        else
+            consume(l);
+    }
+    pthread_mutex_unlock(&store_lock);
+    return res;
+}
+
+static int record_version(const record_hdr_t *h)
+{
+    return h->version >= PROTOCOL_V2 ? PROTOCOL_V2 : PROTOCOL_V1;
+}
+
+msgbuf_t *offline_take(const char *username, int version, offline_ticket_t **ticket)
+{
+    pthread_mutex_lock(&store_lock);
+    pending_t **link;
+    pending_t *p = pending_find(username, &link);
+    if (p == NULL)
+    {
+        pthread_mutex_unlock(&store_lock);
+        return NULL;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < p->count; i++)
+    {
+        record_hdr_t *h = record_at(p->locs[i]);
+        total += h->len + (record_version(h) == version ? 0 : REENCODE_SLACK);
+    }
+    size_t kept = 0, dropped = 0;
+    msgbuf_t *b = msgbuf_alloc(total);
+    offline_ticket_t *t = calloc(1, sizeof(offline_ticket_t));
+    if (t)
+        t->locs = malloc(p->count * sizeof(loc_t));
+    if (b == NULL || t == NULL || t->locs == NULL)
+    {
+        pthread_mutex_unlock(&store_lock);
+        if (b)
+            msgbuf_release(b);
+        if (t)
+            free(t->locs);
+        free(t);
+        return NULL;
+    }
+    strncpy(t->name, username, NAME_LEN - 1);
+    for (size_t i = 0; i < p->count; i++)
+    {
+        record_hdr_t *h = record_at(p->locs[i]);
+        // guardado en la versión de quien lo mandó; se adapta a la del que lo recibe
+        size_t n = reencode_msg_frame(b->data + b->len, version, (const unsigned char *)(h + 1),
+                                      h->len, record_version(h));
+        // uno v2 que no entra en v1 queda guardado hasta que se conecte con v2
+        if (n == 0 && record_version(h) > version)
+        {
+            p->locs[kept++] = p->locs[i];
+            continue;
+        }
+        p->bytes -= record_size(h->len);
+        if (n == 0)
+        {
+            dropped++;
+            consume(p->locs[i]);
+            continue;
+        }
+        b->len += n;
+        t->locs[t->count++] = p->locs[i];
+    }
+    p->count = kept;
+    if (kept == 0)
+        pending_drop(link);
+    pthread_mutex_unlock(&store_lock);
+    if (kept > 0)
+        log_info("Offline: %zu message(s) for '%s' need protocol v2, kept", kept, username);
+    if (dropped > 0)
+        log_warn("Offline: %zu unreadable message(s) for '%s', dropped", dropped, username);
+    // ninguno entraba en la versión del cliente
+    if (b->len == 0)
+    {
+        msgbuf_release(b);
+        offline_commit(t);
+        return NULL;
+    }
+    *ticket = t;
+    return b;
+}
+
+void offline_commit(offline_ticket_t *t)
+{
+    pthread_mutex_lock(&store_lock);
+    for (size_t i = 0; i < t->count; i++)
+        consume(t->locs[i]);
+    pthread_mutex_unlock(&store_lock);
+    free(t->locs);
+    free(t);
+}
+
+void offline_abort(offline_ticket_t *t)
+{
+    pthread_mutex_lock(&store_lock);
+    // van antes de lo que haya llegado mientras tanto, que es más nuevo
+    pending_t *p = pending_get(t->name);
+    loc_t *tmp = p ? realloc(p->locs, (p->count + t->count) * sizeof(loc_t)) : NULL;
+    if (tmp)
+    {
+        memmove(tmp + t->count, tmp, p->count * sizeof(loc_t));
+        memcpy(tmp, t->locs, t->count * sizeof(loc_t));
+        p->locs = tmp;
+        p->count += t->count;
+        p->cap = p->count;
+        for (size_t i = 0; i < t->count; i++)
+            p->bytes += record_size(record_at(t->locs[i])->len);
+    }
+    else
+    {
+        // siguen sin consumir en el log: vuelven al reiniciar
+        if (p && p->count == 0)
+        {
+            pending_t **link;
+            pending_find(t->name, &link);
+            pending_drop(link);
+        }
+        log_warn("Offline: no memory to keep %zu message(s) for '%s' until restart", t->count, t->name);
+    }
+    pthread_mutex_unlock(&store_lock);
+    free(t->locs);
+    free(t);
+}
+
+// descarta los vencidos de cada usuario; los de un usuario están en orden de llegada
+static void expire_pending(void)
+{
+    uint64_t now = now_s();
+    size_t expired = 0;
+    for (size_t i = 0; i < nbuckets; i++)
+    {
+        pending_t **link = &buckets[i];
+        while (*link)
+        {
+            pending_t *p = *link;
+            size_t n = 0;
+            while (n < p->count && p->locs[n].expires_s <= now)
+            {
+                p->bytes -= record_size(record_at(p->locs[n])->len);
+                consume(p->locs[n++]);
+            }
+            expired += n;
+            memmove(p->locs, p->locs + n, (p->count - n) * sizeof(loc_t));
+            p->count -= n;
+            if (p->count == 0)
+                pending_drop(link);
+            else
+                link = &p->next;
+        }
+    }
+    if (expired > 0)
+        log_info("Offline: %zu message(s) expired", expired);
+}
+
+// saca el segmento de la lista y lo borra del disco
+static void remove_segment(size_t i)
+{
+    segment_t *s = segs[i];
+    memmove(&segs[i], &segs[i + 1], (nsegs - i - 1) * sizeof(segment_t *));
+    nsegs--;
+    segment_destroy(s);
+}
+
+/* Copia los registros vivos del segmento al activo y actualiza el índice.
+ * Suelta el lock entre registro y registro para no frenar a los reactores;
+ * sólo este hilo borra segmentos, así que s sigue mapeado. */
+static void compact_segment(segment_t *s)
+{
+    size_t used = s->used;
+    for (size_t off = 0; off < used && s->live > 0;)
+    {
+        loc_t old = {s, off};
+        record_hdr_t *h = record_at(old);
+        off += record_size(h->len);
+        if (h->consumed)
+            continue;
+
+        pending_t *p = pending_find(h->dest, NULL);
+        size_t i = 0;
+        while (p && i < p->count && (p->locs[i].seg != s || p->locs[i].off != old.off))
+            i++;
+        loc_t moved;
+        if (p == NULL || i == p->count ||
+            write_record(h->dest, h->seq, h + 1, h->len, h->version, &moved) < 0)
+            return;
+        moved.expires_s = p->locs[i].expires_s;
+        p->locs[i] = moved;
+        consume(old);
+
+        pthread_mutex_unlock(&store_lock);
+        pthread_mutex_lock(&store_lock);
+    }
+}
+
+static void *compactor_thread(void *arg)
+{
+    (void)arg;
+    uint64_t next_expire = now_s() + EXPIRE_INTERVAL_S;
+    pthread_mutex_lock(&store_lock);
+    for (;;)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += COMPACT_INTERVAL_MS / 1000;
+        ts.tv_nsec += (COMPACT_INTERVAL_MS % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&compact_cond, &store_lock, &ts);
+
+        if (now_s() >= next_expire)
+        {
+            expire_pending();
+            next_expire = now_s() + EXPIRE_INTERVAL_S;
+        }
+
+        // los sellados sin nada vivo se borran enteros
+        for (size_t i = 0; i < nsegs;)
+        {
+            if (segs[i]->sealed && segs[i]->live == 0)
+                remove_segment(i);
+            else
+                i++;
+        }
+
+        // y el sellado más vacío se compacta si vale la pena
+        segment_t *victim = NULL;
+        for (size_t i = 0; i < nsegs; i++)
+        {
+            segment_t *s = segs[i];
+            if (s->sealed && s->live_bytes * COMPACT_LIVE_RATIO < s->used &&
+                (victim == NULL || s->live_bytes < victim->live_bytes))
+                victim = s;
+        }
+        if (victim)
+        {
+            compact_segment(victim);
+            log_info("Offline: compacted segment %u (%zu messages left)", victim->id, victim->live);
+        }
+    }
+    return NULL;
+}
+
+static int cmp_id(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_seq(const void *a, const void *b)
+{
+    uint64_t x = record_at(*(const loc_t *)a)->seq;
+    uint64_t y = record_at(*(const loc_t *)b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+// recorre un segmento existente y carga sus registros vivos en el índice
+static int load_segment(segment_t *s)
+{
+    size_t off = 0;
+    while (off + sizeof(record_hdr_t) <= s->size)
+    {
+        record_hdr_t *h = (record_hdr_t *)(s->map + off);
+        if (h->magic != OFFLINE_MAGIC || off + record_size(h->len) > s->size)
+            break;
+        h->dest[NAME_LEN - 1] = '\0';
+        size_t size = record_size(h->len);
+        if (!h->consumed)
+        {
+            loc_t l = {s, off, now_s() + OFFLINE_TTL_S};
+            pending_t *p = pending_get(h->dest);
+            if (p == NULL || pending_push(p, l) < 0)
+                return -1;
+            s->live++;
+            s->live_bytes += size;
+            stored_bytes += size;
+        }
+        if (h->seq >= next_seq)
+            next_seq = h->seq + 1;
+        off += size;
+    }
+    s->used = off;
+    return 0;
+}
+
+// ordena los pendientes de cada usuario; un corte a mitad de compactar deja duplicados
+static void sort_pending(void)
+{
+    for (size_t b = 0; b < nbuckets; b++)
+    {
+        for (pending_t *p = buckets[b]; p; p = p->next)
+        {
+            qsort(p->locs, p->count, sizeof(loc_t), cmp_seq);
+            size_t n = 0;
+            for (size_t i = 0; i < p->count; i++)
+            {
+                if (n > 0 && record_at(p->locs[i])->seq == record_at(p->locs[n - 1])->seq)
+                {
+                    p->bytes -= record_size(record_at(p->locs[i])->len);
+                    consume(p->locs[i]);
+                }
+                else
+                    p->locs[n++] = p->locs[i];
+            }
+            p->count = n;
+        }
+    }
+}
+
+static int load_segments(void)
+{
+    DIR *d = opendir(store_dir);
+    if (d == NULL)
+        return -1;
+    uint32_t *ids = NULL;
+    size_t nids = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+    {
+        uint32_t id;
+        char tail;
+        if (sscanf(e->d_name, "seg-%8u.lo%c", &id, &tail) != 2 || tail != 'g')
+            continue;
+        if (nids == cap)
+        {
+            cap = cap ? cap * 2 : 16;
+            uint32_t *tmp = realloc(ids, cap * sizeof(uint32_t));
+            if (tmp == NULL)
+                goto fail;
+            ids = tmp;
+        }
+        ids[nids++] = id;
+    }
+    closedir(d);
+    d = NULL;
+
+    qsort(ids, nids, sizeof(uint32_t), cmp_id);
+    for (size_t i = 0; i < nids; i++)
+    {
+        segment_t *s = segment_open(ids[i], 0, 0);
+        if (s == NULL || segs_push(s) < 0 || load_segment(s) < 0)
+            goto fail;
+        s->sealed = i + 1 < nids;
+    }
+    free(ids);
+    sort_pending();
+    return 0;
+
+fail:
+    if (d)
+        closedir(d);
+    free(ids);
+    return -1;
+}
+
+int offline_init(const char *dir)
+{
+    if (strlen(dir) >= sizeof(store_dir))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(store_dir, dir);
+    if (mkdir(store_dir, 0700) < 0 && errno != EEXIST)
+        return -1;
+    if (load_segments() < 0)
+        return -1;
+
+    size_t stored = 0;
+    for (size_t i = 0; i < nsegs; i++)
+        stored += segs[i]->live;
+    log_info("Offline: %zu pending message(s) for %zu user(s) in %zu segment(s) at %s",
+             stored, nusers, nsegs, store_dir);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, compactor_thread, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef CHAT_OFFLINE_H
+#define CHAT_OFFLINE_H
+
+#include <stddef.h>
+
+#include "outqueue.h"
+#include "registry.h"
+
+/* Mensajes para usuarios desconectados. Se agregan al final de un log de
+ * segmentos mapeados en memoria (sin fsync por mensaje: el kernel baja las
+ * páginas a disco) y un índice en memoria guarda, por usuario, dónde está
+ * cada uno. Al reconectarse se le entregan todos juntos. Un hilo compacta
+ * en segundo plano los segmentos que quedaron casi vacíos. */
+
+// un mensaje más grande va en un segmento a su medida
+#define OFFLINE_SEGMENT_SIZE (4 * 1024 * 1024)
+
+/* Límites para que mensajes a nombres que nunca se conectan no llenen el
+ * disco: lo guardado para un usuario, lo guardado en total y cuánto espera
+ * un mensaje antes de descartarse. */
+#define OFFLINE_USER_BYTES (64 * 1024 * 1024)
+#define OFFLINE_MAX_BYTES ((size_t)1024 * 1024 * 1024)
+#define OFFLINE_TTL_S (7 * 24 * 3600)
+
+// offline_append: no se guardó porque se pasaba de un límite
+#define OFFLINE_FULL -2
+
+typedef struct offline_ticket offline_ticket_t;
+
+// abre (o crea) el log en dir, reconstruye el índice y arranca el compactador
+int offline_init(const char *dir);
+
+/* Guarda el frame (un sendmsg de la versión dada) para dest. Si dest se
+ * conectó mientras tanto no guarda nada y devuelve 1 con su conexión en
+ * *online; 0 si lo guardó, OFFLINE_FULL si no hay lugar en los límites, -1
+ * si falló. */
+int offline_append(const char *dest, const void *frame, size_t len, int version, conn_ref_t *online);
+
+/* Saca los mensajes pendientes de username, concatenados en un solo buffer
+ * en el orden en que llegaron y codificados en version. NULL si no tiene
+ * (o no hay memoria, y entonces quedan guardados). Los v2 que no entran en
+ * version quedan guardados para cuando se conecte con v2. Los sacados siguen
+ * en el log hasta que *ticket se cierra: con offline_commit una vez escrito
+ * el buffer, o con offline_abort si la conexión se cayó antes, que los
+ * devuelve para la próxima. */
+msgbuf_t *offline_take(const char *username, int version, offline_ticket_t **ticket);
+
+void offline_commit(offline_ticket_t *t);
+void offline_abort(offline_ticket_t *t);
+
+#endif
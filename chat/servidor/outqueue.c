@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "outqueue.h"
+
+#define OUT_CHUNK_SIZE 4096
+#define FLUSH_IOV 64
+
+static msgbuf_t *buf_alloc(size_t cap, int frozen)
+{
+    msgbuf_t *b = malloc(sizeof(msgbuf_t) + cap);
+    if (b == NULL)
+        return NULL;
+    atomic_init(&b->refs, 1);
+    b->frozen = frozen;
+    b->len = 0;
+    b->cap = cap;
+    return b;
+}
+
+msgbuf_t *msgbuf_alloc(size_t cap)
+{
+    return buf_alloc(cap, 1);
+}
+
+msgbuf_t *msgbuf_new(const void *data, size_t len)
+{
+    msgbuf_t *b = msgbuf_alloc(len);
+    if (b == NULL)
+        return NULL;
+    memcpy(b->data, data, len);
+    b->len = len;
+    return b;
+}
+
+msgbuf_t *msgbuf_share(msgbuf_t *b)
+{
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+    return b;
+}
+
+void msgbuf_release(msgbuf_t *b)
+{
+    if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) == 1)
+        free(b);
+}
+
+static int push_seg(outqueue_t *q, msgbuf_t *b)
+{
+    out_seg_t *s = malloc(sizeof(out_seg_t));
+    if (s == NULL)
+        return -1;
+    s->next = NULL;
+    s->buf = b;
+    s->off = 0;
+    if (q->tail)
+        q->tail->next = s;
+    else
+        q->head = s;
+    q->tail = s;
+    return 0;
+}
+
+int outq_push(outqueue_t *q, const void *data, size_t len)
+{
+    msgbuf_t *b = q->tail ? q->tail->buf : NULL;
+    if (b == NULL || b->frozen || b->cap - b->len < len)
+    {
+        // un segmento propio: no sale de esta cola, así que se le puede seguir agregando
+        size_t cap = len > OUT_CHUNK_SIZE ? len : OUT_CHUNK_SIZE;
+        if ((b = buf_alloc(cap, 0)) == NULL)
+            return -1;
+        if (push_seg(q, b) < 0)
+        {
+            msgbuf_release(b);
+            return -1;
+        }
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    q->bytes += len;
+    return 0;
+}
+
+int outq_push_shared(outqueue_t *q, msgbuf_t *b)
+{
+    msgbuf_share(b);
+    if (push_seg(q, b) < 0)
+    {
+        msgbuf_release(b);
+        return -1;
+    }
+    q->bytes += b->len;
+    return 0;
+}
+
+int outq_flush(outqueue_t *q, int fd)
+{
+    while (q->head)
+    {
+        struct iovec iov[FLUSH_IOV];
+        int n = 0;
+        for (out_seg_t *s = q->head; s && n < FLUSH_IOV; s = s->next)
+        {
+            iov[n].iov_base = s->buf->data + s->off;
+            iov[n].iov_len = s->buf->len - s->off;
+            n++;
+        }
+
+        // sendmsg == writev con MSG_NOSIGNAL: un par caído no manda SIGPIPE
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t w = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return OUTQ_PENDING;
+            return OUTQ_ERROR;
+        }
+        q->bytes -= w;
+
+        // soltar los segmentos enviados completos
+        while (w > 0)
+        {
+            out_seg_t *s = q->head;
+            size_t left = s->buf->len - s->off;
+            if ((size_t)w < left)
+            {
+                s->off += w;
+                return OUTQ_PENDING;
+            }
+            w -= left;
+            q->head = s->next;
+            msgbuf_release(s->buf);
+            free(s);
+        }
+        if (q->head == NULL)
+            q->tail = NULL;
+    }
+    return OUTQ_DRAINED;
+}
+
+void outq_clear(outqueue_t *q)
+{
+    out_seg_t *s = q->head;
+    while (s)
+    {
+        out_seg_t *next = s->next;
+        msgbuf_release(s->buf);
+        free(s);
+        s = next;
+    }
+    q->head = q->tail = NULL;
+    q->bytes = 0;
+}
@@ -0,0 +1,65 @@
+#ifndef CHAT_OUTQUEUE_H
+#define CHAT_OUTQUEUE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* Buffer de frames codificados con contador de referencias. Una vez
+ * compartido (msgbuf_share) es inmutable: el mismo mensaje de una sala puede
+ * estar en la cola de miles de miembros sin copiarse. */
+typedef struct
+{
+    atomic_int refs;
+    /* Se fija al crearlo y no cambia, así se puede leer desde cualquier
+     * shard: sólo los segmentos propios de una cola (0) aceptan más frames;
+     * los de msgbuf_alloc/msgbuf_new se pueden compartir. */
+    int frozen;
+    size_t len;
+    size_t cap;
+    unsigned char data[];
+} msgbuf_t;
+
+// buffer vacío con una referencia y lugar para cap bytes
+msgbuf_t *msgbuf_alloc(size_t cap);
+
+// buffer con una referencia y len bytes copiados de data
+msgbuf_t *msgbuf_new(const void *data, size_t len);
+msgbuf_t *msgbuf_share(msgbuf_t *b);
+void msgbuf_release(msgbuf_t *b);
+
+/* Cola de salida de una conexión: segmentos que apuntan a msgbufs, propios
+ * o compartidos. Los frames chicos propios se juntan en el último segmento
+ * para que un flush sea un solo writev. */
+
+typedef struct out_seg
+{
+    struct out_seg *next;
+    msgbuf_t *buf;
+    size_t off; // bytes ya enviados
+} out_seg_t;
+
+typedef struct
+{
+    out_seg_t *head;
+    out_seg_t *tail;
+    size_t bytes; // pendientes de enviar
+} outqueue_t;
+
+#define OUTQ_DRAINED 0
+#define OUTQ_PENDING 1
+#define OUTQ_ERROR -1
+
+// copia len bytes al final de la cola, -1 si no hay memoria
+int outq_push(outqueue_t *q, const void *data, size_t len);
+
+// encola una referencia más a b (sin copiar), -1 si no hay memoria
+int outq_push_shared(outqueue_t *q, msgbuf_t *b);
+
+/* Escribe todo lo posible con un writev por tanda. Devuelve OUTQ_DRAINED si
+ * la cola quedó vacía, OUTQ_PENDING si el socket se llenó o OUTQ_ERROR si
+ * falló. */
+int outq_flush(outqueue_t *q, int fd);
+
+void outq_clear(outqueue_t *q);
+
+#endif
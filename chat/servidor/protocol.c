@@ -0,0 +1,321 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+/* Busca el '\0' de un campo que empieza en buf[*off]. Devuelve el campo y
+ * avanza *off, NULL con *err = PARSE_INCOMPLETE si todavía no llegó completo
+ * o PARSE_INVALID si ya supera max_len bytes (incluido el '\0'). */
+static const char *take_string(const unsigned char *buf, size_t len, size_t *off, size_t max_len, int *err)
+{
+    size_t avail = len - *off;
+    size_t scan = avail < max_len ? avail : max_len;
+    const unsigned char *nul = memchr(buf + *off, '\0', scan);
+    if (nul == NULL)
+    {
+        *err = avail < max_len ? PARSE_INCOMPLETE : PARSE_INVALID;
+        return NULL;
+    }
+    const char *s = (const char *)buf + *off;
+    *off = nul - buf + 1;
+    return s;
+}
+
+int parse_frame(const unsigned char *buf, size_t len, frame_t *f)
+{
+    if (len < 2)
+        return PARSE_INCOMPLETE;
+
+    uint16_t net_op;
+    memcpy(&net_op, buf, 2);
+    memset(f, 0, sizeof(*f));
+    f->opcode = ntohs(net_op);
+
+    size_t off = 2;
+    int err = PARSE_INCOMPLETE;
+    switch (f->opcode)
+    {
+    case OPCODE_CONNECT:
+        if ((f->username = take_string(buf, len, &off, NAME_LEN, &err)) == NULL)
+            return err;
+        break;
+
+    case OPCODE_CONNECT_EXT:
+        if (len < 6)
+            return PARSE_INCOMPLETE;
+        uint16_t net_version, net_caps;
+        memcpy(&net_version, buf + 2, 2);
+        memcpy(&net_caps, buf + 4, 2);
+        f->version = ntohs(net_version);
+        f->caps = ntohs(net_caps);
+        off = 6;
+        if ((f->username = take_string(buf, len, &off, NAME_LEN, &err)) == NULL)
+            return err;
+        break;
+
+    case OPCODE_SENDMSG:
+        if ((f->orig = take_string(buf, len, &off, NAME_LEN, &err)) == NULL)
+            return err;
+        if ((f->dest = take_string(buf, len, &off, NAME_LEN, &err)) == NULL)
+            return err;
+        if ((f->msg = take_string(buf, len, &off, BUFFER_SIZE, &err)) == NULL)
+            return err;
+        break;
+
+    case OPCODE_ROOM_JOIN:
+    case OPCODE_ROOM_LEAVE:
+        if ((f->room = take_string(buf, len, &off, NAME_LEN, &err)) == NULL)
+            return err;
+        break;
+
+    case OPCODE_ROOM_MSG:
+        if ((f->orig = take_string(buf, len, &off, NAME_LEN, &err)) == NULL)
+            return err;
+        if ((f->room = take_string(buf, len, &off, NAME_LEN, &err)) == NULL)
+            return err;
+        if ((f->msg = take_string(buf, len, &off, BUFFER_SIZE, &err)) == NULL)
+            return err;
+        break;
+
+    case OPCODE_USER_EVENT:
+        // el cliente lo manda al cerrar la ventana
+        if (len < 4)
+            return PARSE_INCOMPLETE;
+        uint16_t net_action;
+        memcpy(&net_action, buf + 2, 2);
+        f->action = ntohs(net_action);
+        off = 4;
+        if ((f->username = take_string(buf, len, &off, NAME_LEN, &err)) == NULL)
+            return err;
+        break;
+
+    default:
+        // opcode desconocido: se descarta sólo el opcode
+        break;
+    }
+    return off;
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+static uint16_t get_u16(const unsigned char *p)
+{
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return ntohs(v);
+}
+
+size_t frame_v2_len(const unsigned char *buf, size_t len)
+{
+    if (len < V2_LEN_SIZE)
+        return 0;
+    return V2_LEN_SIZE + (size_t)get_u32(buf);
+}
+
+/* Lee un nombre str8 de [*p, end): 1 a NAME_LEN - 1 bytes, sin '\0'. -1 si
+ * no entra o no es válido. */
+static int take_name(const unsigned char **p, const unsigned char *end, field_t *out)
+{
+    if (*p >= end)
+        return -1;
+    size_t n = **p;
+    if (n == 0 || n >= NAME_LEN || (size_t)(end - *p - 1) < n || memchr(*p + 1, '\0', n))
+        return -1;
+    out->data = *p + 1;
+    out->len = n;
+    *p += 1 + n;
+    return 0;
+}
+
+// lo mismo para un cuerpo str32 de hasta max_body bytes
+static int take_body(const unsigned char **p, const unsigned char *end, size_t max_body, field_t *out)
+{
+    if (end - *p < 4)
+        return -1;
+    size_t n = get_u32(*p);
+    if (n > max_body || (size_t)(end - *p - 4) < n)
+        return -1;
+    out->data = *p + 4;
+    out->len = n;
+    *p += 4 + n;
+    return 0;
+}
+
+int parse_frame_v2(const unsigned char *buf, size_t len, size_t max_len, size_t max_body, frame_v2_t *f)
+{
+    size_t total = frame_v2_len(buf, len);
+    if (total == 0)
+        return PARSE_INCOMPLETE;
+    if (total < V2_HDR_SIZE || total > max_len)
+        return PARSE_INVALID;
+    if (len < total)
+        return PARSE_INCOMPLETE;
+
+    memset(f, 0, sizeof(*f));
+    f->opcode = get_u16(buf + V2_LEN_SIZE);
+    const unsigned char *p = buf + V2_HDR_SIZE;
+    const unsigned char *end = buf + total;
+    field_t dest, body;
+
+    switch (f->opcode)
+    {
+    case OPCODE_SENDMSG:
+        if (take_name(&p, end, &f->orig) < 0 || end - p < 2)
+            return PARSE_INVALID;
+        f->count = get_u16(p);
+        p += 2;
+        f->entries = p;
+        // se valida todo el lote antes de entregar el primero
+        for (int i = 0; i < f->count; i++)
+        {
+            if (take_name(&p, end, &dest) < 0 || take_body(&p, end, max_body, &body) < 0)
+                return PARSE_INVALID;
+        }
+        break;
+
+    case OPCODE_ROOM_MSG:
+        if (take_name(&p, end, &f->orig) < 0 || take_name(&p, end, &f->room) < 0 ||
+            take_body(&p, end, max_body, &f->body) < 0)
+            return PARSE_INVALID;
+        break;
+
+    case OPCODE_ROOM_JOIN:
+    case OPCODE_ROOM_LEAVE:
+        if (take_name(&p, end, &f->room) < 0)
+            return PARSE_INVALID;
+        break;
+
+    case OPCODE_USER_EVENT:
+        if (end - p < 2)
+            return PARSE_INVALID;
+        f->action = get_u16(p);
+        break;
+
+    default:
+        // desconocido: el largo alcanza para saltearlo entero
+        break;
+    }
+    return total;
+}
+
+void v2_next_entry(const unsigned char **p, field_t *dest, field_t *body)
+{
+    dest->len = **p;
+    dest->data = *p + 1;
+    *p += 1 + dest->len;
+    body->len = get_u32(*p);
+    body->data = *p + 4;
+    *p += 4 + body->len;
+}
+
+void field_to_name(field_t f, char name[NAME_LEN])
+{
+    memcpy(name, f.data, f.len);
+    name[f.len] = '\0';
+}
+
+void put_v2_len(unsigned char *out, size_t len)
+{
+    uint32_t net_len = htonl(len);
+    memcpy(out, &net_len, 4);
+}
+
+size_t msg_frame_len(uint16_t opcode, int version, const char *orig, const char *to,
+                     const unsigned char *body, size_t body_len)
+{
+    size_t orig_len = strlen(orig), to_len = strlen(to);
+    if (version >= PROTOCOL_V2)
+    {
+        size_t n = V2_HDR_SIZE + 1 + orig_len + 1 + to_len + 4 + body_len;
+        return opcode == OPCODE_SENDMSG ? n + 2 : n;
+    }
+    const unsigned char *nul = memchr(body, '\0', body_len);
+    if (nul)
+        body_len = nul - body;
+    if (body_len >= BUFFER_SIZE)
+        return 0;
+    return 2 + orig_len + 1 + to_len + 1 + body_len + 1;
+}
+
+size_t encode_msg_frame(unsigned char *out, uint16_t opcode, int version, const char *orig,
+                        const char *to, const unsigned char *body, size_t body_len)
+{
+    size_t orig_len = strlen(orig), to_len = strlen(to);
+    uint16_t net_op = htons(opcode);
+    unsigned char *p = out;
+
+    if (version < PROTOCOL_V2)
+    {
+        const unsigned char *nul = memchr(body, '\0', body_len);
+        if (nul)
+            body_len = nul - body;
+        memcpy(p, &net_op, 2);
+        p += 2;
+        memcpy(p, orig, orig_len + 1);
+        p += orig_len + 1;
+        memcpy(p, to, to_len + 1);
+        p += to_len + 1;
+        memcpy(p, body, body_len);
+        p += body_len;
+        *p++ = '\0';
+        return p - out;
+    }
+
+    p += V2_LEN_SIZE;
+    memcpy(p, &net_op, 2);
+    p += 2;
+    *p++ = orig_len;
+    memcpy(p, orig, orig_len);
+    p += orig_len;
+    if (opcode == OPCODE_SENDMSG)
+    {
+        uint16_t one = htons(1);
+        memcpy(p, &one, 2);
+        p += 2;
+    }
+    *p++ = to_len;
+    memcpy(p, to, to_len);
+    p += to_len;
+    uint32_t net_body = htonl(body_len);
+    memcpy(p, &net_body, 4);
+    p += 4;
+    memcpy(p, body, body_len);
+    p += body_len;
+    put_v2_len(out, p - out - V2_LEN_SIZE);
+    return p - out;
+}
+
+size_t reencode_msg_frame(unsigned char *out, int to, const unsigned char *frame, size_t len, int from)
+{
+    if (from == to)
+    {
+        memcpy(out, frame, len);
+        return len;
+    }
+    if (from < PROTOCOL_V2)
+    {
+        frame_t f;
+        if (parse_frame(frame, len, &f) != (int)len || f.opcode != OPCODE_SENDMSG)
+            return 0;
+        return encode_msg_frame(out, OPCODE_SENDMSG, to, f.orig, f.dest,
+                                (const unsigned char *)f.msg, strlen(f.msg));
+    }
+
+    frame_v2_t f;
+    if (parse_frame_v2(frame, len, len, len, &f) != (int)len || f.opcode != OPCODE_SENDMSG || f.count != 1)
+        return 0;
+    const unsigned char *p = f.entries;
+    field_t dest, body;
+    v2_next_entry(&p, &dest, &body);
+    char orig_name[NAME_LEN], dest_name[NAME_LEN];
+    field_to_name(f.orig, orig_name);
+    field_to_name(dest, dest_name);
+    if (msg_frame_len(OPCODE_SENDMSG, to, orig_name, dest_name, body.data, body.len) == 0)
+        return 0;
+    return encode_msg_frame(out, OPCODE_SENDMSG, to, orig_name, dest_name, body.data, body.len);
+}
@@ -0,0 +1,143 @@
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUFFER_SIZE 1024
+#define NAME_LEN 32
+
+#define OPCODE_CONNECT 1
+#define OPCODE_SENDMSG 3
+
+/* Salas: room_join/room_leave llevan opcode(2) room\0 y room_msg tiene la
+ * misma forma que sendmsg con la sala como destino:
+ *   opcode(2) orig\0 room\0 msg\0
+ * El servidor reenvía el room_msg tal cual a todos los miembros. */
+#define OPCODE_ROOM_JOIN 4
+#define OPCODE_ROOM_LEAVE 5
+#define OPCODE_ROOM_MSG 11
+#define OPCODE_ACK 7
+#define USER_SUCCESFULLY_CONNECTED_ACK_CODE 1
+/* error: opcode(2) code(2) texto\0. Después de DUPLICATE_USERNAME o
+ * INVALID_USERNAME el servidor cierra la conexión; MESSAGE_DROPPED avisa que
+ * un mensaje no se entregó ni se guardó y la conexión sigue. */
+#define OPCODE_ERROR 6
+#define DUPLICATE_USERNAME_ERROR_CODE 2
+#define MESSAGE_DROPPED_ERROR_CODE 3
+#define INVALID_USERNAME_ERROR_CODE 4
+#define OPCODE_USER_EVENT 8
+#define ACTION_CONNECT 0
+#define ACTION_DISCONNECT 1
+
+/* Lista de eventos de presencia en un solo frame:
+ *   opcode(2) count(2) { action(1) username\0 } * count
+ * Se usa para la foto inicial de usuarios y para los cambios acumulados. */
+#define OPCODE_USER_LIST 9
+#define USER_LIST_MAX_ENTRIES 0xFFFF
+
+/* connect_request extendido: opcode(2) version(2) caps(2) username\0
+ * Los clientes viejos siguen usando OPCODE_CONNECT y reciben USER_EVENT. */
+#define OPCODE_CONNECT_EXT 10
+#define PROTOCOL_V1 1
+#define CAP_USER_LIST 0x0001
+
+/* Protocolo v2 (CONNECT_EXT con version 2): todo lo que sigue al connect,
+ * en los dos sentidos, va en frames con el largo adelante
+ *   len(4) opcode(2) payload
+ * donde len cuenta opcode + payload. Los campos llevan su largo en vez de
+ * terminar en '\0': str8 = len(1) bytes, str32 = len(4) bytes.
+ *   sendmsg:   orig:str8 count(2) { dest:str8 body:str32 } * count
+ *   room_msg:  orig:str8 room:str8 body:str32
+ *   room_join, room_leave: room:str8
+ * El resto (ack, error, user_event, user_list) lleva el payload de v1 y
+ * v2 implica CAP_USER_LIST. Un sendmsg puede traer varios mensajes; el
+ * servidor entrega cada uno con count = 1. Si el cliente pide una versión
+ * mayor el servidor contesta en la mayor que conoce. */
+#define PROTOCOL_V2 2
+#define V2_LEN_SIZE 4
+#define V2_HDR_SIZE 6
+// lo que ocupa un frame v2 además de los cuerpos de los mensajes
+#define V2_FRAME_OVERHEAD 4096
+#define DEFAULT_MAX_BODY_LEN (256 * 1024)
+// lo que puede crecer un sendmsg al pasarlo de v1 a v2
+#define REENCODE_SLACK 16
+
+// frame más largo posible: opcode + orig + dest + msg (con sus '\0')
+#define MAX_FRAME_LEN (2 + NAME_LEN + NAME_LEN + BUFFER_SIZE)
+
+#define PARSE_INCOMPLETE 0
+#define PARSE_INVALID -1
+
+/* Frame decodificado. Los strings apuntan dentro del buffer de recepción
+ * (terminados en '\0'), así que sólo valen hasta que se consuma el buffer. */
+typedef struct
+{
+    uint16_t opcode;
+    uint16_t action;      // USER_EVENT
+    uint16_t version;     // CONNECT_EXT
+    uint16_t caps;        // CONNECT_EXT
+    const char *username; // CONNECT, CONNECT_EXT, USER_EVENT
+    const char *orig;     // SENDMSG, ROOM_MSG
+    const char *dest;     // SENDMSG
+    const char *room;     // ROOM_JOIN, ROOM_LEAVE, ROOM_MSG
+    const char *msg;      // SENDMSG, ROOM_MSG
+} frame_t;
+
+typedef struct
+{
+    const unsigned char *data;
+    size_t len;
+} field_t;
+
+/* Frame v2 decodificado sin copiar: los campos apuntan dentro de buf y sólo
+ * valen mientras no se lo consuma. */
+typedef struct
+{
+    uint16_t opcode;
+    uint16_t action; // USER_EVENT
+    field_t orig;    // SENDMSG, ROOM_MSG
+    field_t room;    // ROOM_JOIN, ROOM_LEAVE, ROOM_MSG
+    field_t body;    // ROOM_MSG
+    uint16_t count;  // SENDMSG: mensajes en entries
+    const unsigned char *entries;
+} frame_v2_t;
+
+/* Intenta extraer un frame del comienzo de buf. Devuelve la cantidad de
+ * bytes consumidos, PARSE_INCOMPLETE si faltan datos o PARSE_INVALID si
+ * algún campo supera su tamaño máximo. */
+int parse_frame(const unsigned char *buf, size_t len, frame_t *f);
+
+/* Largo total (prefijo incluido) del frame v2 al comienzo de buf, 0 si
+ * todavía no llegó el prefijo. */
+size_t frame_v2_len(const unsigned char *buf, size_t len);
+
+/* Como parse_frame para v2. Ningún frame puede pasar de max_len bytes ni
+ * ningún cuerpo de max_body. */
+int parse_frame_v2(const unsigned char *buf, size_t len, size_t max_len, size_t max_body, frame_v2_t *f);
+
+// siguiente mensaje de un sendmsg v2 ya validado; avanza *p
+void v2_next_entry(const unsigned char **p, field_t *dest, field_t *body);
+
+// copia un nombre validado por parse_frame_v2 a un string
+void field_to_name(field_t f, char name[NAME_LEN]);
+
+/* Largo de un sendmsg o room_msg (opcode) de orig a to en la versión dada,
+ * 0 si no entra: en v1 el cuerpo tiene que ser menor que BUFFER_SIZE y se
+ * corta en el primer '\0'. */
+size_t msg_frame_len(uint16_t opcode, int version, const char *orig, const char *to,
+                     const unsigned char *body, size_t body_len);
+
+// lo codifica en out (de msg_frame_len bytes) y devuelve el largo
+size_t encode_msg_frame(unsigned char *out, uint16_t opcode, int version, const char *orig,
+                        const char *to, const unsigned char *body, size_t body_len);
+
+/* Pasa a la versión to un sendmsg de un solo mensaje codificado en from.
+ * out tiene lugar para len + REENCODE_SLACK bytes. Devuelve el largo
+ * escrito, 0 si el frame no es válido o no entra en la otra versión. */
+size_t reencode_msg_frame(unsigned char *out, int to, const unsigned char *frame, size_t len, int from);
+
+// escribe el prefijo v2 de un frame de len bytes (opcode + payload)
+void put_v2_len(unsigned char *out, size_t len);
+
+#endif
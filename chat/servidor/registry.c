@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "registry.h"
+#include "metrics.h"
+
+static pthread_rwlock_t registry_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Toman y sueltan el lock midiendo la espera y cuánto se lo tuvo, en las
+ * métricas del thread que llama. lock devuelve el momento en que lo
+ * obtuvo, para pasárselo a unlock. */
+static uint64_t lock(int mode)
+{
+    uint64_t t0 = metrics_now_ns();
+    if (mode == RWLOCK_WRITE)
+        pthread_rwlock_wrlock(&registry_lock);
+    else
+        pthread_rwlock_rdlock(&registry_lock);
+    uint64_t t1 = metrics_now_ns();
+    hist_record(&metrics_self()->lock_wait[mode], t1 - t0);
+    return t1;
+}
+
+static void unlock(int mode, uint64_t since)
+{
+    uint64_t held = metrics_now_ns() - since;
+    pthread_rwlock_unlock(&registry_lock);
+    hist_record(&metrics_self()->lock_hold[mode], held);
+}
+
+static registry_entry_t *slots = NULL;
+static int slots_cap = 0;
+static int free_head = -1;
+
+static int *buckets = NULL; // primer slot de cada bucket, -1 si vacío
+static size_t nbuckets = 0;
+static size_t count = 0;
+
+// FNV-1a
+static uint32_t hash_name(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// agrega slots nuevos a la free-list
+static int grow_slots(int cap)
+{
+    registry_entry_t *tmp = realloc(slots, cap * sizeof(registry_entry_t));
+    if (tmp == NULL)
+        return -1;
+    for (int i = cap - 1; i >= slots_cap; i--)
+    {
+        memset(&tmp[i], 0, sizeof(tmp[i]));
+        tmp[i].next = free_head;
+        free_head = i;
+    }
+    slots = tmp;
+    slots_cap = cap;
+    return 0;
+}
+
+// redistribuye las cadenas en una tabla de n buckets (n potencia de 2)
+static int rehash(size_t n)
+{
+    int *tmp = malloc(n * sizeof(int));
+    if (tmp == NULL)
+        return -1;
+    for (size_t i = 0; i < n; i++)
+        tmp[i] = -1;
+    for (int i = 0; i < slots_cap; i++)
+    {
+        if (!slots[i].in_use)
+            continue;
+        size_t b = hash_name(slots[i].username) & (n - 1);
+        slots[i].next = tmp[b];
+        tmp[b] = i;
+    }
+    free(buckets);
+    buckets = tmp;
+    nbuckets = n;
+    return 0;
+}
+
+// requiere el lock tomado (lectura o escritura)
+static int find_slot(const char *username)
+{
+    size_t b = hash_name(username) & (nbuckets - 1);
+    for (int i = buckets[b]; i >= 0; i = slots[i].next)
+    {
+        if (strcmp(slots[i].username, username) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int registry_init(size_t initial_slots)
+{
+    size_t n = 16;
+    while (n < initial_slots)
+        n *= 2;
+    uint64_t t = lock(RWLOCK_WRITE);
+    int r = (grow_slots(n) < 0 || rehash(n) < 0) ? -1 : 0;
+    unlock(RWLOCK_WRITE, t);
+    return r;
+}
+
+int registry_add(const char *username, conn_ref_t conn)
+{
+    uint64_t t = lock(RWLOCK_WRITE);
+    if (find_slot(username) >= 0)
+    {
+        unlock(RWLOCK_WRITE, t);
+        return -1;
+    }
+    // factor de carga <= 1: se duplican slots y buckets juntos
+    if (free_head < 0 && (grow_slots(slots_cap * 2) < 0 || rehash(nbuckets * 2) < 0))
+    {
+        unlock(RWLOCK_WRITE, t);
+        return -2;
+    }
+
+    int slot = free_head;
+    registry_entry_t *e = &slots[slot];
+    free_head = e->next;
+
+    strncpy(e->username, username, NAME_LEN - 1);
+    e->username[NAME_LEN - 1] = '\0';
+    e->conn = conn;
+    e->in_use = 1;
+
+    size_t b = hash_name(e->username) & (nbuckets - 1);
+    e->next = buckets[b];
+    buckets[b] = slot;
+    count++;
+    unlock(RWLOCK_WRITE, t);
+    return slot;
+}
+
+void registry_remove(int slot)
+{
+    uint64_t t = lock(RWLOCK_WRITE);
+    registry_entry_t *e = &slots[slot];
+    if (!e->in_use)
+    {
+        unlock(RWLOCK_WRITE, t);
+        return;
+    }
+
+    // desenganchar de la cadena del bucket
+    size_t b = hash_name(e->username) & (nbuckets - 1);
+    int *link = &buckets[b];
+    while (*link != slot)
+        link = &slots[*link].next;
+    *link = e->next;
+
+    e->in_use = 0;
+    e->username[0] = '\0';
+    e->next = free_head;
+    free_head = slot;
+    count--;
+    unlock(RWLOCK_WRITE, t);
+}
+
+int registry_lookup(const char *username, conn_ref_t *out)
+{
+    uint64_t t = lock(RWLOCK_READ);
+    int slot = find_slot(username);
+    if (slot >= 0)
+        *out = slots[slot].conn;
+    unlock(RWLOCK_READ, t);
+    return slot >= 0 ? 0 : -1;
+}
+
+size_t registry_count(void)
+{
+    uint64_t t = lock(RWLOCK_READ);
+    size_t n = count;
+    unlock(RWLOCK_READ, t);
+    return n;
+}
+
+void registry_foreach(registry_visit_fn fn, void *arg)
+{
+    uint64_t t = lock(RWLOCK_READ);
+    for (int i = 0; i < slots_cap; i++)
+    {
+        if (slots[i].in_use)
+            fn(&slots[i], arg);
+    }
+    unlock(RWLOCK_READ, t);
+}
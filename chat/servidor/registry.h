@@ -0,0 +1,52 @@
+#ifndef CHAT_REGISTRY_H
+#define CHAT_REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/* Registro global de usuarios conectados: índice nombre -> conexión en una
+ * tabla hash con encadenamiento por índice de slot, y una free-list de slots.
+ * Las búsquedas toman el lock en modo lectura, así que el ruteo de mensajes
+ * no se serializa; sólo alta y baja lo toman en escritura. */
+
+/* Identifica una conexión: shard dueño, fd y generación (el fd se
+ * reutiliza). Lleva también la versión de protocolo para que quien le manda
+ * algo lo codifique sin preguntarle a su shard. */
+typedef struct
+{
+    int shard;
+    int fd;
+    uint32_t gen;
+    int version;
+} conn_ref_t;
+
+typedef struct
+{
+    char username[NAME_LEN];
+    conn_ref_t conn;
+    int next; // siguiente slot en el bucket, o en la free-list si está libre
+    int in_use;
+} registry_entry_t;
+
+typedef void (*registry_visit_fn)(const registry_entry_t *e, void *arg);
+
+int registry_init(size_t initial_slots);
+
+/* Registra username -> conexión. Devuelve el slot asignado, -1 si el nombre
+ * ya existe o -2 si no hay memoria. */
+int registry_add(const char *username, conn_ref_t conn);
+
+void registry_remove(int slot);
+
+// 0 y la conexión del usuario en *out, -1 si no está conectado
+int registry_lookup(const char *username, conn_ref_t *out);
+
+size_t registry_count(void);
+
+/* Recorre los usuarios conectados con el lock de lectura tomado. fn no
+ * debe llamar a funciones del registro. */
+void registry_foreach(registry_visit_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "rooms.h"
+
+#define ROOM_BUCKETS_MIN 16
+
+// FNV-1a
+static uint32_t hash_name(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int rehash(room_table_t *t, size_t n)
+{
+    room_t **tmp = calloc(n, sizeof(room_t *));
+    if (tmp == NULL)
+        return -1;
+    for (size_t i = 0; i < t->nbuckets; i++)
+    {
+        room_t *r = t->buckets[i];
+        while (r)
+        {
+            room_t *next = r->next;
+            size_t b = hash_name(r->name) & (n - 1);
+            r->next = tmp[b];
+            tmp[b] = r;
+            r = next;
+        }
+    }
+    free(t->buckets);
+    t->buckets = tmp;
+    t->nbuckets = n;
+    return 0;
+}
+
+room_t *room_find(room_table_t *t, const char *name)
+{
+    if (t->nbuckets == 0)
+        return NULL;
+    for (room_t *r = t->buckets[hash_name(name) & (t->nbuckets - 1)]; r; r = r->next)
+    {
+        if (strcmp(r->name, name) == 0)
+            return r;
+    }
+    return NULL;
+}
+
+room_t *room_get_or_create(room_table_t *t, const char *name)
+{
+    room_t *r = room_find(t, name);
+    if (r)
+        return r;
+    if (t->count >= t->nbuckets &&
+        rehash(t, t->nbuckets ? t->nbuckets * 2 : ROOM_BUCKETS_MIN) < 0)
+        return NULL;
+    if ((r = calloc(1, sizeof(room_t))) == NULL)
+        return NULL;
+    strncpy(r->name, name, NAME_LEN - 1);
+    size_t b = hash_name(r->name) & (t->nbuckets - 1);
+    r->next = t->buckets[b];
+    t->buckets[b] = r;
+    t->count++;
+    return r;
+}
+
+int room_add_member(room_t *r, int fd)
+{
+    if (r->count == r->cap)
+    {
+        int cap = r->cap ? r->cap * 2 : 8;
+        int *tmp = realloc(r->members, cap * sizeof(int));
+        if (tmp == NULL)
+            return -1;
+        r->members = tmp;
+        r->cap = cap;
+    }
+    r->members[r->count] = fd;
+    return r->count++;
+}
+
+int room_remove_member(room_table_t *t, room_t *r, int idx)
+{
+    // el orden de los miembros no importa
+    int moved = --r->count > idx ? r->members[r->count] : -1;
+    if (moved >= 0)
+        r->members[idx] = moved;
+    room_drop_if_empty(t, r);
+    return moved;
+}
+
+void room_drop_if_empty(room_table_t *t, room_t *r)
+{
+    if (r->count > 0)
+        return;
+    room_t **link = &t->buckets[hash_name(r->name) & (t->nbuckets - 1)];
+    while (*link != r)
+        link = &(*link)->next;
+    *link = r->next;
+    t->count--;
+    free(r->members);
+    free(r);
+}
@@ -0,0 +1,54 @@
+#ifndef CHAT_ROOMS_H
+#define CHAT_ROOMS_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+/* Salas de un shard: nombre -> fds de los miembros conectados a este shard.
+ * Cada shard tiene su propia tabla y sólo él la toca, así que no lleva lock;
+ * un mensaje a una sala se reparte en cada shard con su tabla local.
+ *
+ * Cada cliente guarda sus salas con su posición en members (room_ref_t), así
+ * unirse y salir no recorren la sala: se agrega al final y se saca por
+ * índice, moviendo el último miembro al hueco. */
+
+typedef struct room
+{
+    struct room *next; // cadena del bucket
+    char name[NAME_LEN];
+    int *members;
+    int count, cap;
+} room_t;
+
+// una sala de un cliente y su lugar en members
+typedef struct
+{
+    room_t *room;
+    int idx;
+} room_ref_t;
+
+typedef struct
+{
+    room_t **buckets;
+    size_t nbuckets;
+    size_t count;
+} room_table_t;
+
+room_t *room_find(room_table_t *t, const char *name);
+
+// busca la sala y la crea si no existe; NULL si no hay memoria
+room_t *room_get_or_create(room_table_t *t, const char *name);
+
+// agrega a fd, que no tiene que ser miembro; su índice en members, o -1 si no hay memoria
+int room_add_member(room_t *r, int fd);
+
+/* Saca al miembro idx y destruye la sala si quedó vacía. Devuelve el fd del
+ * miembro que pasó a ocupar idx, para que actualice su room_ref_t, o -1 si
+ * no se movió ninguno. */
+int room_remove_member(room_table_t *t, room_t *r, int idx);
+
+// destruye la sala si no le quedan miembros
+void room_drop_if_empty(room_table_t *t, room_t *r);
+
+#endif
@@ -1,263 +1,1522 @@
+#define _GNU_SOURCE // accept4, pthread_setaffinity_np
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
-#include <pthread.h>
 
-#define BUFFER_SIZE 1024
-#define NAME_LEN 32
-#define MAX_CLIENTS 100
+#include "protocol.h"
+#include "registry.h"
+#include "outqueue.h"
+#include "mpsc.h"
+#include "rooms.h"
+#include "offline.h"
+#include "log.h"
+#include "metrics.h"
+
+#define INITIAL_CLIENTS 64
+#define MAX_EVENTS 256
+#define RX_CHUNK 65536
+#define DEFAULT_MAX_QUEUE_BYTES (1 << 20)
+#define DEFAULT_HANDSHAKE_TIMEOUT_MS 10000
+#define ACCEPT_BATCH 64
+#define MAX_WORKERS 256
+#define DEFAULT_PRESENCE_INTERVAL_MS 50
+
+#define CONN_HANDSHAKE 0 // esperando connect_request
+#define CONN_ACTIVE 1    // registrado
 
-#define OPCODE_CONNECT 1
-#define OPCODE_SENDMSG 3
-#define OPCODE_ACK 7
-#define USER_SUCCESFULLY_CONNECTED_ACK_CODE 1
-#define OPCODE_ERROR 6
-#define DUPLICATE_USERNAME_ERROR_CODE 2
-#define OPCODE_USER_EVENT 8
-#define ACTION_CONNECT 0
-#define ACTION_DISCONNECT 1
+#define CLOSE_NONE 0
+#define CLOSE_AFTER_FLUSH 1 // mandar lo encolado (p. ej. un error) y cerrar
+#define CLOSE_NOW 2         // consumidor lento o error de socket
 
 typedef struct
 {
     int sockfd;
+    uint32_t gen;
+    int state;
+    int slot; // slot en el registro, -1 hasta completar el CONNECT
+    uint16_t caps; // capacidades anunciadas en CONNECT_EXT
+    int version;   // PROTOCOL_V1 hasta que un CONNECT_EXT pida otra
     char username[NAME_LEN];
+    unsigned char *rx; // frame parcial pendiente, NULL si no hay
+    size_t rx_len, rx_cap;
+    outqueue_t outq;
+    // salas a las que está unido (de la tabla de su shard)
+    room_ref_t *rooms;
+    int nrooms, rooms_cap;
+    size_t replay_bytes; // mensajes offline reenviados; no cuentan para el límite
+    // los reenviados quedan en el log hasta que se escriban los replay_left bytes de la cola
+    offline_ticket_t *replay;
+    size_t replay_left;
+    int dirty; // está en dirty_fds esperando flush
+    int announcing; // su alta está en el lote de presencia de su shard
+    int closing;
+    uint64_t deadline_ms;
+    // enlaces en la lista de handshakes o en la de activos, según state
+    int prev, next;
 } client_t;
 
-static client_t clients[MAX_CLIENTS];
-static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int next_thread_id = 1;
+typedef struct
+{
+    int head, tail;
+} fd_list_t;
+
+typedef struct
+{
+    unsigned char *data;
+    size_t len, cap;
+} bytebuf_t;
 
-// lee hasta '\0'
-int read_null_string(int fd, char *buf, int max_len)
+// cambio de presencia pendiente de avisar
+typedef struct
+{
+    uint16_t action;
+    char username[NAME_LEN];
+    // en un alta, la conexión que la originó: a ella no se le avisa
+    int fd;
+    uint32_t gen;
+} presence_t;
+
+/* Un shard: un thread con su epoll, su listener SO_REUSEPORT y sus clientes.
+ * Nada de esto se comparte; otros shards sólo le escriben en el inbox. */
+typedef struct
 {
-    int i = 0;
-    while (i < max_len)
+    int id;
+    pthread_t thread;
+    int epfd;
+    int listen_fd;
+    int event_fd;
+    mpsc_queue_t inbox;
+
+    // indexada por fd, NULL si el fd no es de este shard
+    client_t **clients;
+    int clients_cap;
+    uint32_t next_gen;
+
+    // conexiones con datos encolados, se vacían al final de cada vuelta del loop
+    int *dirty_fds;
+    int dirty_len, dirty_cap;
+
+    /* Handshakes en orden de llegada: como el plazo es el mismo para todos,
+     * también es el orden de vencimiento. */
+    fd_list_t handshakes;
+    fd_list_t active;
+
+    // quedaron conexiones en el backlog después de un lote de accept
+    int accept_pending;
+
+    /* Altas y bajas de este shard en la ventana actual. Al vencer se
+     * codifican una vez y salen como un frame por destinatario. */
+    presence_t *presence;
+    int presence_len, presence_cap;
+    uint64_t presence_deadline_ms;
+
+    room_table_t rooms;
+
+    metrics_t *metrics;
+    uint64_t rx_ns; // cuándo llegó lo último leído, para la latencia de reenvío
+
+    unsigned char rx_scratch[RX_CHUNK];
+} reactor_t;
+
+#define XMSG_DELIVER 0  // frame para una conexión
+#define XMSG_PRESENCE 1 // lote de presencia para todos los activos del shard
+#define XMSG_ROOM 2     // room_msg para los miembros locales de una sala
+
+/* Lo que un shard le pasa a otro por su inbox. Los frames viajan como
+ * referencias a msgbufs compartidos, no como copias. */
+typedef struct
+{
+    mpsc_node_t node;
+    int kind;
+    int fd; // XMSG_DELIVER: destino
+    uint32_t gen;
+    msgbuf_t *buf;  // el frame; en XMSG_PRESENCE los USER_EVENT sueltos; en XMSG_ROOM la versión v1
+    msgbuf_t *list; // XMSG_PRESENCE: el mismo lote como USER_LIST
+    msgbuf_t *v2;   // XMSG_PRESENCE: la USER_LIST en v2; XMSG_ROOM: el room_msg en v2
+    char room[NAME_LEN];
+} xmsg_t;
+
+static reactor_t *reactors = NULL;
+static int nworkers = 1;
+
+// bytes pendientes permitidos por cliente antes de desconectarlo
+static size_t max_queue_bytes = DEFAULT_MAX_QUEUE_BYTES;
+static uint64_t handshake_timeout_ms = DEFAULT_HANDSHAKE_TIMEOUT_MS;
+static uint64_t presence_interval_ms = DEFAULT_PRESENCE_INTERVAL_MS;
+static int listen_port;
+// directorio del log de mensajes offline; NULL si no se guardan
+static const char *offline_dir = NULL;
+// socket Unix de métricas; NULL si no se exponen
+static const char *admin_path = NULL;
+// cuerpo más largo aceptado en v2 y frame más largo que eso permite
+static size_t max_body_len = DEFAULT_MAX_BODY_LEN;
+static size_t max_frame_v2_len;
+
+uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+client_t *get_client(reactor_t *r, int fd)
+{
+    return fd >= 0 && fd < r->clients_cap ? r->clients[fd] : NULL;
+}
+
+int bytebuf_put(bytebuf_t *b, const void *data, size_t len)
+{
+    if (b->len + len > b->cap)
     {
-        if (read(fd, &buf[i], 1) != 1)
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap < b->len + len)
+            cap *= 2;
+        unsigned char *tmp = realloc(b->data, cap);
+        if (tmp == NULL)
             return -1;
-        if (buf[i++] == '\0')
-            return i;
+        b->data = tmp;
+        b->cap = cap;
     }
-    return -2;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+// asegura que exista la entrada clients[fd]
+int clients_reserve(reactor_t *r, int fd)
+{
+    if (fd < r->clients_cap)
+        return 0;
+    int cap = r->clients_cap ? r->clients_cap : INITIAL_CLIENTS;
+    while (cap <= fd)
+        cap *= 2;
+    client_t **tmp = realloc(r->clients, cap * sizeof(client_t *));
+    if (tmp == NULL)
+        return -1;
+    memset(tmp + r->clients_cap, 0, (cap - r->clients_cap) * sizeof(client_t *));
+    r->clients = tmp;
+    r->clients_cap = cap;
+    return 0;
 }
 
-// envía paquete user_event a un socket dado
-void send_user_event(int sockfd, uint16_t action, const char *username)
+void list_insert(reactor_t *r, fd_list_t *l, int fd)
+{
+    client_t *c = r->clients[fd];
+    c->prev = l->tail;
+    c->next = -1;
+    if (l->tail >= 0)
+        r->clients[l->tail]->next = fd;
+    else
+        l->head = fd;
+    l->tail = fd;
+}
+
+void list_remove(reactor_t *r, fd_list_t *l, int fd)
+{
+    client_t *c = r->clients[fd];
+    if (c->prev >= 0)
+        r->clients[c->prev]->next = c->next;
+    else
+        l->head = c->next;
+    if (c->next >= 0)
+        r->clients[c->next]->prev = c->prev;
+    else
+        l->tail = c->prev;
+}
+
+void mark_dirty(reactor_t *r, client_t *c)
+{
+    if (c->dirty)
+        return;
+    if (r->dirty_len == r->dirty_cap)
+    {
+        int cap = r->dirty_cap ? r->dirty_cap * 2 : INITIAL_CLIENTS;
+        int *tmp = realloc(r->dirty_fds, cap * sizeof(int));
+        if (tmp == NULL)
+        {
+            // sin memoria para anotarlo: se cierra en vez de perder datos
+            c->closing = CLOSE_NOW;
+            return;
+        }
+        r->dirty_fds = tmp;
+        r->dirty_cap = cap;
+    }
+    r->dirty_fds[r->dirty_len++] = c->sockfd;
+    c->dirty = 1;
+}
+
+// -1 (y marca el cierre) si encolar len bytes más lo vuelve un slow consumer
+int check_budget(client_t *c, size_t len)
+{
+    if (c->outq.bytes + len <= max_queue_bytes + c->replay_bytes)
+        return 0;
+    log_warn("Server: slow consumer '%s' fd=%d (%zu bytes queued), disconnecting",
+             c->username, c->sockfd, c->outq.bytes);
+    counter_add(&metrics_self()->slow_consumers, 1);
+    c->closing = CLOSE_NOW;
+    return -1;
+}
+
+// encola un frame para un cliente de este shard; no hace I/O
+void queue_frame(reactor_t *r, client_t *c, const void *data, size_t len)
+{
+    if (c->closing == CLOSE_NOW)
+        return;
+    if (check_budget(c, len) == 0 && outq_push(&c->outq, data, len) < 0)
+        c->closing = CLOSE_NOW;
+    mark_dirty(r, c);
+}
+
+// encola un frame de control (ack, error) con el prefijo v2 si lo lleva
+void queue_ctrl(reactor_t *r, client_t *c, const void *data, size_t len)
+{
+    if (c->version >= PROTOCOL_V2)
+    {
+        unsigned char prefix[V2_LEN_SIZE];
+        put_v2_len(prefix, len);
+        queue_frame(r, c, prefix, V2_LEN_SIZE);
+    }
+    queue_frame(r, c, data, len);
+}
+
+// igual que queue_frame pero encola una referencia a un buffer compartido
+void queue_shared(reactor_t *r, client_t *c, msgbuf_t *b)
+{
+    if (c->closing == CLOSE_NOW)
+        return;
+    if (check_budget(c, b->len) == 0 && outq_push_shared(&c->outq, b) < 0)
+        c->closing = CLOSE_NOW;
+    mark_dirty(r, c);
+}
+
+void xmsg_push(int shard, xmsg_t *m)
+{
+    reactor_t *dst = &reactors[shard];
+    if (mpsc_push(&dst->inbox, &m->node))
+    {
+        uint64_t one = 1;
+        if (write(dst->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            log_error("write eventfd: %s", strerror(errno));
+    }
+}
+
+/* Pasa al inbox de otro shard una referencia a cada buffer que no sea
+ * NULL y lo despierta si hace falta. */
+void xmsg_send(int shard, int kind, int fd, uint32_t gen, const char *room,
+               msgbuf_t *b, msgbuf_t *list, msgbuf_t *v2)
+{
+    xmsg_t *m = calloc(1, sizeof(xmsg_t));
+    if (m == NULL)
+        return;
+    m->kind = kind;
+    m->fd = fd;
+    m->gen = gen;
+    m->buf = b ? msgbuf_share(b) : NULL;
+    m->list = list ? msgbuf_share(list) : NULL;
+    m->v2 = v2 ? msgbuf_share(v2) : NULL;
+    if (room)
+        strncpy(m->room, room, NAME_LEN - 1);
+    xmsg_push(shard, m);
+}
+
+// entrega un buffer ya armado a una conexión de cualquier shard, sin copiarlo
+void deliver_shared(reactor_t *r, conn_ref_t to, msgbuf_t *b)
+{
+    if (to.shard != r->id)
+    {
+        xmsg_send(to.shard, XMSG_DELIVER, to.fd, to.gen, NULL, b, NULL, NULL);
+        return;
+    }
+    client_t *c = get_client(r, to.fd);
+    // el destino pudo desconectarse y su fd reutilizarse
+    if (c == NULL || c->gen != to.gen || c->state != CONN_ACTIVE)
+        return;
+    queue_shared(r, c, b);
+}
+
+// entrega un frame a una conexión de cualquier shard
+void deliver_frame(reactor_t *r, conn_ref_t to, const void *data, size_t len)
+{
+    if (to.shard != r->id)
+    {
+        msgbuf_t *b = msgbuf_new(data, len);
+        if (b == NULL)
+            return;
+        deliver_shared(r, to, b);
+        msgbuf_release(b);
+        return;
+    }
+    client_t *c = get_client(r, to.fd);
+    // el destino pudo desconectarse y su fd reutilizarse
+    if (c == NULL || c->gen != to.gen || c->state != CONN_ACTIVE)
+        return;
+    queue_frame(r, c, data, len);
+}
+
+// sendmsg o room_msg codificado en version; NULL si no entra o no hay memoria
+msgbuf_t *encode_message(uint16_t opcode, int version, const char *orig, const char *to,
+                         const unsigned char *body, size_t body_len)
+{
+    size_t len = msg_frame_len(opcode, version, orig, to, body, body_len);
+    if (len == 0)
+        return NULL;
+    msgbuf_t *b = msgbuf_alloc(len);
+    if (b == NULL)
+        return NULL;
+    b->len = encode_msg_frame(b->data, opcode, version, orig, to, body, body_len);
+    return b;
+}
+
+// arma un paquete user_event, devuelve su largo
+size_t encode_user_event(unsigned char *buf, uint16_t action, const char *username)
 {
     uint16_t hdr[2] = {htons(OPCODE_USER_EVENT), htons(action)};
-    int ulen = strlen(username) + 1;
-    unsigned char buf[4 + NAME_LEN + 1];
+    size_t ulen = strlen(username) + 1;
     memcpy(buf, hdr, 4);
     memcpy(buf + 4, username, ulen);
-    send(sockfd, buf, 4 + ulen, 0);
+    return 4 + ulen;
+}
+
+/* Agrega una entrada a una secuencia de frames USER_LIST en b. *count_off
+ * apunta al contador del frame abierto (0 si no hay ninguno); se abre otro
+ * al llegar al máximo de entradas. En v2 cada frame lleva su prefijo, que
+ * se actualiza con cada entrada. */
+int user_list_add(bytebuf_t *b, size_t *count_off, int version, uint16_t action, const char *username)
+{
+    uint16_t count = 0;
+    if (*count_off)
+        memcpy(&count, b->data + *count_off, 2);
+    count = ntohs(count);
+    if (*count_off == 0 || count == USER_LIST_MAX_ENTRIES)
+    {
+        uint16_t hdr[2] = {htons(OPCODE_USER_LIST), 0};
+        unsigned char prefix[V2_LEN_SIZE] = {0};
+        if ((version >= PROTOCOL_V2 && bytebuf_put(b, prefix, V2_LEN_SIZE) < 0) || bytebuf_put(b, hdr, 4) < 0)
+            return -1;
+        *count_off = b->len - 2;
+        count = 0;
+    }
+    uint8_t act = action;
+    if (bytebuf_put(b, &act, 1) < 0 || bytebuf_put(b, username, strlen(username) + 1) < 0)
+        return -1;
+    count = htons(count + 1);
+    memcpy(b->data + *count_off, &count, 2);
+    if (version >= PROTOCOL_V2)
+        put_v2_len(b->data + *count_off - V2_HDR_SIZE, b->len - (*count_off - 2));
+    return 0;
 }
 
-// notifica a todos excepto idx_exclude
-void broadcast_user_event(uint16_t action, const char *username, int idx_exclude)
+/* Anota un alta/baja local; sale con el próximo lote. from es la conexión
+ * que se dio de alta (NULL en una baja), que no recibe su propia alta. */
+void add_presence(reactor_t *r, uint16_t action, const char *username, client_t *from)
 {
-    pthread_mutex_lock(&clients_mutex);
+    if (r->presence_len == r->presence_cap)
+    {
+        int cap = r->presence_cap ? r->presence_cap * 2 : INITIAL_CLIENTS;
+        presence_t *tmp = realloc(r->presence, cap * sizeof(presence_t));
+        if (tmp == NULL)
+            return;
+        r->presence = tmp;
+        r->presence_cap = cap;
+    }
+    if (r->presence_len == 0)
+        r->presence_deadline_ms = now_ms() + presence_interval_ms;
+    presence_t *p = &r->presence[r->presence_len++];
+    p->action = action;
+    strncpy(p->username, username, NAME_LEN - 1);
+    p->username[NAME_LEN - 1] = '\0';
+    p->fd = from ? from->sockfd : -1;
+    p->gen = from ? from->gen : 0;
+    if (from)
+        from->announcing = 1;
+}
 
-    for (int i = 0; i < MAX_CLIENTS; i++)
+// reparte un lote ya codificado a los activos de este shard
+void deliver_presence(reactor_t *r, msgbuf_t *v1, msgbuf_t *list, msgbuf_t *list_v2)
+{
+    for (int fd = r->active.head; fd >= 0; fd = r->clients[fd]->next)
     {
-        if (i != idx_exclude && clients[i].sockfd > 0)
+        client_t *c = r->clients[fd];
+        if (c->version >= PROTOCOL_V2)
+            queue_shared(r, c, list_v2);
+        else
+            queue_shared(r, c, (c->caps & CAP_USER_LIST) ? list : v1);
+    }
+}
+
+/* Codifica el lote de este shard en los tres formatos (USER_EVENT sueltos
+ * para clientes viejos, USER_LIST para los nuevos y USER_LIST con prefijo
+ * para v2), sin las altas de la conexión skip_fd/skip_gen (-1: ninguna).
+ * 1 si armó los tres buffers, 0 si no quedó nada, -1 si no hay memoria. */
+int encode_presence(reactor_t *r, int skip_fd, uint32_t skip_gen, msgbuf_t *out[3])
+{
+    bytebuf_t v1 = {0}, list = {0}, list_v2 = {0};
+    size_t count_off = 0, count_off_v2 = 0;
+    int res = -1;
+    out[0] = out[1] = out[2] = NULL;
+    for (int i = 0; i < r->presence_len; i++)
+    {
+        presence_t *p = &r->presence[i];
+        if (skip_fd >= 0 && p->fd == skip_fd && p->gen == skip_gen)
+            continue;
+        unsigned char ev[4 + NAME_LEN + 1];
+        size_t ev_len = encode_user_event(ev, p->action, p->username);
+        if (bytebuf_put(&v1, ev, ev_len) < 0 ||
+            user_list_add(&list, &count_off, PROTOCOL_V1, p->action, p->username) < 0 ||
+            user_list_add(&list_v2, &count_off_v2, PROTOCOL_V2, p->action, p->username) < 0)
+            goto out;
+    }
+    if (v1.len == 0)
+    {
+        res = 0;
+        goto out;
+    }
+    out[0] = msgbuf_new(v1.data, v1.len);
+    out[1] = msgbuf_new(list.data, list.len);
+    out[2] = msgbuf_new(list_v2.data, list_v2.len);
+    res = out[0] && out[1] && out[2] ? 1 : -1;
+
+out:
+    free(v1.data);
+    free(list.data);
+    free(list_v2.data);
+    return res;
+}
+
+void release_presence(msgbuf_t *bufs[3])
+{
+    for (int i = 0; i < 3; i++)
+    {
+        if (bufs[i])
+            msgbuf_release(bufs[i]);
+    }
+}
+
+/* Codifica el lote una sola vez y todos los destinatarios, de este shard y
+ * de los demás, comparten esos buffers. Las conexiones que se dieron de
+ * alta en esta ventana (todas de este shard) reciben uno propio sin su alta,
+ * así ningún cliente, tampoco uno viejo, se ve llegar a sí mismo. */
+void flush_presence(reactor_t *r)
+{
+    if (r->presence_len == 0)
+        return;
+
+    msgbuf_t *all[3];
+    if (encode_presence(r, -1, 0, all) == 1)
+    {
+        for (int fd = r->active.head; fd >= 0; fd = r->clients[fd]->next)
+        {
+            client_t *c = r->clients[fd];
+            msgbuf_t *own[3] = {NULL, NULL, NULL};
+            msgbuf_t **b = all;
+            if (c->announcing)
+            {
+                c->announcing = 0;
+                if (encode_presence(r, fd, c->gen, own) != 1)
+                {
+                    release_presence(own);
+                    continue;
+                }
+                b = own;
+            }
+            if (c->version >= PROTOCOL_V2)
+                queue_shared(r, c, b[2]);
+            else
+                queue_shared(r, c, (c->caps & CAP_USER_LIST) ? b[1] : b[0]);
+            release_presence(own);
+        }
+        for (int s = 0; s < nworkers; s++)
         {
-            send_user_event(clients[i].sockfd, action, username);
+            if (s != r->id)
+                xmsg_send(s, XMSG_PRESENCE, -1, 0, NULL, all[0], all[1], all[2]);
         }
     }
-    pthread_mutex_unlock(&clients_mutex);
+    release_presence(all);
+    r->presence_len = 0;
+}
+
+// índice de la sala en las del cliente, -1 si no es miembro
+int find_room_ref(const client_t *c, const room_t *room)
+{
+    for (int i = 0; i < c->nrooms; i++)
+    {
+        if (c->rooms[i].room == room)
+            return i;
+    }
+    return -1;
 }
 
-void *client_thread(void *arg)
+// saca al cliente de su sala i; el miembro que ocupa su lugar en la sala actualiza su índice
+void drop_room_ref(reactor_t *r, client_t *c, int i)
 {
-    int idx = *(int *)arg;
-    free(arg);
-    pthread_mutex_lock(&clients_mutex);
-    int thread_id = next_thread_id++;
-    int fd = clients[idx].sockfd;
+    room_t *room = c->rooms[i].room;
+    int moved = room_remove_member(&r->rooms, room, c->rooms[i].idx);
+    if (moved >= 0)
+    {
+        client_t *m = r->clients[moved];
+        m->rooms[find_room_ref(m, room)].idx = c->rooms[i].idx;
+    }
+    c->rooms[i] = c->rooms[--c->nrooms];
+}
+
+void disconnect_client(reactor_t *r, int fd)
+{
+    client_t *c = r->clients[fd];
+    list_remove(r, c->state == CONN_HANDSHAKE ? &r->handshakes : &r->active, fd);
+    while (c->nrooms > 0)
+        drop_room_ref(r, c, c->nrooms - 1);
+    free(c->rooms);
+    r->clients[fd] = NULL;
+    // antes de sacarlo del registro: si vuelve a conectarse, los encuentra
+    if (c->replay)
+        offline_abort(c->replay);
+
+    // close() también lo quita del epoll
+    close(fd);
+    int slot = c->slot;
     char name[NAME_LEN];
-    strncpy(name, clients[idx].username, NAME_LEN);
-    pthread_mutex_unlock(&clients_mutex);
+    strncpy(name, c->username, NAME_LEN);
+    free(c->rx);
+    outq_clear(&c->outq);
+    free(c);
+    if (slot < 0)
+        return;
+    registry_remove(slot);
 
-    printf("Thread[%d]: handling '%s' fd=%d\n", thread_id, name, fd);
+    // notificar a todos de desconexión
+    add_presence(r, ACTION_DISCONNECT, name, NULL);
+    log_info("Reactor[%d]: '%s' disconnected (%zu online)", r->id, name, registry_count());
+}
 
-    // loop de mensajes
-    while (1)
+typedef struct
+{
+    reactor_t *r;
+    client_t *c;
+    bytebuf_t buf;
+    size_t count_off;
+    int failed;
+} user_list_arg_t;
+
+void add_user_list_entry(const registry_entry_t *e, void *arg)
+{
+    user_list_arg_t *a = arg;
+    if (e->conn.shard == a->r->id && e->conn.fd == a->c->sockfd)
+        return;
+    if (a->c->caps & CAP_USER_LIST)
     {
-        uint16_t net_op;
-        if (read(fd, &net_op, 2) <= 0)
-            break;
-        if (ntohs(net_op) != OPCODE_SENDMSG)
-            continue;
+        if (user_list_add(&a->buf, &a->count_off, a->c->version, ACTION_CONNECT, e->username) < 0)
+            a->failed = 1;
+        return;
+    }
+    unsigned char ev[4 + NAME_LEN + 1];
+    size_t len = encode_user_event(ev, ACTION_CONNECT, e->username);
+    if (bytebuf_put(&a->buf, ev, len) < 0)
+        a->failed = 1;
+}
 
-        char orig[NAME_LEN] = {0}, dest[NAME_LEN] = {0}, msg[BUFFER_SIZE] = {0};
-        if (read_null_string(fd, orig, NAME_LEN - 1) <= 0)
-            break;
-        if (read_null_string(fd, dest, NAME_LEN - 1) <= 0)
-            break;
-        if (read_null_string(fd, msg, BUFFER_SIZE - 1) <= 0)
-            break;
+// foto de los usuarios conectados para el recién llegado, en un solo push
+int send_user_list(reactor_t *r, client_t *c)
+{
+    user_list_arg_t list = {r, c, {0}, 0, 0};
+    registry_foreach(add_user_list_entry, &list);
+    if (!list.failed && list.buf.len > 0)
+        queue_frame(r, c, list.buf.data, list.buf.len);
+    free(list.buf.data);
+    return list.failed ? -1 : 0;
+}
+
+// encola un ERROR con su código y texto
+void queue_error(reactor_t *r, client_t *c, uint16_t code, const char *text)
+{
+    unsigned char err[4 + 64];
+    uint16_t err_hdr[2] = {htons(OPCODE_ERROR), htons(code)};
+    memcpy(err, err_hdr, 4);
+    int n = snprintf((char *)err + 4, sizeof(err) - 4, "%s", text);
+    if (n >= (int)sizeof(err) - 4)
+        n = sizeof(err) - 5;
+    queue_ctrl(r, c, err, 4 + n + 1);
+}
 
-        printf("Thread[%d]: %s -> %s : %s\n", thread_id, orig, dest, msg);
+// connect_request + registro, -1 si hay que cerrar la conexión
+int handle_connect(reactor_t *r, client_t *c, const char *name, uint16_t caps, int version)
+{
+    int client_fd = c->sockfd;
+    log_info("Server: connect_request '%s' fd=%d v%d", name, client_fd, version);
+
+    // desde acá, incluido un rechazo, se le habla en su versión
+    c->version = version >= PROTOCOL_V2 ? PROTOCOL_V2 : PROTOCOL_V1;
+    if (c->version >= PROTOCOL_V2)
+        caps |= CAP_USER_LIST;
+
+    if (name[0] == '\0')
+    {
+        queue_error(r, c, INVALID_USERNAME_ERROR_CODE, "Invalid username");
+        c->closing = CLOSE_AFTER_FLUSH;
+        log_info("Server: empty username on fd=%d, rejected", client_fd);
+        return 0;
+    }
+
+    // registrar cliente; falla si el nombre ya existe
+    conn_ref_t self = {r->id, client_fd, c->gen, c->version};
+    int slot = registry_add(name, self);
+    if (slot == -2)
+        return -1;
+    if (slot < 0)
+    {
+        queue_error(r, c, DUPLICATE_USERNAME_ERROR_CODE, "Username taken");
+        c->closing = CLOSE_AFTER_FLUSH;
+        log_info("Server: duplicate username '%s', rejected", name);
+        return 0;
+    }
+
+    strncpy(c->username, name, NAME_LEN - 1);
+    c->slot = slot;
+    c->caps = caps;
+    list_remove(r, &r->handshakes, client_fd);
+    c->state = CONN_ACTIVE;
+    list_insert(r, &r->active, client_fd);
+
+    // enviar lista de usuarios existentes
+    if (send_user_list(r, c) < 0)
+        return -1;
+
+    // notificar a todos los demás el nuevo usuario
+    add_presence(r, ACTION_CONNECT, name, c);
+
+    // lo que le llegó mientras estaba desconectado, en una sola escritura antes del ACK
+    if (offline_dir)
+    {
+        msgbuf_t *stored = offline_take(name, c->version, &c->replay);
+        if (stored)
+        {
+            log_info("Server: replaying %zu stored bytes to '%s'", stored->len, name);
+            // puede pasar del límite de la cola: se lo permite hasta vaciarla
+            c->replay_bytes = stored->len;
+            if (outq_push_shared(&c->outq, stored) < 0)
+                c->closing = CLOSE_NOW;
+            c->replay_left = c->outq.bytes;
+            msgbuf_release(stored);
+            mark_dirty(r, c);
+        }
+    }
 
-        pthread_mutex_lock(&clients_mutex);
-        // reenviar a destinatario
-        for (int j = 0; j < MAX_CLIENTS; j++)
+    // send ACK
+    uint16_t ack_msg[2] = {htons(OPCODE_ACK), htons(USER_SUCCESFULLY_CONNECTED_ACK_CODE)};
+    queue_ctrl(r, c, ack_msg, sizeof(ack_msg));
+    log_debug("Server: ACK queued to '%s' fd=%d", name, client_fd);
+    return 0;
+}
+
+// avisa a c que su mensaje a dest se descartó; a diferencia del de nombre repetido, no cierra
+void notify_dropped(reactor_t *r, client_t *c, const char *dest)
+{
+    char text[NAME_LEN + 32];
+    snprintf(text, sizeof(text), "Message to '%s' dropped", dest);
+    queue_error(r, c, MESSAGE_DROPPED_ERROR_CODE, text);
+}
+
+/* Entrega un mensaje de c (orig) a dest, o lo guarda si dest está
+ * desconectado. raw es el frame tal como llegó, en raw_version, y se
+ * reenvía así si el destino habla esa versión; si no (o si raw es NULL, un
+ * mensaje sacado de un lote) se codifica de nuevo. Si no se puede ni
+ * entregar ni guardar se le avisa a c con un ERROR. */
+void route_message(reactor_t *r, client_t *c, const char *orig, const char *dest, const unsigned char *body,
+                   size_t body_len, const unsigned char *raw, size_t raw_len, int raw_version)
+{
+    conn_ref_t to;
+    msgbuf_t *enc = NULL;
+    if (registry_lookup(dest, &to) < 0)
+    {
+        if (offline_dir == NULL)
+        {
+            counter_add(&r->metrics->dropped, 1);
+            return;
+        }
+        if (raw == NULL)
         {
-            if (clients[j].sockfd > 0 && strcmp(clients[j].username, dest) == 0)
+            // se guarda en v2, que puede representar cualquier mensaje
+            if ((enc = encode_message(OPCODE_SENDMSG, PROTOCOL_V2, orig, dest, body, body_len)) == NULL)
             {
-                unsigned char buf[BUFFER_SIZE];
-                int off = 0;
-                memcpy(buf + off, &net_op, 2);
-                off += 2;
-                int l = strlen(orig) + 1;
-                memcpy(buf + off, orig, l);
-                off += l;
-                l = strlen(dest) + 1;
-                memcpy(buf + off, dest, l);
-                off += l;
-                l = strlen(msg) + 1;
-                memcpy(buf + off, msg, l);
-                off += l;
-                send(clients[j].sockfd, buf, off, 0);
-                printf("Thread[%d]: forwarded to '%s' fd=%d %d bytes\n",
-                       thread_id, dest, clients[j].sockfd, off);
-                break;
+                counter_add(&r->metrics->dropped, 1);
+                notify_dropped(r, c, dest);
+                return;
             }
+            raw = enc->data;
+            raw_len = enc->len;
+            raw_version = PROTOCOL_V2;
+        }
+        int res = offline_append(dest, raw, raw_len, raw_version, &to);
+        if (res == 0)
+            log_debug("Reactor[%d]: '%s' is offline, message stored", r->id, dest);
+        else if (res < 0)
+        {
+            if (res == OFFLINE_FULL)
+                log_debug("Reactor[%d]: offline store full for '%s', dropped", r->id, dest);
+            else
+                log_warn("Reactor[%d]: could not store message for '%s', dropped", r->id, dest);
+            notify_dropped(r, c, dest);
+        }
+        if (res != 1)
+        {
+            counter_add(res == 0 ? &r->metrics->stored : &r->metrics->dropped, 1);
+            goto out;
         }
-        pthread_mutex_unlock(&clients_mutex);
     }
 
-    // desconexión
-    pthread_mutex_lock(&clients_mutex);
-    clients[idx].sockfd = 0;
-    clients[idx].username[0] = '\0';
-    pthread_mutex_unlock(&clients_mutex);
+    if (raw != NULL && to.version == raw_version)
+        deliver_frame(r, to, raw, raw_len);
+    else
+    {
+        msgbuf_t *b = encode_message(OPCODE_SENDMSG, to.version, orig, dest, body, body_len);
+        if (b == NULL)
+        {
+            log_warn("Reactor[%d]: message to '%s' does not fit protocol v%d, dropped",
+                     r->id, dest, to.version);
+            counter_add(&r->metrics->dropped, 1);
+            notify_dropped(r, c, dest);
+            goto out;
+        }
+        deliver_shared(r, to, b);
+        raw_len = b->len;
+        msgbuf_release(b);
+    }
+    counter_add(&r->metrics->forwarded, 1);
+    hist_record(&r->metrics->forward_latency, metrics_now_ns() - r->rx_ns);
+    log_debug("Reactor[%d]: forwarded to '%s' shard=%d fd=%d %zu bytes",
+              r->id, dest, to.shard, to.fd, raw_len);
+out:
+    if (enc)
+        msgbuf_release(enc);
+}
 
-    // notificar a todos de desconexión
-    broadcast_user_event(ACTION_DISCONNECT, name, idx);
+// reenvía el frame SENDMSG tal como llegó si el destino también es v1
+void forward_message(reactor_t *r, client_t *c, const frame_t *f, const unsigned char *raw, size_t raw_len)
+{
+    log_debug("Reactor[%d]: %s -> %s : %s", r->id, f->orig, f->dest, f->msg);
+    route_message(r, c, f->orig, f->dest, (const unsigned char *)f->msg, strlen(f->msg),
+                  raw, raw_len, PROTOCOL_V1);
+}
 
-    close(fd);
-    printf("Thread[%d]: '%s' disconnected\n", thread_id, name);
-    return NULL;
+// entrega cada mensaje de un sendmsg v2 por separado
+void forward_batch(reactor_t *r, client_t *c, const frame_v2_t *f, const unsigned char *raw, size_t raw_len)
+{
+    char orig[NAME_LEN], dest[NAME_LEN];
+    field_to_name(f->orig, orig);
+    const unsigned char *p = f->entries;
+    for (int i = 0; i < f->count; i++)
+    {
+        field_t to, body;
+        v2_next_entry(&p, &to, &body);
+        field_to_name(to, dest);
+        log_debug("Reactor[%d]: %s -> %s : %zu bytes", r->id, orig, dest, body.len);
+        // con un solo mensaje el frame ya es el que recibe un destino v2
+        route_message(r, c, orig, dest, body.data, body.len, f->count == 1 ? raw : NULL, raw_len,
+                      PROTOCOL_V2);
+    }
 }
 
-int main(int argc, char *argv[])
+void join_room(reactor_t *r, client_t *c, const char *name)
 {
-    if (argc != 2)
-        exit(1);
-    int port = atoi(argv[1]);
+    if (c->nrooms == c->rooms_cap)
+    {
+        int cap = c->rooms_cap ? c->rooms_cap * 2 : 4;
+        room_ref_t *tmp = realloc(c->rooms, cap * sizeof(room_ref_t));
+        if (tmp == NULL)
+            return;
+        c->rooms = tmp;
+        c->rooms_cap = cap;
+    }
+    room_t *room = room_get_or_create(&r->rooms, name);
+    if (room == NULL || find_room_ref(c, room) >= 0)
+        return;
+    int idx = room_add_member(room, c->sockfd);
+    if (idx < 0)
+    {
+        room_drop_if_empty(&r->rooms, room); // pudo haberse creado recién
+        return;
+    }
+    c->rooms[c->nrooms++] = (room_ref_t){room, idx};
+    log_info("Reactor[%d]: '%s' joined room '%s'", r->id, c->username, name);
+}
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+void leave_room(reactor_t *r, client_t *c, const char *name)
+{
+    room_t *room = room_find(&r->rooms, name);
+    int i = room ? find_room_ref(c, room) : -1;
+    if (i < 0)
+        return;
+    drop_room_ref(r, c, i);
+    log_info("Reactor[%d]: '%s' left room '%s'", r->id, c->username, name);
+}
 
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
-    bind(server_fd, (struct sockaddr *)&addr, sizeof(addr));
-    listen(server_fd, MAX_CLIENTS);
+/* Reparte un room_msg a los miembros de la sala en este shard, a cada uno
+ * en su versión. v1 es NULL si el mensaje no entra en v1. */
+void deliver_room(reactor_t *r, const char *name, msgbuf_t *v1, msgbuf_t *v2, int exclude_fd)
+{
+    room_t *room = room_find(&r->rooms, name);
+    if (room == NULL)
+        return;
+    for (int i = 0; i < room->count; i++)
+    {
+        if (room->members[i] == exclude_fd)
+            continue;
+        client_t *m = r->clients[room->members[i]];
+        msgbuf_t *b = m->version >= PROTOCOL_V2 ? v2 : v1;
+        if (b)
+            queue_shared(r, m, b);
+    }
+}
 
-    printf("Server[%d]: listening on port %d...\n", getpid(), port);
+/* El frame se copia una sola vez a un buffer compartido por versión: cada
+ * miembro, en cualquier shard, encola una referencia al de la suya. */
+void post_room(reactor_t *r, client_t *c, const char *orig, const char *name,
+               const unsigned char *body, size_t body_len, const unsigned char *raw, size_t raw_len)
+{
+    room_t *room = room_find(&r->rooms, name);
+    if (room == NULL || find_room_ref(c, room) < 0)
+        return; // sólo los miembros pueden escribir en la sala
 
-    while (1)
+    msgbuf_t *own = msgbuf_new(raw, raw_len);
+    if (own == NULL)
+        return;
+    int v2_sender = c->version >= PROTOCOL_V2;
+    msgbuf_t *other = encode_message(OPCODE_ROOM_MSG, v2_sender ? PROTOCOL_V1 : PROTOCOL_V2,
+                                     orig, name, body, body_len);
+    msgbuf_t *v1 = v2_sender ? other : own;
+    msgbuf_t *v2 = v2_sender ? own : other;
+    deliver_room(r, name, v1, v2, c->sockfd);
+    for (int s = 0; s < nworkers; s++)
     {
-        int client_fd = accept(server_fd, NULL, NULL);
-        if (client_fd < 0)
+        if (s != r->id)
+            xmsg_send(s, XMSG_ROOM, -1, 0, name, v1, NULL, v2);
+    }
+    counter_add(&r->metrics->room_posts, 1);
+    hist_record(&r->metrics->forward_latency, metrics_now_ns() - r->rx_ns);
+    msgbuf_release(own);
+    if (other)
+        msgbuf_release(other);
+}
+
+// despacha un frame completo, -1 si hay que cerrar la conexión
+int handle_frame(reactor_t *r, client_t *c, const frame_t *f, const unsigned char *raw, size_t raw_len)
+{
+    if (c->state == CONN_HANDSHAKE)
+    {
+        // lo primero tiene que ser un connect_request
+        if (f->opcode == OPCODE_CONNECT)
+            return handle_connect(r, c, f->username, 0, PROTOCOL_V1);
+        if (f->opcode == OPCODE_CONNECT_EXT && f->version >= PROTOCOL_V1)
+            return handle_connect(r, c, f->username, f->caps, f->version);
+        return -1;
+    }
+
+    switch (f->opcode)
+    {
+    case OPCODE_SENDMSG:
+        forward_message(r, c, f, raw, raw_len);
+        break;
+    case OPCODE_ROOM_JOIN:
+        join_room(r, c, f->room);
+        break;
+    case OPCODE_ROOM_LEAVE:
+        leave_room(r, c, f->room);
+        break;
+    case OPCODE_ROOM_MSG:
+        post_room(r, c, f->orig, f->room, (const unsigned char *)f->msg, strlen(f->msg), raw, raw_len);
+        log_debug("Reactor[%d]: %s -> #%s : %s", r->id, f->orig, f->room, f->msg);
+        break;
+    case OPCODE_USER_EVENT:
+        if (f->action == ACTION_DISCONNECT)
+            return -1;
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+// como handle_frame para una conexión v2, que ya pasó el handshake
+int handle_frame_v2(reactor_t *r, client_t *c, const frame_v2_t *f, const unsigned char *raw, size_t raw_len)
+{
+    char orig[NAME_LEN], room[NAME_LEN];
+    switch (f->opcode)
+    {
+    case OPCODE_SENDMSG:
+        forward_batch(r, c, f, raw, raw_len);
+        break;
+    case OPCODE_ROOM_JOIN:
+        field_to_name(f->room, room);
+        join_room(r, c, room);
+        break;
+    case OPCODE_ROOM_LEAVE:
+        field_to_name(f->room, room);
+        leave_room(r, c, room);
+        break;
+    case OPCODE_ROOM_MSG:
+        field_to_name(f->orig, orig);
+        field_to_name(f->room, room);
+        post_room(r, c, orig, room, f->body.data, f->body.len, raw, raw_len);
+        log_debug("Reactor[%d]: %s -> #%s : %zu bytes", r->id, orig, room, f->body.len);
+        break;
+    case OPCODE_USER_EVENT:
+        if (f->action == ACTION_DISCONNECT)
+            return -1;
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+void count_frame(reactor_t *r, uint16_t opcode)
+{
+    counter_add(&r->metrics->frames_in[opcode < METRICS_OPCODES ? opcode : 0], 1);
+}
+
+/* Parsea y despacha el frame al comienzo de buf según la versión de la
+ * conexión. Devuelve los bytes consumidos, PARSE_INCOMPLETE, o
+ * PARSE_INVALID si hay que cerrar la conexión. */
+int next_frame(reactor_t *r, client_t *c, const unsigned char *buf, size_t len)
+{
+    int k;
+    if (c->version >= PROTOCOL_V2)
+    {
+        frame_v2_t f;
+        k = parse_frame_v2(buf, len, max_frame_v2_len, max_body_len, &f);
+        if (k > 0)
+            count_frame(r, f.opcode);
+        if (k > 0 && handle_frame_v2(r, c, &f, buf, k) < 0)
+            return PARSE_INVALID;
+        return k;
+    }
+    frame_t f;
+    k = parse_frame(buf, len, &f);
+    if (k > 0)
+        count_frame(r, f.opcode);
+    if (k > 0 && handle_frame(r, c, &f, buf, k) < 0)
+        return PARSE_INVALID;
+    return k;
+}
+
+// guarda el frame incompleto del final hasta el próximo recv
+int save_pending(client_t *c, const unsigned char *data, size_t len)
+{
+    if (len == 0)
+    {
+        free(c->rx);
+        c->rx = NULL;
+        c->rx_len = c->rx_cap = 0;
+        return 0;
+    }
+    if (c->rx_cap < len)
+    {
+        // en v2 lo pendiente puede ser casi todo el scratch
+        size_t cap = len > MAX_FRAME_LEN ? len : MAX_FRAME_LEN;
+        unsigned char *tmp = realloc(c->rx, cap);
+        if (tmp == NULL)
+            return -1;
+        c->rx = tmp;
+        c->rx_cap = cap;
+    }
+    memmove(c->rx, data, len);
+    c->rx_len = len;
+    return 0;
+}
+
+/* Un frame v2 más grande que el scratch se recibe directo en c->rx, con
+ * el largo que anunció, y se despacha desde ahí sin pasar por el scratch.
+ * Devuelve 1 si lo despachó, 0 si el socket se vació antes o -1 si hay que
+ * cerrar la conexión. */
+int recv_large_frame(reactor_t *r, client_t *c)
+{
+    size_t total = frame_v2_len(c->rx, c->rx_len);
+    if (c->rx_cap < total)
+    {
+        unsigned char *tmp = realloc(c->rx, total);
+        if (tmp == NULL)
+            return -1;
+        c->rx = tmp;
+        c->rx_cap = total;
+    }
+    while (c->rx_len < total)
+    {
+        ssize_t n = recv(c->sockfd, c->rx + c->rx_len, total - c->rx_len, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
             continue;
-        printf("Server: accepted fd=%d\n", client_fd);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        c->rx_len += n;
+        counter_add(&r->metrics->bytes_in, n);
+        r->rx_ns = metrics_now_ns();
+    }
+
+    int k = next_frame(r, c, c->rx, total);
+    // no se guarda un buffer tan grande para el próximo frame
+    save_pending(c, NULL, 0);
+    return k == (int)total ? 1 : -1;
+}
 
-        // connect_request
-        uint16_t net_op;
-        if (read(client_fd, &net_op, 2) != 2 || ntohs(net_op) != OPCODE_CONNECT)
+// procesa todos los frames disponibles de un cliente, -1 si se desconectó
+int handle_client(reactor_t *r, client_t *c)
+{
+    unsigned char *scratch = r->rx_scratch;
+    while (1)
+    {
+        if (c->version >= PROTOCOL_V2 && frame_v2_len(c->rx, c->rx_len) > RX_CHUNK)
         {
-            close(client_fd);
+            int res = recv_large_frame(r, c);
+            if (res <= 0)
+                return res;
+            if (c->closing)
+                return 0;
             continue;
         }
-        char name[NAME_LEN] = {0};
-        if (read_null_string(client_fd, name, NAME_LEN - 1) <= 0)
-        {
-            close(client_fd);
+
+        // el frame parcial de la vuelta anterior va adelante de lo nuevo
+        size_t len = c->rx_len;
+        if (len > 0)
+            memcpy(scratch, c->rx, len);
+        size_t room = RX_CHUNK - len;
+        ssize_t n = recv(c->sockfd, scratch + len, room, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
             continue;
-        }
-        printf("Server: connect_request '%s' fd=%d\n", name, client_fd);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        len += n;
+        counter_add(&r->metrics->bytes_in, n);
+        r->rx_ns = metrics_now_ns();
 
-        pthread_mutex_lock(&clients_mutex);
-        // duplicate check
-        int duplicate = 0;
-        for (int j = 0; j < MAX_CLIENTS; j++)
+        size_t off = 0;
+        while (off < len)
         {
-            if (clients[j].sockfd > 0 && strcmp(clients[j].username, name) == 0)
-            {
-                duplicate = 1;
+            int k = next_frame(r, c, scratch + off, len - off);
+            if (k == PARSE_INCOMPLETE)
                 break;
-            }
+            if (k == PARSE_INVALID)
+                return -1;
+            off += k;
+            // ya rechazado: lo que siga no se procesa
+            if (c->closing)
+                return 0;
         }
-        if (duplicate)
-        {
-            uint16_t err_hdr[2] = {htons(OPCODE_ERROR), htons(DUPLICATE_USERNAME_ERROR_CODE)};
-            const char *err_txt = "Username taken";
-            send(client_fd, err_hdr, 4, 0);
-            send(client_fd, err_txt, strlen(err_txt) + 1, 0);
-            close(client_fd);
-            printf("Server: duplicate username '%s', rejected\n", name);
-            pthread_mutex_unlock(&clients_mutex);
+        if (save_pending(c, scratch + off, len - off) < 0)
+            return -1;
+
+        // lectura corta: el socket quedó vacío, el próximo dato trae otro evento
+        if ((size_t)n < room)
+            return 0;
+    }
+}
+
+// vacía la cola de salida; cierra si corresponde
+void flush_client(reactor_t *r, client_t *c)
+{
+    if (c->closing == CLOSE_NOW)
+    {
+        disconnect_client(r, c->sockfd);
+        return;
+    }
+    size_t queued = c->outq.bytes;
+    int res = outq_flush(&c->outq, c->sockfd);
+    size_t sent = queued - c->outq.bytes;
+    counter_add(&r->metrics->bytes_out, sent);
+    if (res == OUTQ_DRAINED)
+        c->replay_bytes = 0;
+    // la cola sale en orden: escrito lo que había hasta el reenvío, ya no hace falta guardarlo
+    if (c->replay && sent >= c->replay_left)
+    {
+        offline_commit(c->replay);
+        c->replay = NULL;
+    }
+    else if (c->replay)
+        c->replay_left -= sent;
+    if (res == OUTQ_ERROR || (res == OUTQ_DRAINED && c->closing == CLOSE_AFTER_FLUSH))
+        disconnect_client(r, c->sockfd);
+    // OUTQ_PENDING: sigue cuando llegue EPOLLOUT
+}
+
+void flush_dirty(reactor_t *r)
+{
+    // una desconexión puede encolar avisos y agrandar la lista mientras se recorre
+    for (int i = 0; i < r->dirty_len; i++)
+    {
+        client_t *c = get_client(r, r->dirty_fds[i]);
+        if (c == NULL || !c->dirty)
             continue;
+        c->dirty = 0;
+        flush_client(r, c);
+    }
+    r->dirty_len = 0;
+}
+
+// entrega lo que mandaron los otros shards
+void drain_inbox(reactor_t *r)
+{
+    uint64_t count;
+    if (read(r->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        log_error("read eventfd: %s", strerror(errno));
+
+    mpsc_node_t *n = mpsc_take_all(&r->inbox);
+    while (n)
+    {
+        xmsg_t *m = (xmsg_t *)n;
+        n = n->next;
+        switch (m->kind)
+        {
+        case XMSG_PRESENCE:
+            deliver_presence(r, m->buf, m->list, m->v2);
+            msgbuf_release(m->list);
+            break;
+        case XMSG_ROOM:
+            deliver_room(r, m->room, m->buf, m->v2, -1);
+            break;
+        default:
+        {
+            client_t *c = get_client(r, m->fd);
+            // el destino pudo desconectarse y su fd reutilizarse
+            if (c && c->gen == m->gen && c->state == CONN_ACTIVE)
+                queue_shared(r, c, m->buf);
+            break;
+        }
         }
+        if (m->buf)
+            msgbuf_release(m->buf);
+        if (m->v2)
+            msgbuf_release(m->v2);
+        free(m);
+    }
+}
+
+// cierra los handshakes que no terminaron a tiempo
+void expire_handshakes(reactor_t *r, uint64_t now)
+{
+    while (r->handshakes.head >= 0 && r->clients[r->handshakes.head]->deadline_ms <= now)
+    {
+        int fd = r->handshakes.head;
+        log_info("Server: handshake timeout fd=%d", fd);
+        disconnect_client(r, fd);
+    }
+}
+
+// milisegundos hasta el próximo vencimiento, para epoll_wait
+int next_timeout_ms(reactor_t *r, uint64_t now)
+{
+    if (r->accept_pending)
+        return 0;
+    uint64_t deadline = UINT64_MAX;
+    if (r->handshakes.head >= 0)
+        deadline = r->clients[r->handshakes.head]->deadline_ms;
+    if (r->presence_len > 0 && r->presence_deadline_ms < deadline)
+        deadline = r->presence_deadline_ms;
+    if (deadline == UINT64_MAX)
+        return -1;
+    return deadline > now ? (int)(deadline - now) : 0;
+}
 
-        // find free slot
-        int idx = -1;
-        for (int i = 0; i < MAX_CLIENTS; i++)
+/* Acepta un lote del backlog. Si quedan conexiones se sigue en la próxima
+ * vuelta del loop, así una tormenta de reconexiones no posterga el tráfico
+ * de los que ya están conectados. */
+void handle_accept(reactor_t *r)
+{
+    r->accept_pending = 1;
+    uint64_t deadline = now_ms() + handshake_timeout_ms;
+    for (int i = 0; i < ACCEPT_BATCH; i++)
+    {
+        int client_fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0)
         {
-            if (clients[i].sockfd == 0)
-            {
-                idx = i;
-                break;
-            }
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_error("accept4: %s", strerror(errno));
+            r->accept_pending = 0;
+            return;
         }
-        if (idx < 0)
+
+        client_t *c = calloc(1, sizeof(client_t));
+        if (c == NULL || clients_reserve(r, client_fd) < 0)
         {
+            free(c);
             close(client_fd);
-            pthread_mutex_unlock(&clients_mutex);
             continue;
         }
+        r->clients[client_fd] = c;
+        c->sockfd = client_fd;
+        c->gen = r->next_gen++;
+        c->state = CONN_HANDSHAKE;
+        c->slot = -1;
+        c->version = PROTOCOL_V1;
+        c->deadline_ms = deadline;
+        list_insert(r, &r->handshakes, client_fd);
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client_fd;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
+        {
+            log_error("epoll_ctl: %s", strerror(errno));
+            disconnect_client(r, client_fd);
+        }
+    }
+}
 
-        // registrar cliente
-        clients[idx].sockfd = client_fd;
-        strncpy(clients[idx].username, name, NAME_LEN - 1);
+void *reactor_loop(void *arg)
+{
+    reactor_t *r = arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, next_timeout_ms(r, now_ms()));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_error("epoll_wait: %s", strerror(errno));
+            break;
+        }
 
-        // enviar lista de usuarios existentes
-        for (int k = 0; k < MAX_CLIENTS; k++)
+        for (int i = 0; i < n; i++)
         {
-            if (clients[k].sockfd > 0 && k != idx)
+            int fd = events[i].data.fd;
+            if (fd == r->listen_fd)
+            {
+                handle_accept(r);
+                continue;
+            }
+            if (fd == r->event_fd)
+            {
+                drain_inbox(r);
+                continue;
+            }
+            client_t *c = get_client(r, fd);
+            if (c == NULL)
+                continue; // cerrado antes en esta misma vuelta
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
             {
-                send_user_event(client_fd, ACTION_CONNECT, clients[k].username);
+                if (handle_client(r, c) < 0)
+                {
+                    disconnect_client(r, fd);
+                    continue;
+                }
             }
+            if ((events[i].events & EPOLLOUT) && c->outq.bytes > 0)
+                mark_dirty(r, c);
+        }
+
+        if (r->accept_pending)
+            handle_accept(r);
+        uint64_t now = now_ms();
+        expire_handshakes(r, now);
+        if (r->presence_len > 0 && r->presence_deadline_ms <= now)
+            flush_presence(r);
+
+        // todo el I/O de salida sale acá, fuera de cualquier lock
+        flush_dirty(r);
+    }
+    return NULL;
+}
+
+// listener propio del shard; SO_REUSEPORT reparte las conexiones entre shards
+int create_listener(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int reactor_init(reactor_t *r, int id)
+{
+    memset(r, 0, sizeof(*r));
+    r->id = id;
+    r->handshakes.head = r->handshakes.tail = -1;
+    r->active.head = r->active.tail = -1;
+    mpsc_init(&r->inbox);
+
+    if ((r->metrics = metrics_new()) == NULL)
+    {
+        perror("metrics_new");
+        return -1;
+    }
+    if ((r->listen_fd = create_listener(listen_port)) < 0)
+    {
+        perror("listener");
+        return -1;
+    }
+    if ((r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        perror("eventfd");
+        return -1;
+    }
+    if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = r->listen_fd;
+    epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listen_fd, &ev);
+    ev.data.fd = r->event_fd;
+    epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->event_fd, &ev);
+    return 0;
+}
+
+void *reactor_thread(void *arg)
+{
+    reactor_t *r = arg;
+
+    // un shard por core
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(r->id % ncpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    metrics_bind(r->metrics);
+    return reactor_loop(r);
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-w workers] [-q max_queue_bytes] [-t handshake_timeout_ms] "
+                    "[-p presence_interval_ms] [-o offline_dir] [-m max_body_bytes] "
+                    "[-l error|warn|info|debug] [-a admin_socket] <port>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    if (log_init(STDOUT_FILENO) < 0)
+    {
+        perror("log_init");
+        exit(1);
+    }
+
+    int opt, level;
+    while ((opt = getopt(argc, argv, "w:q:t:p:o:m:l:a:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'q':
+            max_queue_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            handshake_timeout_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            presence_interval_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            offline_dir = optarg;
+            break;
+        case 'm':
+            max_body_len = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            if ((level = log_level_from_str(optarg)) < 0)
+                usage(argv[0]);
+            log_set_level(level);
+            break;
+        case 'a':
+            admin_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
         }
+    }
+    // el largo de un frame v2 tiene que entrar en el int que devuelve el parser
+    if (optind != argc - 1 || nworkers < 1 || nworkers > MAX_WORKERS ||
+        max_body_len > INT_MAX - V2_FRAME_OVERHEAD)
+        usage(argv[0]);
+    listen_port = atoi(argv[optind]);
+    max_frame_v2_len = max_body_len + V2_FRAME_OVERHEAD;
 
-        pthread_mutex_unlock(&clients_mutex);
+    // las del thread principal, que toma el lock del registro al inicializarlo
+    metrics_t *main_metrics = metrics_new();
+    if (main_metrics == NULL)
+    {
+        perror("metrics_new");
+        exit(1);
+    }
+    metrics_bind(main_metrics);
 
-        // notificar a todos el nuevo usuario
-        broadcast_user_event(ACTION_CONNECT, name, idx);
+    if (registry_init(INITIAL_CLIENTS) < 0)
+    {
+        perror("registry_init");
+        exit(1);
+    }
+    if (offline_dir && offline_init(offline_dir) < 0)
+    {
+        perror("offline_init");
+        exit(1);
+    }
 
-        // send ACK
-        uint16_t ack_msg[2] = {htons(OPCODE_ACK), htons(USER_SUCCESFULLY_CONNECTED_ACK_CODE)};
-        send(client_fd, ack_msg, sizeof(ack_msg), 0);
-        printf("Server: ACK sent to '%s' fd=%d\n", name, client_fd);
+    if (admin_path && metrics_serve(admin_path) < 0)
+    {
+        perror("metrics_serve");
+        exit(1);
+    }
 
-        // spawn thread
-        pthread_t tid;
-        int *pidx = malloc(sizeof(int));
-        *pidx = idx;
-        pthread_create(&tid, NULL, client_thread, pidx);
-        pthread_detach(tid);
-        printf("Server: thread %d created for '%s' idx=%d\n", next_thread_id - 1, name, idx);
+    reactors = calloc(nworkers, sizeof(reactor_t));
+    if (reactors == NULL)
+    {
+        perror("calloc");
+        exit(1);
     }
+    for (int i = 0; i < nworkers; i++)
+    {
+        if (reactor_init(&reactors[i], i) < 0)
+            exit(1);
+    }
+
+    log_info("Server[%d]: listening on port %d with %d worker(s)...", getpid(), listen_port, nworkers);
 
+    for (int i = 0; i < nworkers; i++)
+    {
+        if (pthread_create(&reactors[i].thread, NULL, reactor_thread, &reactors[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(reactors[i].thread, NULL);
     return 0;
 }
@@ -0,0 +1,310 @@
+#define _GNU_SOURCE // syscall(SYS_gettid)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+
+#define RING_SLOTS 1024 // potencia de 2
+#define DRAIN_INTERVAL_MS 10
+#define OUT_BUF_SIZE (64 * 1024)
+
+typedef struct
+{
+    log_record_t hdr;
+    char msg[LOG_MSG_MAX];
+} slot_t;
+
+/* Ring de un thread. head lo mueve sólo el dueño y tail sólo el que
+ * descarga, así que alcanza con loads/stores atómicos, sin CAS. Cuando el
+ * thread termina el ring queda libre para el próximo que arranque. */
+typedef struct ring
+{
+    struct ring *next; // lista de todos los rings; sólo se agregan
+    atomic_int in_use;
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+    slot_t slots[RING_SLOTS];
+} ring_t;
+
+atomic_int log_threshold = LOG_INFO;
+
+static _Atomic(ring_t *) rings = NULL;
+static __thread ring_t *my_ring = NULL;
+static __thread uint32_t my_tid = 0;
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static int out_fd = STDOUT_FILENO;
+static int out_format = LOG_FORMAT_TEXT;
+
+// todo lo de abajo es de quien descarga: el thread de fondo o log_flush
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char out[OUT_BUF_SIZE];
+static size_t out_len = 0;
+static uint64_t dropped_reported = 0;
+
+static void release_ring(void *arg)
+{
+    ring_t *r = arg;
+    atomic_store_explicit(&r->in_use, 0, memory_order_release);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+
+// ring del thread que llama: uno libre de un thread que terminó o uno nuevo
+static ring_t *get_ring(void)
+{
+    if (my_ring)
+        return my_ring;
+    pthread_once(&key_once, make_key);
+
+    for (ring_t *r = atomic_load_explicit(&rings, memory_order_acquire); r; r = r->next)
+    {
+        int idle = 0;
+        if (atomic_compare_exchange_strong(&r->in_use, &idle, 1))
+        {
+            my_ring = r;
+            break;
+        }
+    }
+    if (my_ring == NULL)
+    {
+        ring_t *r = calloc(1, sizeof(ring_t));
+        if (r == NULL)
+            return NULL;
+        atomic_init(&r->in_use, 1);
+        r->next = atomic_load_explicit(&rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&rings, &r->next, r, memory_order_release,
+                                                      memory_order_relaxed))
+            ;
+        my_ring = r;
+    }
+    pthread_setspecific(ring_key, my_ring);
+    return my_ring;
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+    ring_t *r = get_ring();
+    if (r == NULL)
+        return;
+    uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (h - atomic_load_explicit(&r->tail, memory_order_acquire) == RING_SLOTS)
+    {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    if (my_tid == 0)
+        my_tid = syscall(SYS_gettid);
+
+    slot_t *s = &r->slots[h & (RING_SLOTS - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    s->hdr.ts_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    s->hdr.tid = my_tid;
+    s->hdr.level = level;
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(s->msg, LOG_MSG_MAX, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        n = 0;
+    s->hdr.len = n < LOG_MSG_MAX ? n : LOG_MSG_MAX - 1;
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+static void out_flush(void)
+{
+    size_t off = 0;
+    while (off < out_len)
+    {
+        ssize_t w = write(out_fd, out + off, out_len - off);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            break; // sin salida no hay a quién avisarle
+        off += w;
+    }
+    out_len = 0;
+}
+
+static void out_put(const void *data, size_t len)
+{
+    if (out_len + len > sizeof(out))
+        out_flush();
+    memcpy(out + out_len, data, len);
+    out_len += len;
+}
+
+static void emit(const log_record_t *h, const char *msg)
+{
+    if (out_format == LOG_FORMAT_BINARY)
+    {
+        out_put(h, sizeof(*h));
+        out_put(msg, h->len);
+        return;
+    }
+
+    char line[64 + LOG_MSG_MAX];
+    time_t sec = h->ts_ns / 1000000000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    size_t n = strftime(line, 32, "%Y-%m-%d %H:%M:%S", &tm);
+    n += snprintf(line + n, sizeof(line) - n, ".%06u %c [%u] ",
+                  (unsigned)(h->ts_ns % 1000000000 / 1000), "EWID"[h->level & 3], h->tid);
+    memcpy(line + n, msg, h->len);
+    n += h->len;
+    line[n++] = '\n';
+    out_put(line, n);
+}
+
+// baja lo que haya en todos los rings; con drain_lock tomado
+static void drain_all(void)
+{
+    uint64_t dropped = 0;
+    for (ring_t *r = atomic_load_explicit(&rings, memory_order_acquire); r; r = r->next)
+    {
+        uint64_t t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint64_t h = atomic_load_explicit(&r->head, memory_order_acquire);
+        for (; t != h; t++)
+        {
+            slot_t *s = &r->slots[t & (RING_SLOTS - 1)];
+            emit(&s->hdr, s->msg);
+        }
+        // recién ahora el dueño puede volver a usar esos slots
+        atomic_store_explicit(&r->tail, t, memory_order_release);
+        dropped += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    }
+
+    if (dropped > dropped_reported)
+    {
+        slot_t s = {0};
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        s.hdr.ts_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        s.hdr.tid = syscall(SYS_gettid);
+        s.hdr.level = LOG_WARN;
+        s.hdr.len = snprintf(s.msg, LOG_MSG_MAX, "log: %llu record(s) dropped, ring full",
+                             (unsigned long long)(dropped - dropped_reported));
+        emit(&s.hdr, s.msg);
+        dropped_reported = dropped;
+    }
+    out_flush();
+}
+
+void log_flush(void)
+{
+    pthread_mutex_lock(&drain_lock);
+    drain_all();
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void *drain_thread(void *arg)
+{
+    (void)arg;
+    struct timespec interval = {0, DRAIN_INTERVAL_MS * 1000000};
+    while (1)
+    {
+        log_flush();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+static int start_drain_thread(void)
+{
+    pthread_t t;
+    if (pthread_create(&t, NULL, drain_thread, NULL) != 0)
+        return -1;
+    pthread_detach(t);
+    return 0;
+}
+
+// que el hijo de un fork no encuentre el lock tomado por un thread que no existe
+static void before_fork(void)
+{
+    pthread_mutex_lock(&drain_lock);
+}
+
+static void after_fork_parent(void)
+{
+    pthread_mutex_unlock(&drain_lock);
+}
+
+/* Lo pendiente en los rings copiados lo baja el padre. Del hijo sólo
+ * queda el thread que hizo el fork: los demás rings se liberan. */
+static void after_fork_child(void)
+{
+    for (ring_t *r = atomic_load_explicit(&rings, memory_order_acquire); r; r = r->next)
+    {
+        atomic_store(&r->tail, atomic_load(&r->head));
+        atomic_store(&r->dropped, 0);
+        if (r != my_ring)
+            atomic_store(&r->in_use, 0);
+    }
+    dropped_reported = 0;
+    my_tid = 0;
+    pthread_mutex_unlock(&drain_lock);
+    start_drain_thread();
+}
+
+static void flush_at_exit(void)
+{
+    log_flush();
+}
+
+int log_level_from_str(const char *s)
+{
+    static const char *names[] = {"error", "warn", "info", "debug"};
+    for (int i = LOG_ERROR; i <= LOG_DEBUG; i++)
+    {
+        if (strcmp(s, names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+void log_set_level(int level)
+{
+    if (level < LOG_ERROR)
+        level = LOG_ERROR;
+    if (level > LOG_DEBUG)
+        level = LOG_DEBUG;
+    atomic_store_explicit(&log_threshold, level, memory_order_relaxed);
+}
+
+uint64_t log_dropped(void)
+{
+    uint64_t total = 0;
+    for (ring_t *r = atomic_load_explicit(&rings, memory_order_acquire); r; r = r->next)
+        total += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    return total;
+}
+
+int log_init(int fd)
+{
+    out_fd = fd;
+    const char *level = getenv("LOG_LEVEL");
+    if (level && log_level_from_str(level) >= 0)
+        log_set_level(log_level_from_str(level));
+    const char *format = getenv("LOG_FORMAT");
+    if (format && strcmp(format, "binary") == 0)
+        out_format = LOG_FORMAT_BINARY;
+
+    if (pthread_atfork(before_fork, after_fork_parent, after_fork_child) != 0)
+        return -1;
+    atexit(flush_at_exit);
+    return start_drain_thread();
+}
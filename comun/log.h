@@ -0,0 +1,71 @@
+#ifndef COMUN_LOG_H
+#define COMUN_LOG_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Logger asincrónico compartido por los dos servidores. Cada thread escribe
+ * sus registros en un ring propio (un productor, un consumidor) sin locks
+ * ni syscalls; un thread de fondo los junta y los baja en tandas con un
+ * solo write. Si el ring de un thread está lleno el registro se descarta y
+ * se cuenta: loguear nunca bloquea al que atiende clientes.
+ *
+ * Nivel y formato se eligen al arrancar con las variables de entorno
+ * LOG_LEVEL (error, warn, info, debug) y LOG_FORMAT (text, binary), y el
+ * nivel se puede cambiar después con log_set_level. */
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#define LOG_FORMAT_TEXT 0
+#define LOG_FORMAT_BINARY 1
+
+// lo que entra del mensaje de un registro; el resto se corta
+#define LOG_MSG_MAX 240
+
+/* Registro binario, tal como sale con LOG_FORMAT=binary: esta cabecera
+ * seguida de len bytes de mensaje, sin '\n'. */
+typedef struct
+{
+    uint64_t ts_ns; // CLOCK_REALTIME
+    uint32_t tid;
+    uint16_t len;
+    uint8_t level;
+    uint8_t pad;
+} log_record_t;
+
+extern atomic_int log_threshold;
+
+/* Arranca el thread de descarga hacia fd. Lo vuelve a arrancar en los hijos
+ * de un fork y baja lo pendiente al salir con exit(). */
+int log_init(int fd);
+
+void log_set_level(int level);
+
+// "error", "warn", "info" o "debug"; -1 si no es ninguno
+int log_level_from_str(const char *s);
+
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// baja todo lo encolado hasta ahora, desde el thread que llama
+void log_flush(void);
+
+// registros descartados por rings llenos desde el arranque
+uint64_t log_dropped(void);
+
+// el formato sólo se evalúa si el nivel está habilitado
+#define log_at(level, ...)                                                        \
+    do                                                                            \
+    {                                                                             \
+        if ((level) <= atomic_load_explicit(&log_threshold, memory_order_relaxed)) \
+            log_write((level), __VA_ARGS__);                                      \
+    } while (0)
+
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
+#endif
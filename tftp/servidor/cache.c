@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "cache.h"
+
+#define CACHE_BUCKETS 256 // potencia de 2
+
+struct cache_entrada
+{
+    char *nombre;
+    dev_t dev;
+    ino_t ino;
+    size_t tam;
+    struct timespec mtime, ctime;
+    uint8_t *datos;
+    int refs;    // transferencias que la están mandando
+    int vigente; // en la tabla; si no, se libera con la última referencia
+
+    struct cache_entrada *sig; // en el bucket
+    struct cache_entrada *lru_prev, *lru_next;
+};
+
+struct cache
+{
+    pthread_mutex_t lock;
+    size_t presupuesto;
+    size_t ocupado; // lo mapeado, incluidas las entradas viejas todavía en uso
+    cache_entrada_t *buckets[CACHE_BUCKETS];
+    cache_entrada_t *lru_primero, *lru_ultimo; // la más reciente primero
+};
+
+static unsigned hash_nombre(const char *s)
+{
+    unsigned h = 2166136261u; // FNV-1a
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    return h & (CACHE_BUCKETS - 1);
+}
+
+static int misma_version(const cache_entrada_t *e, const struct stat *st)
+{
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->tam == (size_t)st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           e->ctime.tv_sec == st->st_ctim.tv_sec && e->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static void lru_sacar(cache_t *c, cache_entrada_t *e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        c->lru_primero = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        c->lru_ultimo = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_al_frente(cache_t *c, cache_entrada_t *e)
+{
+    e->lru_next = c->lru_primero;
+    if (c->lru_primero)
+        c->lru_primero->lru_prev = e;
+    else
+        c->lru_ultimo = e;
+    c->lru_primero = e;
+}
+
+static void liberar(cache_entrada_t *e)
+{
+    munmap(e->datos, e->tam);
+    free(e->nombre);
+    free(e);
+}
+
+// libera, ya sin el lock, las entradas que se juntaron en basura
+static void liberar_lista(cache_entrada_t *basura)
+{
+    while (basura)
+    {
+        cache_entrada_t *sig = basura->sig;
+        liberar(basura);
+        basura = sig;
+    }
+}
+
+/* La saca de la tabla; si alguien la está mandando sigue viva hasta que la
+ * suelte. Si no, deja de contar en ocupado y pasa a basura, para hacer el
+ * munmap después de soltar el lock. */
+static void descartar(cache_t *c, cache_entrada_t *e, cache_entrada_t **basura)
+{
+    cache_entrada_t **p = &c->buckets[hash_nombre(e->nombre)];
+    while (*p != e)
+        p = &(*p)->sig;
+    *p = e->sig;
+    lru_sacar(c, e);
+    e->vigente = 0;
+    if (e->refs == 0)
+    {
+        c->ocupado -= e->tam;
+        e->sig = *basura;
+        *basura = e;
+    }
+}
+
+// descarta las menos usadas que nadie usa hasta que entren tam bytes más
+static int hacer_lugar(cache_t *c, size_t tam, cache_entrada_t **basura)
+{
+    cache_entrada_t *e = c->lru_ultimo;
+    while (e && c->ocupado + tam > c->presupuesto)
+    {
+        cache_entrada_t *prev = e->lru_prev;
+        if (e->refs == 0)
+        {
+            log_debug("caché: descarto \"%s\" (%zu bytes)", e->nombre, e->tam);
+            descartar(c, e, basura);
+        }
+        e = prev;
+    }
+    return c->ocupado + tam <= c->presupuesto ? 0 : -1;
+}
+
+static cache_entrada_t *buscar(cache_t *c, const char *filename)
+{
+    cache_entrada_t *e = c->buckets[hash_nombre(filename)];
+    while (e && strcmp(e->nombre, filename) != 0)
+        e = e->sig;
+    return e;
+}
+
+/* Abre y mapea filename en una entrada nueva, todavía fuera de la tabla; se
+ * llama sin el lock. Deja en st el fstat de lo que se abrió, que es lo que
+ * vale por si el archivo cambió desde el stat del nombre. */
+static cache_entrada_t *cargar(cache_t *c, const char *filename, struct stat *st)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    cache_entrada_t *e = NULL;
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode) || st->st_size == 0 || (size_t)st->st_size > c->presupuesto)
+        goto fin;
+    void *datos = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (datos == MAP_FAILED)
+    {
+        log_debug("caché: mmap de \"%s\": %s", filename, strerror(errno));
+        goto fin;
+    }
+    // que el kernel vaya leyendo todo mientras se mandan los primeros bloques
+    madvise(datos, st->st_size, MADV_WILLNEED);
+
+    if ((e = calloc(1, sizeof(cache_entrada_t))) == NULL || (e->nombre = strdup(filename)) == NULL)
+    {
+        free(e);
+        e = NULL;
+        munmap(datos, st->st_size);
+        goto fin;
+    }
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->tam = st->st_size;
+    e->mtime = st->st_mtim;
+    e->ctime = st->st_ctim;
+    e->datos = datos;
+fin:
+    close(fd);
+    return e;
+}
+
+// la pone en la tabla como la vigente de su nombre; con el lock tomado
+static void insertar(cache_t *c, cache_entrada_t *e)
+{
+    unsigned h = hash_nombre(e->nombre);
+    e->vigente = 1;
+    e->sig = c->buckets[h];
+    c->buckets[h] = e;
+    lru_al_frente(c, e);
+    c->ocupado += e->tam;
+    log_debug("caché: cargo \"%s\" (%zu bytes, %zu de %zu ocupados)", e->nombre, e->tam, c->ocupado,
+              c->presupuesto);
+}
+
+cache_t *cache_create(size_t presupuesto)
+{
+    cache_t *c = calloc(1, sizeof(cache_t));
+    if (c)
+    {
+        pthread_mutex_init(&c->lock, NULL);
+        c->presupuesto = presupuesto;
+    }
+    return c;
+}
+
+/* El lock sólo cubre buscar e insertar en la tabla: el open, el mmap y los
+ * munmap de lo que se descarta se hacen sin tomarlo, para que un archivo que
+ * tarda en abrirse no frene a los workers que mandan otros. */
+cache_entrada_t *cache_obtener(cache_t *c, const char *filename, const uint8_t **datos, size_t *tam)
+{
+    struct stat st;
+    if (stat(filename, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || (size_t)st.st_size > c->presupuesto)
+        return NULL;
+
+    cache_entrada_t *basura = NULL;
+    pthread_mutex_lock(&c->lock);
+    cache_entrada_t *e = buscar(c, filename);
+    if (e && !misma_version(e, &st))
+    {
+        log_debug("caché: \"%s\" cambió, lo vuelvo a cargar", filename);
+        descartar(c, e, &basura);
+        e = NULL;
+    }
+    if (e)
+    {
+        lru_sacar(c, e);
+        lru_al_frente(c, e);
+        e->refs++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    liberar_lista(basura);
+    basura = NULL;
+
+    if (e == NULL)
+    {
+        cache_entrada_t *nueva = cargar(c, filename, &st);
+        if (nueva == NULL)
+            return NULL;
+        pthread_mutex_lock(&c->lock);
+        // otro worker pudo haberlo cargado mientras tanto; si es la misma versión se usa esa
+        if ((e = buscar(c, filename)) && misma_version(e, &st))
+        {
+            lru_sacar(c, e);
+            lru_al_frente(c, e);
+            nueva->sig = basura;
+            basura = nueva;
+        }
+        else
+        {
+            if (e)
+                descartar(c, e, &basura);
+            if (hacer_lugar(c, nueva->tam, &basura) < 0)
+            {
+                nueva->sig = basura;
+                basura = nueva;
+                e = NULL;
+            }
+            else
+                insertar(c, e = nueva);
+        }
+        if (e)
+            e->refs++;
+        pthread_mutex_unlock(&c->lock);
+        liberar_lista(basura);
+        if (e == NULL)
+            return NULL;
+    }
+
+    *datos = e->datos;
+    *tam = e->tam;
+    return e;
+}
+
+void cache_soltar(cache_t *c, cache_entrada_t *e)
+{
+    pthread_mutex_lock(&c->lock);
+    int libre = --e->refs == 0 && !e->vigente;
+    if (libre)
+        c->ocupado -= e->tam;
+    pthread_mutex_unlock(&c->lock);
+    if (libre)
+        liberar(e);
+}
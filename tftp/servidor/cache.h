@@ -0,0 +1,32 @@
+#ifndef TFTP_CACHE_H
+#define TFTP_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Caché de archivos para RRQ: cada archivo pedido queda mapeado una sola vez
+ * y todas las transferencias que lo leen a la vez mandan desde esas mismas
+ * páginas, sin abrirlo ni mapearlo de nuevo. Las que nadie está usando se
+ * descartan de la menos usada a la más usada cuando el total mapeado pasa del
+ * presupuesto. Antes de reusar una entrada se compara un stat del nombre con
+ * el que tenía al cargarla (dispositivo, inodo, tamaño, mtime y ctime): si el
+ * archivo cambió o se reemplazó, se carga de nuevo. Con varios workers hay
+ * una sola para todos, así un archivo se mapea una vez y el presupuesto es del
+ * servidor: un mutex cubre la tabla, que sólo se toca al empezar y al
+ * terminar una RRQ; los bloques se mandan desde el mapa sin tomarlo. */
+
+typedef struct cache cache_t;
+typedef struct cache_entrada cache_entrada_t;
+
+cache_t *cache_create(size_t presupuesto);
+
+/* La entrada vigente de filename con una referencia más, cargándola si hace
+ * falta; datos y tam apuntan al contenido. NULL si no se puede cachear (no
+ * existe, no es un archivo regular, está vacío o no entra en el
+ * presupuesto): el llamador lo lee por su cuenta y reporta el error. */
+cache_entrada_t *cache_obtener(cache_t *c, const char *filename, const uint8_t **datos, size_t *tam);
+
+// la transferencia terminó de usar e
+void cache_soltar(cache_t *c, cache_entrada_t *e);
+
+#endif
@@ -0,0 +1,537 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "engine.h"
+
+#define MAX_EVENTS 256
+#define REPORTE_NS 10000000000ull // cada cuánto se informa cuánto se agrupa la E/S
+
+/* Rueda de timers: WHEEL_SLOTS listas de WHEEL_TICK_NS cada una, ~2 s por
+ * vuelta. Un deadline más lejano queda en su slot y se saltea hasta la
+ * vuelta que le toca. Armar, mover y vencer un timer es O(1). */
+#define WHEEL_SLOTS 512 // potencia de 2
+#define WHEEL_TICK_NS 4000000ull
+
+#define URING_ENTRADAS 1024 // operaciones que se juntan antes de tener que mandarlas
+#define URING_PEDIDOS 16    // recepciones encoladas en el socket de pedidos
+
+// la espera del aviso del escritor, sin dueño como las recepciones del socket de pedidos
+#define OP_AVISO_ESCRITOR 4
+
+struct engine
+{
+    int epfd;
+    int listen_fd;
+    transfer_config_t cfg;
+    transfer_compartido_t comp; // sin caché si no hay socket de pedidos o el presupuesto es 0
+    int max_transfers;
+    int activas;
+    uint64_t tick; // el último que se procesó
+    int armados;
+    transfer_t *wheel[WHEEL_SLOTS];
+
+    // E/S del socket de pedidos más la de las transferencias que terminaron
+    udp_stats_t io, io_reportado;
+    uint64_t reporte_ns;
+
+    /* io_uring en vez de epoll: cada socket tiene recepciones encoladas y lo
+     * que mandan todas las transferencias sale junto en un io_uring_enter */
+    uring_t *uring;
+    tftp_packet_t *pedidos; // buffers de las recepciones del socket de pedidos
+    int fijo_listen;
+    uint64_t llamadas_reportadas, ops_reportadas;
+};
+
+static void timer_unlink(engine_t *e, transfer_t *t)
+{
+    if (t->timer_tick == 0)
+        return;
+    if (t->timer_prev)
+        t->timer_prev->timer_next = t->timer_next;
+    else
+        e->wheel[t->timer_tick & (WHEEL_SLOTS - 1)] = t->timer_next;
+    if (t->timer_next)
+        t->timer_next->timer_prev = t->timer_prev;
+    t->timer_prev = t->timer_next = NULL;
+    t->timer_tick = 0;
+    e->armados--;
+}
+
+// vuelve a poner a t en la rueda según su deadline_ns
+static void timer_update(engine_t *e, transfer_t *t)
+{
+    timer_unlink(e, t);
+    if (t->deadline_ns == 0)
+        return;
+    uint64_t tick = (t->deadline_ns + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+    if (tick <= e->tick)
+        tick = e->tick + 1;
+    transfer_t **slot = &e->wheel[tick & (WHEEL_SLOTS - 1)];
+    t->timer_tick = tick;
+    t->timer_next = *slot;
+    if (*slot)
+        (*slot)->timer_prev = t;
+    *slot = t;
+    e->armados++;
+}
+
+static void liberar(engine_t *e, transfer_t *t)
+{
+    if (e->uring)
+        uring_soltar(e->uring, t->fijo);
+    transfer_free(t);
+}
+
+static void terminar(engine_t *e, transfer_t *t)
+{
+    timer_unlink(e, t);
+    udp_stats_sumar(&e->io, &t->io);
+    e->activas--;
+    if (e->uring == NULL)
+        epoll_ctl(e->epfd, EPOLL_CTL_DEL, t->sockfd, NULL);
+    else if (t->en_vuelo > 0)
+    {
+        // lo encolado antes sale igual; lo demás vuelve cancelado y con lo último se libera
+        t->terminada = 1;
+        uring_cancelar(e->uring, t->sockfd, t->fijo);
+        return;
+    }
+    liberar(e, t);
+}
+
+static void esperar_escritura(engine_t *e, transfer_t *t)
+{
+    uring_op_t *op = uring_esperar(e->uring, t->sockfd, t->fijo, POLLOUT);
+    if (op == NULL)
+        return; // sigue con el timer
+    op->tipo = TRANSFER_OP_ESCRITURA;
+    op->duenio = t;
+    t->en_vuelo++;
+    t->esperando_escritura = 1;
+}
+
+// después de cada llamada a la transferencia: timer e interés en EPOLLOUT
+static void despachar(engine_t *e, transfer_t *t, int r)
+{
+    if (r == TRANSFER_DONE)
+    {
+        terminar(e, t);
+        return;
+    }
+    timer_update(e, t);
+    if (e->uring)
+    {
+        if (t->bloqueado && !t->esperando_escritura)
+            esperar_escritura(e, t);
+        return;
+    }
+    uint32_t eventos = EPOLLIN | (t->bloqueado ? EPOLLOUT : 0);
+    if (eventos != t->eventos)
+    {
+        struct epoll_event ev = {.events = eventos, .data.ptr = t};
+        epoll_ctl(e->epfd, EPOLL_CTL_MOD, t->sockfd, &ev);
+        t->eventos = eventos;
+    }
+}
+
+static void expirar(engine_t *e, uint64_t now)
+{
+    uint64_t hasta = now / WHEEL_TICK_NS;
+    if (e->armados == 0 || hasta <= e->tick)
+    {
+        if (hasta > e->tick)
+            e->tick = hasta;
+        return;
+    }
+
+    // si pasó más de una vuelta alcanza con recorrer cada slot una vez
+    uint64_t desde = hasta - e->tick > WHEEL_SLOTS ? hasta - WHEEL_SLOTS : e->tick;
+    transfer_t *vencidos = NULL;
+    for (uint64_t tick = desde + 1; tick <= hasta; tick++)
+    {
+        transfer_t *t = e->wheel[tick & (WHEEL_SLOTS - 1)];
+        while (t)
+        {
+            transfer_t *next = t->timer_next;
+            if (t->timer_tick <= hasta)
+            {
+                timer_unlink(e, t);
+                t->timer_next = vencidos;
+                vencidos = t;
+            }
+            t = next;
+        }
+    }
+    e->tick = hasta;
+
+    while (vencidos)
+    {
+        transfer_t *t = vencidos;
+        vencidos = t->timer_next;
+        t->timer_next = NULL;
+        despachar(e, t, transfer_on_timeout(t));
+    }
+}
+
+// las transferencias a las que el escritor les terminó algo
+static void atender_escritor(engine_t *e)
+{
+    transfer_t *t;
+    while ((t = escritor_novedad(e->comp.escritor)) != NULL)
+        despachar(e, t, transfer_on_salida(t));
+}
+
+static void atender_pedido(engine_t *e, const tftp_packet_t *pkt, ssize_t n, const struct sockaddr_in *client)
+{
+    if (n < 2)
+    { // mínimo debe traer 2 bytes para el opcode
+        log_debug("Paquete demasiado corto (%zd bytes)", n);
+        return;
+    }
+
+    if (e->activas >= e->max_transfers)
+    {
+        log_warn("Pedido rechazado: ya hay %d transferencias en curso", e->activas);
+        enviar_error(e->listen_fd, client, sizeof(*client), 0, "Server busy");
+        return;
+    }
+
+    transfer_t *t = transfer_start(pkt, n, client, sizeof(*client), &e->cfg, &e->comp);
+    if (t && engine_add(e, t) < 0)
+        transfer_free(t);
+}
+
+static void atender_pedidos(engine_t *e)
+{
+    while (1)
+    {
+        tftp_packet_t pkts[UDP_LOTE_MAX];
+        size_t largos[UDP_LOTE_MAX];
+        struct sockaddr_in clients[UDP_LOTE_MAX];
+
+        int cant = udp_recibir_lote(e->listen_fd, (uint8_t *)pkts, sizeof(pkts[0]), UDP_LOTE_MAX, largos, clients,
+                                    &e->io);
+        if (cant < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_error("recvmmsg: %s", strerror(errno));
+            return;
+        }
+
+        for (int i = 0; i < cant; i++)
+            atender_pedido(e, &pkts[i], largos[i], &clients[i]);
+        if (cant < UDP_LOTE_MAX)
+            return;
+    }
+}
+
+// paquetes por syscall desde el último reporte, si hubo tráfico
+static void reportar(engine_t *e, uint64_t now)
+{
+    udp_stats_t d = e->io;
+    d.tx_syscalls -= e->io_reportado.tx_syscalls;
+    d.tx_paquetes -= e->io_reportado.tx_paquetes;
+    d.rx_syscalls -= e->io_reportado.rx_syscalls;
+    d.rx_paquetes -= e->io_reportado.rx_paquetes;
+    e->reporte_ns = now;
+    if (d.tx_paquetes == 0 && d.rx_paquetes == 0)
+        return;
+    e->io_reportado = e->io;
+    if (e->uring)
+    {
+        // casi todo pasa por el ring: lo que cuenta son las entradas al kernel
+        uint64_t llamadas = uring_llamadas(e->uring) - e->llamadas_reportadas;
+        uint64_t ops = uring_operaciones(e->uring) - e->ops_reportadas;
+        e->llamadas_reportadas += llamadas;
+        e->ops_reportadas += ops;
+        log_info("E/S UDP: %llu paquetes enviados y %llu recibidos con io_uring, %llu operaciones en %llu llamadas "
+                 "a io_uring_enter (%.1f por llamada)",
+                 (unsigned long long)d.tx_paquetes, (unsigned long long)d.rx_paquetes, (unsigned long long)ops,
+                 (unsigned long long)llamadas, llamadas ? (double)ops / llamadas : 0.0);
+        return;
+    }
+    log_info("E/S UDP: %llu paquetes enviados en %llu syscalls (%.1f por syscall), %llu recibidos en %llu (%.1f)",
+             (unsigned long long)d.tx_paquetes, (unsigned long long)d.tx_syscalls,
+             d.tx_syscalls ? (double)d.tx_paquetes / d.tx_syscalls : 0.0, (unsigned long long)d.rx_paquetes,
+             (unsigned long long)d.rx_syscalls, d.rx_syscalls ? (double)d.rx_paquetes / d.rx_syscalls : 0.0);
+}
+
+engine_t *engine_create(int listen_fd, const transfer_config_t *cfg, int max_transfers)
+{
+    engine_t *e = calloc(1, sizeof(engine_t));
+    if (e == NULL)
+        return NULL;
+    e->listen_fd = listen_fd;
+    e->cfg = *cfg;
+    e->max_transfers = max_transfers;
+    e->fijo_listen = -1;
+    e->reporte_ns = now_ns();
+    e->tick = e->reporte_ns / WHEEL_TICK_NS;
+    if ((e->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        free(e);
+        return NULL;
+    }
+    int cache_propia = listen_fd >= 0 && cfg->cache == NULL && cfg->cache_bytes > 0;
+    e->comp.cache = listen_fd >= 0 ? cfg->cache : NULL;
+    if (cache_propia && (e->comp.cache = cache_create(cfg->cache_bytes)) == NULL)
+    {
+        close(e->epfd);
+        free(e);
+        return NULL;
+    }
+    if (listen_fd >= 0)
+    {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+        {
+            close(e->epfd);
+            if (cache_propia)
+                free(e->comp.cache); // todavía vacía
+            free(e);
+            return NULL;
+        }
+    }
+    // sin el hilo igual se puede escribir, desde el engine
+    if (listen_fd >= 0 && cfg->escritor && (e->comp.escritor = escritor_create()) == NULL)
+        log_warn("No se pudo crear el hilo de escritura: %s", strerror(errno));
+    if (e->comp.escritor)
+    {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = e->comp.escritor};
+        if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, escritor_fd(e->comp.escritor), &ev) < 0)
+        {
+            // queda creado, pero sin poder esperar sus avisos no se usa
+            log_warn("epoll_ctl del escritor: %s", strerror(errno));
+            e->comp.escritor = NULL;
+        }
+    }
+    return e;
+}
+
+// recepción encolada en el i-ésimo buffer de t; vuelve a completar()
+static void recibir(engine_t *e, transfer_t *t, int i)
+{
+    uring_op_t *op = uring_recibir(e->uring, t->sockfd, t->fijo, t->rx + i * t->rx_cap, t->rx_cap);
+    if (op == NULL)
+    {
+        log_error("%s: no se pudo encolar una recepción", t->peer_str);
+        return;
+    }
+    op->tipo = TRANSFER_OP_RECEPCION;
+    op->duenio = t;
+    op->dato = i;
+    t->en_vuelo++;
+}
+
+static void recibir_pedido(engine_t *e, int i)
+{
+    uring_op_t *op = uring_recibir(e->uring, e->listen_fd, e->fijo_listen, &e->pedidos[i], sizeof(e->pedidos[i]));
+    if (op == NULL)
+    {
+        log_error("No se pudo encolar una recepción de pedidos");
+        return;
+    }
+    op->tipo = TRANSFER_OP_RECEPCION;
+    op->dato = i;
+}
+
+static void esperar_escritor(engine_t *e)
+{
+    uring_op_t *op = uring_esperar(e->uring, escritor_fd(e->comp.escritor), -1, POLLIN);
+    if (op == NULL)
+    {
+        log_error("No se pudo encolar la espera del escritor");
+        return;
+    }
+    op->tipo = OP_AVISO_ESCRITOR;
+}
+
+static int agregar_uring(engine_t *e, transfer_t *t)
+{
+    if (transfer_preparar_rx(t) < 0)
+    {
+        log_error("malloc: %s", strerror(errno));
+        return -1;
+    }
+    t->uring = e->uring;
+    t->fijo = uring_fijar(e->uring, t->sockfd);
+    for (int i = 0; i < t->rx_cant; i++)
+        recibir(e, t, i);
+    e->activas++;
+    despachar(e, t, TRANSFER_CONTINUE);
+    return 0;
+}
+
+int engine_add(engine_t *e, transfer_t *t)
+{
+    if (e->uring)
+        return agregar_uring(e, t);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = t};
+    if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, t->sockfd, &ev) < 0)
+    {
+        log_error("epoll_ctl: %s", strerror(errno));
+        return -1;
+    }
+    t->eventos = EPOLLIN;
+    e->activas++;
+    despachar(e, t, TRANSFER_CONTINUE);
+    return 0;
+}
+
+// lo que se completó en el ring, de una transferencia o del socket de pedidos (sin dueño)
+static void completar(engine_t *e, uring_op_t *op)
+{
+    transfer_t *t = op->duenio;
+    if (t == NULL && op->tipo == OP_AVISO_ESCRITOR)
+    {
+        uring_liberar(e->uring, op);
+        atender_escritor(e);
+        esperar_escritor(e);
+        return;
+    }
+    if (t == NULL)
+    {
+        if (op->res >= 0)
+        {
+            e->io.rx_paquetes++;
+            atender_pedido(e, &e->pedidos[op->dato], op->res, &op->dir);
+        }
+        else if (op->res != -EAGAIN)
+            log_error("recvmsg: %s", strerror(-op->res));
+        recibir_pedido(e, op->dato);
+        uring_liberar(e->uring, op);
+        return;
+    }
+
+    t->en_vuelo--;
+    // lo más común, un DATA que salió, no cambia nada
+    if (t->terminada || (op->tipo == TRANSFER_OP_ENVIO && op->res >= 0))
+    {
+        uring_liberar(e->uring, op);
+        if (t->terminada && t->en_vuelo == 0)
+            liberar(e, t);
+        return;
+    }
+
+    int r;
+    if (op->tipo == TRANSFER_OP_RECEPCION)
+    {
+        /* Con varias recepciones esperando en el mismo socket, a las que
+         * llegaron tarde a un datagrama el kernel las puede terminar con
+         * EAGAIN (el socket es no bloqueante): se vuelven a encolar. */
+        r = op->res == -EAGAIN ? TRANSFER_CONTINUE
+                               : transfer_on_datagrama(t, t->rx + op->dato * t->rx_cap, op->res, &op->dir);
+        if (r == TRANSFER_CONTINUE)
+            recibir(e, t, op->dato);
+    }
+    else if (op->tipo == TRANSFER_OP_ENVIO)
+        r = transfer_on_enviado(t, op->dato, op->res);
+    else
+    {
+        t->esperando_escritura = 0;
+        r = transfer_on_writable(t);
+    }
+    uring_liberar(e->uring, op);
+    despachar(e, t, r);
+}
+
+/* El ring se crea en el hilo que corre el engine, que es el único que lo
+ * puede usar. Si el kernel no tiene io_uring se sigue con epoll. */
+static int iniciar_uring(engine_t *e)
+{
+    if ((e->uring = uring_create(URING_ENTRADAS, 2 * e->max_transfers + 1)) == NULL ||
+        (e->pedidos = calloc(URING_PEDIDOS, sizeof(tftp_packet_t))) == NULL)
+    {
+        log_warn("No se pudo usar io_uring (%s), sigo con epoll", strerror(errno));
+        if (e->uring)
+            uring_destroy(e->uring);
+        e->uring = NULL;
+        return -1;
+    }
+    // los avisos de MSG_ZEROCOPY llegan por la cola de errores, que acá no se lee
+    if (e->cfg.zerocopy)
+        log_warn("Con io_uring no se usa MSG_ZEROCOPY");
+    e->cfg.zerocopy = 0;
+    e->fijo_listen = uring_fijar(e->uring, e->listen_fd);
+    for (int i = 0; i < URING_PEDIDOS; i++)
+        recibir_pedido(e, i);
+    if (e->comp.escritor)
+        esperar_escritor(e);
+    return 0;
+}
+
+static void correr_uring(engine_t *e)
+{
+    while (e->listen_fd >= 0 || e->activas > 0)
+    {
+        // lo encolado desde la vuelta anterior sale acá; con timers armados se vuelve en cada tick
+        if (uring_entrar(e->uring, e->armados > 0 ? WHEEL_TICK_NS : 0) < 0)
+        {
+            log_error("io_uring_enter: %s", strerror(errno));
+            return;
+        }
+        uring_op_t *op;
+        while ((op = uring_completada(e->uring)) != NULL)
+            completar(e, op);
+        uint64_t now = now_ns();
+        expirar(e, now);
+        if (now - e->reporte_ns >= REPORTE_NS)
+            reportar(e, now);
+    }
+}
+
+void engine_run(engine_t *e)
+{
+    if (e->cfg.uring && e->listen_fd >= 0 && iniciar_uring(e) == 0)
+    {
+        correr_uring(e);
+        return;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (e->listen_fd >= 0 || e->activas > 0)
+    {
+        // con timers armados se despierta en cada tick; si no, sólo por paquetes
+        int timeout_ms = e->armados > 0 ? (int)(WHEEL_TICK_NS / 1000000) : -1;
+        int n = epoll_wait(e->epfd, events, MAX_EVENTS, timeout_ms);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_error("epoll_wait: %s", strerror(errno));
+            return;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            if (e->comp.escritor && events[i].data.ptr == e->comp.escritor)
+            {
+                atender_escritor(e);
+                continue;
+            }
+            transfer_t *t = events[i].data.ptr;
+            if (t == NULL)
+            {
+                atender_pedidos(e);
+                continue;
+            }
+            int r = TRANSFER_CONTINUE;
+            if (events[i].events & (EPOLLIN | EPOLLERR))
+                r = transfer_on_readable(t);
+            if (r == TRANSFER_CONTINUE && (events[i].events & EPOLLOUT))
+                r = transfer_on_writable(t);
+            despachar(e, t, r);
+        }
+        uint64_t now = now_ns();
+        expirar(e, now);
+        if (now - e->reporte_ns >= REPORTE_NS && e->listen_fd >= 0)
+            reportar(e, now);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef TFTP_ENGINE_H
+#define TFTP_ENGINE_H
+
+#include <stdint.h>
+
+#include "transfer.h"
+
+/* Un solo proceso atiende todas las transferencias: epoll sobre el socket
+ * de pedidos y los sockets efímeros, y una rueda de timers para los
+ * deadlines de retransmisión. Con cfg->uring, en vez de epoll cada socket
+ * tiene recepciones encoladas en un io_uring y lo que mandan todas las
+ * transferencias sale junto: una sola syscall por vuelta del loop. */
+
+typedef struct engine engine_t;
+
+/* Sin listen_fd (< 0) el engine sólo atiende lo que se le agregue con
+ * engine_add y engine_run vuelve cuando termina todo: así corre cada hijo
+ * en el modo fork. Los pedidos que superan max_transfers se rechazan. */
+engine_t *engine_create(int listen_fd, const transfer_config_t *cfg, int max_transfers);
+
+int engine_add(engine_t *e, transfer_t *t);
+
+void engine_run(engine_t *e);
+
+#endif
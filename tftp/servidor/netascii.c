@@ -0,0 +1,93 @@
+#include <string.h>
+
+#include "netascii.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CR '\r'
+#define LF '\n'
+
+// posición del primer a o b en p[0..n), o n si no hay
+static size_t buscar(const uint8_t *p, size_t n, uint8_t a, uint8_t b)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+#endif
+    for (; i < n; i++)
+        if (p[i] == a || p[i] == b)
+            return i;
+    return n;
+}
+
+size_t netascii_codificar(const uint8_t *src, size_t n, size_t *consumidos, uint8_t *dst, size_t cap, int *pendiente)
+{
+    size_t in = 0, out = 0;
+    if (*pendiente >= 0 && cap > 0)
+    {
+        dst[out++] = *pendiente;
+        *pendiente = -1;
+    }
+    while (out < cap && in < n)
+    {
+        size_t resto = n - in < cap - out ? n - in : cap - out;
+        size_t corrida = buscar(src + in, resto, CR, LF);
+        memcpy(dst + out, src + in, corrida);
+        in += corrida;
+        out += corrida;
+        if (corrida == resto)
+            continue;
+
+        // LF → CR LF, CR → CR NUL; si el segundo no entra, abre el bloque siguiente
+        uint8_t segundo = src[in++] == LF ? LF : '\0';
+        dst[out++] = CR;
+        if (out < cap)
+            dst[out++] = segundo;
+        else
+            *pendiente = segundo;
+    }
+    *consumidos = in;
+    return out;
+}
+
+size_t netascii_decodificar(const uint8_t *src, size_t n, uint8_t *dst, int *cr)
+{
+    size_t in = 0, out = 0;
+    while (in < n)
+    {
+        if (*cr)
+        {
+            // CR LF → LF, CR NUL → CR; un CR con otra cosa queda como vino
+            *cr = 0;
+            if (src[in] == LF)
+            {
+                dst[out++] = LF;
+                in++;
+                continue;
+            }
+            dst[out++] = CR;
+            if (src[in] == '\0')
+                in++;
+            continue;
+        }
+        size_t corrida = buscar(src + in, n - in, CR, CR);
+        memcpy(dst + out, src + in, corrida);
+        in += corrida;
+        out += corrida;
+        if (in < n)
+        {
+            *cr = 1;
+            in++;
+        }
+    }
+    return out;
+}
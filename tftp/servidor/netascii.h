@@ -0,0 +1,30 @@
+#ifndef TFTP_NETASCII_H
+#define TFTP_NETASCII_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Modo netascii (RFC 1350, fin de línea de RFC 764): en la red cada LF va
+ * como CR LF y cada CR suelto como CR NUL. Se traduce de a bloques: lo que
+ * queda a mitad de una secuencia en el borde de un bloque sigue en el
+ * próximo. Los CR y LF se buscan de a 16 bytes con SSE2 (byte a byte donde
+ * no hay), y lo que hay entre uno y otro se copia entero. */
+
+// de dónde sale un bloque codificado: offset en el archivo y lo que quedó del anterior
+typedef struct
+{
+    uint64_t offset;
+    int pendiente; // el LF o NUL de una secuencia que no entró en el bloque anterior, -1 si no hay
+} netascii_pos_t;
+
+/* Codifica src[0..n) en dst hasta llenar cap bytes o terminar src,
+ * empezando por *pendiente. Devuelve cuántos bytes escribió, deja en
+ * *consumidos cuántos leyó y en *pendiente lo que no entró. */
+size_t netascii_codificar(const uint8_t *src, size_t n, size_t *consumidos, uint8_t *dst, size_t cap, int *pendiente);
+
+/* Decodifica src[0..n) en dst, que tiene que tener lugar para n + 1 bytes.
+ * *cr indica que el bloque anterior terminó en CR, y a la salida si éste
+ * también; al final del archivo ese CR va solo. Devuelve cuántos escribió. */
+size_t netascii_decodificar(const uint8_t *src, size_t n, uint8_t *dst, int *cr);
+
+#endif
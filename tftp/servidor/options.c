@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> // strcasecmp
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "tftp.h"
+
+// valor decimal sin signo; -1 si no es un número o no entra en max
+static int parse_number(const char *s, uint64_t max, uint64_t *out)
+{
+    if (*s < '0' || *s > '9')
+        return -1;
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno != 0 || *end != '\0' || v > max)
+        return -1;
+    *out = v;
+    return 0;
+}
+
+int parse_options(const char *p, const char *end, tftp_options_t *o)
+{
+    memset(o, 0, sizeof(*o));
+    o->blksize = CANT_MAX_DATA;
+    o->windowsize = 1;
+    int accepted = 0;
+    while (p < end)
+    {
+        const char *name = p;
+        const char *name_end = memchr(name, '\0', end - name);
+        if (name_end == NULL)
+            return -1;
+        const char *value = name_end + 1;
+        const char *value_end = value < end ? memchr(value, '\0', end - value) : NULL;
+        if (value_end == NULL)
+            return -1;
+        p = value_end + 1;
+
+        uint64_t v;
+        if (strcasecmp(name, "blksize") == 0)
+        {
+            // menos de 8 no se acepta; más de lo que soportamos se negocia a la baja
+            if (parse_number(value, UINT64_MAX, &v) < 0 || v < TFTP_MIN_BLKSIZE)
+                continue;
+            o->blksize = v < TFTP_MAX_BLKSIZE ? v : TFTP_MAX_BLKSIZE;
+            o->has_blksize = 1;
+        }
+        else if (strcasecmp(name, "tsize") == 0)
+        {
+            if (parse_number(value, UINT64_MAX, &v) < 0)
+                continue;
+            o->tsize = v;
+            o->has_tsize = 1;
+        }
+        else if (strcasecmp(name, "timeout") == 0)
+        {
+            if (parse_number(value, TFTP_MAX_TIMEOUT, &v) < 0 || v < TFTP_MIN_TIMEOUT)
+                continue;
+            o->timeout = v;
+            o->has_timeout = 1;
+        }
+        else if (strcasecmp(name, "windowsize") == 0)
+        {
+            // RFC 7440: 1 a 65535
+            if (parse_number(value, 65535, &v) < 0 || v < 1)
+                continue;
+            o->windowsize = v < TFTP_MAX_WINDOWSIZE ? v : TFTP_MAX_WINDOWSIZE;
+            o->has_windowsize = 1;
+        }
+        else if (strcasecmp(name, "multicast") == 0)
+        {
+            // RFC 2090: en el pedido va sin valor; la dirección la elige el servidor
+            if (*value != '\0')
+                continue;
+            o->has_multicast = 1;
+        }
+        else
+            continue;
+        accepted++;
+    }
+    return accepted;
+}
+
+static size_t put_option(char *buf, size_t cap, size_t off, const char *name, unsigned long long value)
+{
+    int n = snprintf(buf + off, cap - off, "%s%c%llu", name, '\0', value);
+    // snprintf deja el '\0' del valor: también va en el paquete
+    return n < 0 || (size_t)n >= cap - off ? off : off + n + 1;
+}
+
+static size_t put_option_str(char *buf, size_t cap, size_t off, const char *name, const char *value)
+{
+    int n = snprintf(buf + off, cap - off, "%s%c%s", name, '\0', value);
+    return n < 0 || (size_t)n >= cap - off ? off : off + n + 1;
+}
+
+size_t build_oack(char *buf, size_t cap, const tftp_options_t *o)
+{
+    uint16_t opcode = htons(OPCODE_OACK);
+    memcpy(buf, &opcode, 2);
+    size_t off = 2;
+    if (o->has_blksize)
+        off = put_option(buf, cap, off, "blksize", o->blksize);
+    if (o->has_tsize)
+        off = put_option(buf, cap, off, "tsize", o->tsize);
+    if (o->has_timeout)
+        off = put_option(buf, cap, off, "timeout", o->timeout);
+    if (o->has_windowsize)
+        off = put_option(buf, cap, off, "windowsize", o->windowsize);
+    if (o->has_multicast)
+        off = put_option_str(buf, cap, off, "multicast", o->multicast);
+    return off;
+}
@@ -0,0 +1,485 @@
+#define _GNU_SOURCE // renameat2, fallocate
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "salida.h"
+
+// alineación de los buffers: páginas enteras para el page cache
+#define SALIDA_ALINEACION 4096
+
+// qué hace el escritor con un trabajo que no es un buffer
+#define TRABAJO_CERRAR -1    // bajarlo al disco y renombrarlo
+#define TRABAJO_DESCARTAR -2 // borrar el temporal y liberar la salida
+
+// un buffer lleno (o un cierre) esperando al escritor
+typedef struct trabajo
+{
+    salida_t *s;
+    int buf; // o TRABAJO_CERRAR, TRABAJO_DESCARTAR
+    size_t largo;
+    uint64_t offset;
+    struct trabajo *sig;
+} trabajo_t;
+
+struct escritor
+{
+    pthread_t hilo;
+    pthread_mutex_t mu;
+    pthread_cond_t hay_trabajo;
+    trabajo_t *primero, *ultimo;
+    int aviso;           // eventfd para el engine
+    salida_t *novedades; // las que tienen algo para contarle
+};
+
+struct salida
+{
+    int fd;
+    char *final, *temporal;
+    uint8_t *buf[SALIDA_BUFFERS];
+    size_t cap;         // de cada buffer
+    int actual;         // el que se está llenando
+    size_t usado;       // de actual
+    uint64_t offset;    // dónde va actual en el archivo
+    uint64_t reservado; // lo que se reservó con fallocate
+
+    escritor_t *escritor;
+    void *duenio;
+    trabajo_t trabajos[SALIDA_BUFFERS], cierre, baja;
+    // todo lo que sigue, con el mutex del escritor
+    int ocupado[SALIDA_BUFFERS]; // en manos del escritor
+    int error;                   // errno de una escritura del escritor
+    int esperando;               // devolvió SALIDA_LLENA: avisar cuando se libere un buffer
+    int confirmada;              // el escritor terminó el cierre; el resultado está en error
+    int descartada;              // no se avisa más
+    int en_novedades;
+    struct salida *sig_novedad;
+};
+
+static int escribir_todo(int fd, const uint8_t *p, size_t n, uint64_t offset)
+{
+    while (n > 0)
+    {
+        ssize_t w = pwrite(fd, p, n, offset);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+static void liberar(salida_t *s);
+static int cerrar(salida_t *s);
+
+// con el mutex: s pasa a novedades y se despierta al engine
+static void avisar(escritor_t *e, salida_t *s)
+{
+    if (s->descartada || s->en_novedades)
+        return;
+    s->en_novedades = 1;
+    s->sig_novedad = e->novedades;
+    e->novedades = s;
+    uint64_t uno = 1;
+    if (write(e->aviso, &uno, sizeof(uno)) < 0 && errno != EAGAIN)
+        log_error("write eventfd: %s", strerror(errno));
+}
+
+static void *escritor_loop(void *arg)
+{
+    escritor_t *e = arg;
+    pthread_mutex_lock(&e->mu);
+    while (1)
+    {
+        while (e->primero == NULL)
+            pthread_cond_wait(&e->hay_trabajo, &e->mu);
+        trabajo_t *w = e->primero;
+        e->primero = w->sig;
+        if (e->primero == NULL)
+            e->ultimo = NULL;
+        pthread_mutex_unlock(&e->mu);
+
+        salida_t *s = w->s;
+        if (w->buf == TRABAJO_DESCARTAR)
+        {
+            // es lo último de s en la cola: nadie más la usa
+            liberar(s);
+            pthread_mutex_lock(&e->mu);
+            continue;
+        }
+        int r = w->buf == TRABAJO_CERRAR ? cerrar(s) : escribir_todo(s->fd, s->buf[w->buf], w->largo, w->offset);
+        int err = errno;
+
+        // desde el aviso el engine puede liberar la salida: no se toca más
+        pthread_mutex_lock(&e->mu);
+        if (r < 0 && s->error == 0)
+            s->error = err;
+        if (w->buf == TRABAJO_CERRAR)
+        {
+            s->confirmada = 1;
+            avisar(e, s);
+        }
+        else
+        {
+            s->ocupado[w->buf] = 0;
+            if (s->esperando)
+            {
+                s->esperando = 0;
+                avisar(e, s);
+            }
+        }
+    }
+    return NULL;
+}
+
+escritor_t *escritor_create(void)
+{
+    escritor_t *e = calloc(1, sizeof(escritor_t));
+    if (e == NULL)
+        return NULL;
+    if ((e->aviso = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        free(e);
+        return NULL;
+    }
+    pthread_mutex_init(&e->mu, NULL);
+    pthread_cond_init(&e->hay_trabajo, NULL);
+    int r = pthread_create(&e->hilo, NULL, escritor_loop, e);
+    if (r != 0)
+    {
+        close(e->aviso);
+        free(e);
+        errno = r;
+        return NULL;
+    }
+    pthread_detach(e->hilo);
+    return e;
+}
+
+int escritor_fd(escritor_t *e)
+{
+    return e->aviso;
+}
+
+void *escritor_novedad(escritor_t *e)
+{
+    pthread_mutex_lock(&e->mu);
+    salida_t *s = e->novedades;
+    if (s)
+    {
+        e->novedades = s->sig_novedad;
+        s->en_novedades = 0;
+    }
+    else
+    {
+        // con el mutex: un aviso nuevo pone su novedad antes de escribir en el eventfd
+        uint64_t cuenta;
+        if (read(e->aviso, &cuenta, sizeof(cuenta)) < 0 && errno != EAGAIN)
+            log_error("read eventfd: %s", strerror(errno));
+    }
+    pthread_mutex_unlock(&e->mu);
+    return s ? s->duenio : NULL;
+}
+
+// con el mutex
+static void encolar(escritor_t *e, trabajo_t *w)
+{
+    w->sig = NULL;
+    if (e->ultimo)
+        e->ultimo->sig = w;
+    else
+        e->primero = w;
+    e->ultimo = w;
+    pthread_cond_signal(&e->hay_trabajo);
+}
+
+// la umask se lee una sola vez: cambiarla para leerla no es seguro con otros hilos
+static mode_t mascara;
+static pthread_once_t mascara_once = PTHREAD_ONCE_INIT;
+
+static void leer_mascara(void)
+{
+    mascara = umask(0);
+    umask(mascara);
+}
+
+/* Manda a escribir el buffer actual y sigue en el otro. Con escritor el
+ * otro ya está libre: salida_escribir lo mira antes de llegar acá. */
+static int despachar(salida_t *s)
+{
+    if (s->usado == 0)
+        return 0;
+    int r = 0;
+    if (s->escritor == NULL)
+        r = escribir_todo(s->fd, s->buf[0], s->usado, s->offset);
+    else
+    {
+        escritor_t *e = s->escritor;
+        trabajo_t *w = &s->trabajos[s->actual];
+        *w = (trabajo_t){.s = s, .buf = s->actual, .largo = s->usado, .offset = s->offset};
+
+        pthread_mutex_lock(&e->mu);
+        s->ocupado[s->actual] = 1;
+        encolar(e, w);
+        if (s->error)
+        {
+            errno = s->error;
+            r = -1;
+        }
+        pthread_mutex_unlock(&e->mu);
+        s->actual = (s->actual + 1) % SALIDA_BUFFERS;
+    }
+    s->offset += s->usado;
+    s->usado = 0;
+    return r;
+}
+
+// sin escritor; con escritor, desde su hilo con lo último de s en la cola o sin nada encolado
+static void liberar(salida_t *s)
+{
+    if (s->fd >= 0)
+    {
+        close(s->fd);
+        unlink(s->temporal);
+    }
+    for (int i = 0; i < SALIDA_BUFFERS; i++)
+        free(s->buf[i]);
+    free(s->final);
+    free(s->temporal);
+    free(s);
+}
+
+// el rename queda en el directorio; si no se puede bajar, el archivo igual está en su lugar
+static void sincronizar_directorio(const char *filename)
+{
+    const char *barra = strrchr(filename, '/');
+    char *dir = barra ? strndup(filename, barra - filename + 1) : NULL;
+    if (barra && dir == NULL)
+        return;
+    int fd = open(dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+/* Con todo ya escrito: lo reservado de más afuera, los datos al disco y el
+ * nombre pedido. Deja en error el errno si falló, y entonces el temporal se
+ * borra. */
+static int cerrar(salida_t *s)
+{
+    int r = 0;
+    if (s->error)
+    {
+        errno = s->error;
+        r = -1;
+    }
+    // el cliente mandó menos de lo que anunció: lo reservado de más no es del archivo
+    if (r == 0 && s->reservado > s->offset && ftruncate(s->fd, s->offset) < 0)
+        r = -1;
+    // sin esto, después de una caída el nombre puede quedar apuntando a un archivo vacío
+    if (r == 0 && fdatasync(s->fd) < 0)
+        r = -1;
+    if (r == 0)
+    {
+        r = close(s->fd);
+        s->fd = -1;
+    }
+    // RENAME_NOREPLACE: si otro creó el archivo mientras tanto, no se pisa
+    if (r == 0 && renameat2(AT_FDCWD, s->temporal, AT_FDCWD, s->final, RENAME_NOREPLACE) < 0)
+    {
+        // un filesystem que no lo soporta: link tampoco reemplaza
+        if ((errno == EINVAL || errno == ENOSYS) && link(s->temporal, s->final) == 0)
+            unlink(s->temporal);
+        else
+            r = -1;
+    }
+    int err = errno;
+    if (r == 0)
+        sincronizar_directorio(s->final);
+    else if (s->fd < 0)
+        unlink(s->temporal);
+    s->error = r < 0 ? err : 0;
+    errno = err;
+    return r;
+}
+
+salida_t *salida_abrir(const char *filename, uint64_t tam, escritor_t *e, void *duenio)
+{
+    // se rechaza de entrada; si igual aparece mientras tanto, lo detecta el rename
+    struct stat st;
+    if (lstat(filename, &st) == 0)
+    {
+        errno = EEXIST;
+        return NULL;
+    }
+    const char *barra = strrchr(filename, '/');
+    size_t dir = barra ? (size_t)(barra - filename + 1) : 0;
+    if (filename[dir] == '\0')
+    {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    salida_t *s = calloc(1, sizeof(salida_t));
+    if (s == NULL)
+        return NULL;
+    s->fd = -1;
+    s->escritor = e;
+    s->duenio = duenio;
+    // ".nombre.XXXXXX" al lado del pedido, así el rename no cruza de filesystem
+    if ((s->final = strdup(filename)) == NULL ||
+        asprintf(&s->temporal, "%.*s.%s.XXXXXX", (int)dir, filename, filename + dir) < 0)
+    {
+        s->temporal = NULL;
+        goto error;
+    }
+    if ((s->fd = mkostemp(s->temporal, O_CLOEXEC)) < 0)
+        goto error;
+    pthread_once(&mascara_once, leer_mascara);
+    fchmod(s->fd, 0644 & ~mascara);
+
+    // con el tamaño anunciado se reserva todo junto: menos fragmentación, y sin lugar se sabe ya
+    if (tam > 0)
+    {
+        if (fallocate(s->fd, 0, 0, tam) == 0)
+            s->reservado = tam;
+        else if (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)
+            goto error;
+    }
+
+    // un archivo chico no necesita buffers de SALIDA_BUFFER
+    s->cap = SALIDA_BUFFER;
+    if (tam > 0 && tam < SALIDA_BUFFER)
+        s->cap = (tam + SALIDA_ALINEACION - 1) / SALIDA_ALINEACION * SALIDA_ALINEACION;
+    // con escritor un bloque tiene que entrar en un buffer, para no pasar por dos seguidos
+    if (e && s->cap < SALIDA_BLOQUE_MAX)
+        s->cap = SALIDA_BLOQUE_MAX;
+    for (int i = 0; i < (e ? SALIDA_BUFFERS : 1); i++)
+    {
+        int r = posix_memalign((void **)&s->buf[i], SALIDA_ALINEACION, s->cap);
+        if (r != 0)
+        {
+            s->buf[i] = NULL;
+            errno = r;
+            goto error;
+        }
+    }
+    return s;
+
+error:;
+    int err = errno;
+    liberar(s);
+    errno = err;
+    return NULL;
+}
+
+int salida_escribir(salida_t *s, const void *datos, size_t n)
+{
+    escritor_t *e = s->escritor;
+    if (e && s->usado + n > s->cap)
+    {
+        int sig = (s->actual + 1) % SALIDA_BUFFERS;
+        pthread_mutex_lock(&e->mu);
+        int err = s->error, lleno = s->ocupado[sig];
+        if (err == 0 && lleno)
+            s->esperando = 1;
+        pthread_mutex_unlock(&e->mu);
+        if (err)
+        {
+            errno = err;
+            return -1;
+        }
+        if (lleno)
+            return SALIDA_LLENA;
+    }
+
+    const uint8_t *p = datos;
+    while (n > 0)
+    {
+        size_t cabe = s->cap - s->usado < n ? s->cap - s->usado : n;
+        memcpy(s->buf[s->actual] + s->usado, p, cabe);
+        s->usado += cabe;
+        p += cabe;
+        n -= cabe;
+        if (s->usado == s->cap && despachar(s) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int salida_confirmar(salida_t *s)
+{
+    escritor_t *e = s->escritor;
+    if (e == NULL)
+    {
+        int r = despachar(s);
+        if (r == 0)
+            r = cerrar(s);
+        int err = errno;
+        liberar(s);
+        errno = err;
+        return r;
+    }
+
+    // el último buffer y el cierre, en orden detrás de lo que ya estaba en la cola
+    despachar(s);
+    s->cierre = (trabajo_t){.s = s, .buf = TRABAJO_CERRAR};
+    pthread_mutex_lock(&e->mu);
+    encolar(e, &s->cierre);
+    pthread_mutex_unlock(&e->mu);
+    return SALIDA_EN_CURSO;
+}
+
+int salida_confirmada(salida_t *s)
+{
+    pthread_mutex_lock(&s->escritor->mu);
+    int r = s->confirmada;
+    pthread_mutex_unlock(&s->escritor->mu);
+    return r;
+}
+
+int salida_resultado(salida_t *s)
+{
+    int err = s->error;
+    liberar(s);
+    errno = err;
+    return err ? -1 : 0;
+}
+
+void salida_descartar(salida_t *s)
+{
+    escritor_t *e = s->escritor;
+    if (e == NULL)
+    {
+        liberar(s);
+        return;
+    }
+    pthread_mutex_lock(&e->mu);
+    s->descartada = 1;
+    if (s->en_novedades)
+    {
+        salida_t **p = &e->novedades;
+        while (*p != s)
+            p = &(*p)->sig_novedad;
+        *p = s->sig_novedad;
+        s->en_novedades = 0;
+    }
+    s->baja = (trabajo_t){.s = s, .buf = TRABAJO_DESCARTAR};
+    encolar(e, &s->baja);
+    pthread_mutex_unlock(&e->mu);
+}
@@ -0,0 +1,72 @@
+#ifndef TFTP_SALIDA_H
+#define TFTP_SALIDA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Escritura de un WRQ: los bloques se juntan en buffers alineados de
+ * SALIDA_BUFFER bytes y se escriben de a uno con pwrite, en un archivo
+ * temporal del mismo directorio que recién al final, ya en el disco, toma el
+ * nombre pedido con un rename atómico. Mientras tanto nadie ve un archivo a
+ * medias, y si se aborta el temporal se borra. Con un escritor, las pwrite,
+ * el fdatasync y el rename los hace otro hilo mientras los bloques
+ * siguientes llenan el otro buffer, y el engine no lo espera nunca: cuando
+ * no hay buffer libre o termina el rename, el escritor le avisa por un
+ * eventfd. */
+
+#define SALIDA_BUFFER (1 << 20)
+#define SALIDA_BUFFERS 2
+
+// lo más que se le pasa a salida_escribir de una vez: un bloque TFTP, más un CR de netascii
+#define SALIDA_BLOQUE_MAX 65536
+
+// salida_escribir: no hay buffer libre, los datos no se tomaron
+#define SALIDA_LLENA 1
+// salida_confirmar: el escritor lo está guardando, el resultado llega con su aviso
+#define SALIDA_EN_CURSO 1
+
+// hilo de fondo que escribe los buffers llenos de todas las salidas de un engine
+typedef struct escritor escritor_t;
+
+typedef struct salida salida_t;
+
+escritor_t *escritor_create(void);
+
+// se pone legible cuando alguna salida tiene novedades; el engine lo espera junto con sus sockets
+int escritor_fd(escritor_t *e);
+
+/* Con escritor_fd legible: el dueño de una salida con novedades, de a uno;
+ * NULL cuando no quedan. Las novedades son un buffer libre después de un
+ * SALIDA_LLENA, o el fin de un salida_confirmar. */
+void *escritor_novedad(escritor_t *e);
+
+/* Crea el temporal para filename; si no existe todavía, con el tamaño tam
+ * (0 = desconocido) reservado en el disco. e puede ser NULL: se escribe en
+ * el mismo hilo. duenio es lo que devuelve escritor_novedad. NULL con errno
+ * si no se pudo (EEXIST si filename ya existe, ENOSPC si no entra). */
+salida_t *salida_abrir(const char *filename, uint64_t tam, escritor_t *e, void *duenio);
+
+/* Agrega n bytes al final; -1 con errno si falló la escritura de algo
+ * anterior. Con escritor, n no pasa de SALIDA_BLOQUE_MAX, y si el buffer que
+ * sigue todavía se está escribiendo devuelve SALIDA_LLENA sin tomar nada:
+ * hay que volver a intentar después de la novedad. */
+int salida_escribir(salida_t *s, const void *datos, size_t n);
+
+/* Escribe lo que falta, lo baja al disco y le da al temporal el nombre
+ * pedido. Sin escritor se hace acá: devuelve 0, o -1 con errno (EEXIST si
+ * otro lo creó mientras tanto, y entonces el temporal se borra), y libera s.
+ * Con escritor devuelve SALIDA_EN_CURSO y el resultado se lee con
+ * salida_resultado cuando salida_confirmada lo indique. */
+int salida_confirmar(salida_t *s);
+
+// con escritor, si ya terminó lo que empezó salida_confirmar
+int salida_confirmada(salida_t *s);
+
+// lo que hubiera devuelto salida_confirmar sin escritor; libera s
+int salida_resultado(salida_t *s);
+
+/* Borra el temporal sin tocar el nombre pedido y libera s; con escritor, en
+ * ese hilo después de lo que tenía pendiente. Desde acá no hay novedades. */
+void salida_descartar(salida_t *s);
+
+#endif
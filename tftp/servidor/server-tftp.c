@@ -1,23 +1,26 @@
+#define _GNU_SOURCE // pthread_attr_setaffinity_np
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h> // close()
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <netinet/in.h> // struct sockaddr_in
 #include <errno.h>
-#include <sys/time.h>
 
-#define TFTP_MAX_PAYLOAD_SIZE 514
-#define CANT_MAX_DATA 512
-#define MAX_RETRIES 3
+#include "log.h"
+#include "tftp.h"
+#include "transfer.h"
+#include "engine.h"
 
-typedef struct
-{
-    uint16_t opcode; /* 2 bytes en network byte order */
-    char payload[TFTP_MAX_PAYLOAD_SIZE];
-} tftp_packet_t;
+#define DEFAULT_MAX_TRANSFERS 1024
+#define DEFAULT_CACHE_MB 256
+#define DEFAULT_MAX_RETRIES 5
 
 int crear_socket()
 {
@@ -48,412 +51,292 @@ void bind_socket(int sockfd, const char *puerto_str)
     }
 }
 
-// void mostrar_barra_progreso(size_t bytes_recibidos, size_t total_bytes)
-// {
-//     int ancho_barra = 50;
-//     float progreso = (float)bytes_recibidos / total_bytes;
-//     int cantidad = (int)(progreso * ancho_barra);
-
-//     printf("\r[");
-//     for (int i = 0; i < ancho_barra; i++)
-//     {
-//         if (i < cantidad)
-//             printf("#");
-//         else
-//             printf(" ");
-//     }
-//     printf("] %.2f%%", progreso * 100);
-//     fflush(stdout);
-// }
-
-void manejar_cliente(int sockfd, tftp_packet_t pkt, ssize_t n, struct sockaddr_in client, socklen_t client_len, double timeout_sec)
+/* Modo anterior: un proceso por pedido. Cada hijo corre un engine propio
+ * con una sola transferencia, así el protocolo está escrito una sola vez. */
+void loop_fork(int socketfd, const transfer_config_t *cfg)
 {
-    // 3.2) Convertir opcode a host byte order
-    uint16_t opcode = ntohs(pkt.opcode);
-
-    // 3.3) Mostrar quién envió (IP:puerto)
-    char ipstr[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client.sin_addr, ipstr, sizeof(ipstr));
-    printf("Paquete de %s:%u ", ipstr, ntohs(client.sin_port));
+    // los hijos no quedan zombies
+    signal(SIGCHLD, SIG_IGN);
 
-    // 3.4) Lógica básica según opcode
-    switch (opcode)
-    {
-    case 1: /* RRQ */
+    // 3) Loop de recepción de paquetes
+    while (1)
     {
-        /* En RRQ/WRQ el payload es:
-         *   Filename\0Mode\0
-         */
-        char *filename = pkt.payload;                 // Puntero a donde empieza el string filename
-        char *mode = filename + strlen(filename) + 1; // Puntero al final del filename + 1 = mode
-        printf("RRQ → filename=\"%s\", mode=\"%s\"\n", filename, mode);
-
-        FILE *fd = fopen(filename, "r");
-        if (fd == NULL)
-        {
-            perror("Error al abrir el archivo RRQ");
-
-            // Construir paquete de error
-            tftp_packet_t error_pkt;
-            error_pkt.opcode = htons(5); // Opcode de error
-
-            uint16_t error_code = htons(1); // File not found
-            memcpy(error_pkt.payload, &error_code, 2);
-
-            const char *msg = "File not found";
-            strcpy(error_pkt.payload + 2, msg); // Copiar el mensaje
-            size_t msg_len = strlen(msg);
-
-            error_pkt.payload[2 + msg_len] = '\0'; // Terminador
-
-            // Calcular longitud total: 2 (opcode) + 2 (code) + msg_len + 1 (null)
-            ssize_t error_len = 2 + 2 + msg_len + 1;
-
-            sendto(sockfd, &error_pkt, error_len, 0, (struct sockaddr *)&client, client_len);
+        tftp_packet_t pkt;
+        struct sockaddr_in client;
+        socklen_t client_len = sizeof(client);
 
-            return;
+        // 3.1) Recibir un paquete completo
+        ssize_t n = recvfrom(socketfd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&client, &client_len);
+        if (n < 2)
+        { // mínimo debe traer 2 bytes para el opcode
+            if (n >= 0)
+                log_debug("Paquete demasiado corto (%zd bytes)", n);
+            continue;
         }
 
-        size_t total_enviado = 0;
-        fseek(fd, 0, SEEK_END);
-        // size_t tam_archivo = ftell(fd);
-        rewind(fd);
-
-        size_t cantidad_bytes = CANT_MAX_DATA;
-        char buffer[CANT_MAX_DATA];
-
-        uint16_t bloque = 1;
-        size_t leidos = 0;
-        do
+        // sólo un pedido vale un proceso: la basura no llega al fork
+        uint16_t opcode = ntohs(pkt.opcode);
+        if (opcode != OPCODE_RRQ && opcode != OPCODE_WRQ)
         {
-            leidos = fread(buffer, 1, cantidad_bytes, fd);
-
-            total_enviado += leidos;
-            // mostrar_barra_progreso(total_enviado, tam_archivo);
-
-            tftp_packet_t data_pkt;
-            data_pkt.opcode = htons(3); // Opcode para DATA
-
-            // Número de bloque (ej: bloque 1, 2, 3, etc.)
-            uint16_t block_number = htons(bloque); // Incrementalo en cada iteración
-
-            // Copiar el número de bloque (2 bytes) al principio del payload
-            memcpy(data_pkt.payload, &block_number, 2);
-
-            // Copiar los datos leídos desde el archivo (hasta 512 bytes)
-            memcpy(data_pkt.payload + 2, buffer, leidos);
-
-            // Enviar el paquete
-            ssize_t total_len = 2 /*opcode*/ + 2 /*block*/ + leidos;
-
-            int retries = 0; // contador de reintentos por este bloque
-
-        reenvia_data: // label
-
-            sendto(sockfd, &data_pkt, total_len, 0, (struct sockaddr *)&client, client_len);
-
-            // Esperar ACK
-            tftp_packet_t ack_pkt;
-            ssize_t ack_len = recvfrom(sockfd, &ack_pkt, sizeof(ack_pkt), 0, (struct sockaddr *)&client, &client_len);
-
-            if (ack_len < 0)
-            {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                {
-                    // Timeout: aumentar contador y comprobar límite
-                    retries++;
-                    if (retries > MAX_RETRIES)
-                    {
-                        fprintf(stderr, "Máximo de %d reintentos alcanzado para bloque %u. Cerrando conexión.\n", MAX_RETRIES, bloque);
-                        fclose(fd);
-                        break;
-                    }
-                    fprintf(stderr, "Timeout esperando ACK %u (intento %d/%d), retransmito bloque %u\n", bloque, retries, MAX_RETRIES, bloque);
-                    goto reenvia_data;
-                }
-                perror("recvfrom (ACK)");
-                break; // otro error real: abandonar este bloque
-            }
-
-            if (ack_len < 4 || ntohs(ack_pkt.opcode) != 4) // verifica que el paquete sea de minimo 4 bytes y que el opcde sea 4, o sea, un ACK
-            {
-                fprintf(stderr, "ACK inválido o error de recepción\n");
-                break;
-            }
-
-            // extrae los dos primeros bytes del payload que son el numero de bloque de ACK que envia el cliente
-            uint16_t ack_block;
-            memcpy(&ack_block, ack_pkt.payload, 2);
-            ack_block = ntohs(ack_block);
-
-            if (ack_block > bloque)
-            {
-                fprintf(stderr, "ACK inesperado. Se esperaba %d, pero llegó %d\n", bloque, ack_block);
-                break;
-            }
-
-            if (ack_block < bloque)
-            {
-                fprintf(stderr, "ACK viejo. Se esperaba %u, pero llegó %u. Se ignora y reenvía el bloque.\n", bloque, ack_block);
-                goto reenvia_data;
-            }
-
-            bloque++;
-
-        } while (leidos == cantidad_bytes);
+            log_debug("Paquete con opcode desconocido: %u", opcode);
+            continue;
+        }
 
-        if (leidos < cantidad_bytes)
+        pid_t pid = fork();
+        if (pid < 0)
         {
-            printf("\nTransferencia completa\n");
+            log_error("fork: %s", strerror(errno));
+            continue;
         }
-        break;
-    }
-
-    case 2: /* WRQ */
-    {
-        /* En RRQ/WRQ el payload es:
-         *   Filename\0Mode\0
-         */
-        /* Copiamos el nombre en un buffer propio para que no se sobrescriba luego */
-        char filename_buf[512];
-        strncpy(filename_buf, pkt.payload, sizeof(filename_buf) - 1);
-        char *mode = filename_buf + strlen(filename_buf) + 1;
-        filename_buf[sizeof(filename_buf) - 1] = '\0';
-        printf("WRQ → filename=\"%s\", mode=\"%s\"\n", filename_buf, mode);
-
-        FILE *fd = fopen(filename_buf, "r");
-        if (fd != NULL)
+        else if (pid == 0)
         {
-            // Construir paquete de error
-            tftp_packet_t error_pkt;
-            error_pkt.opcode = htons(5); // Opcode de error
-
-            uint16_t error_code = htons(6); // File already exists
-            memcpy(error_pkt.payload, &error_code, 2);
-
-            const char *msg = "File already exists";
-            strcpy(error_pkt.payload + 2, msg);
-            size_t msg_len = strlen(msg);
-            error_pkt.payload[2 + msg_len] = '\0';
-
-            // Longitud: opcode(2) + code(2) + msg + '\0'
-            ssize_t error_len = 2 + 2 + msg_len + 1;
-            sendto(sockfd, &error_pkt, error_len, 0, (struct sockaddr *)&client, client_len);
-
-            printf("Error al abrir el archivo WRQ\n");
-            return;
+            // Proceso hijo: la transferencia usa su propio socket efímero
+            close(socketfd);
+            engine_t *e = engine_create(-1, cfg, 1);
+            transfer_t *t = e ? transfer_start(&pkt, n, &client, client_len, cfg, NULL) : NULL;
+            if (t && engine_add(e, t) == 0)
+                engine_run(e);
+            exit(0); // Termina el hijo
         }
+        // Padre: sigue esperando nuevos clientes
+    }
+}
 
-        fd = fopen(filename_buf, "w");
-
-        // 1) Enviar ACK0 para que el cliente empiece con DATA1
-        tftp_packet_t ack_pkt;
-        ack_pkt.opcode = htons(4); // Opcode para ACK
-        uint16_t block_number_expected = 0;
-        uint16_t zero = htons(0);
-        memcpy(ack_pkt.payload, &zero, 2);
-        ssize_t ack_len = 2 /*opcode*/ + 2 /*block*/;
-        sendto(sockfd, &ack_pkt, ack_len, 0, (struct sockaddr *)&client, client_len);
+/* Varios workers: cada hilo tiene su propio socket en el puerto del servidor
+ * (SO_REUSEPORT) y su engine, con sus transferencias, timers y sesiones
+ * multicast; en el camino de los paquetes no comparten nada. La caché de
+ * archivos es una sola, para que el presupuesto de -c sea del servidor y un
+ * archivo no se mapee una vez por worker; se toca sólo al empezar y terminar
+ * una RRQ. El kernel reparte los pedidos por un hash de las direcciones y
+ * puertos, así que los reintentos de un cliente llegan siempre al mismo
+ * worker. Cada hilo queda fijo en un core. */
+typedef struct
+{
+    engine_t *e;
+    pthread_t hilo;
+} worker_t;
 
-        block_number_expected = 1;
-        uint16_t block_number_received;
-        int retries;
+static void *correr_worker(void *arg)
+{
+    worker_t *w = arg;
+    engine_run(w->e);
+    return NULL;
+}
 
-        int eof = 0;
-        int aborted = 0;
-        while (!eof)
+void loop_workers(const char *puerto, const transfer_config_t *cfg, int max_transfers, int cant)
+{
+    worker_t *workers = calloc(cant, sizeof(worker_t));
+    if (workers == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    transfer_config_t comun = *cfg;
+    if (cfg->cache_bytes > 0 && (comun.cache = cache_create(cfg->cache_bytes)) == NULL)
+    {
+        perror("cache_create");
+        exit(EXIT_FAILURE);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < cant; i++)
+    {
+        // los puertos multicast se reparten entre los workers
+        transfer_config_t c = comun;
+        c.mc_primero = i;
+        c.mc_paso = cant;
+
+        int fd = crear_socket();
+        int uno = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &uno, sizeof(uno)) < 0)
         {
-            retries = 0;
-
-        espera_data: // Esperar DATA-N
-            ssize_t n = recvfrom(sockfd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&client, &client_len);
-
-            if (n < 0)
-            {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                {
-                    // Caso 1: no llegó DATA-N en timeout. Reenviar ACK-(N-1)
-                    retries++;
-                    fprintf(stderr, "Timeout esperando DATA %u (intento %d/%d), retransmito ACK %u\n", block_number_expected, retries, MAX_RETRIES, block_number_expected - 1);
-                    if (retries > MAX_RETRIES)
-                    {
-                        fprintf(stderr, "Máximo de %d reintentos esperando DATA %u. Abortando.\n", MAX_RETRIES, block_number_expected);
-                        fclose(fd);
-                        remove(filename_buf);
-                        aborted = 1;
-                        break;
-                    }
-                    uint16_t prev_block = htons(block_number_expected - 1);
-                    memcpy(ack_pkt.payload, &prev_block, 2);
-                    sendto(sockfd, &ack_pkt, ack_len, 0,
-                           (struct sockaddr *)&client, client_len);
-                    goto espera_data;
-                }
-                perror("recvfrom (DATA)");
-                fclose(fd);
-                remove(filename_buf);
-                aborted = 1;
-                break;
-            }
-
-            if (n < CANT_MAX_DATA + 4)
-            {
-                eof = 1;
-            }
-
-            uint16_t opcode2 = ntohs(pkt.opcode);
-            if (opcode2 != 3)
-            {
-                fprintf(stderr, "Esperaba un paquete de DATA y recibió otro opcode: %d\n", opcode2);
-                fclose(fd);
-                remove(filename_buf);
-                aborted = 1;
-                break;
-            }
-
-            memcpy(&block_number_received, &pkt.payload, 2);
-            block_number_received = ntohs(block_number_received);
-
-            if (block_number_received < block_number_expected)
-            {
-                fprintf(stderr, "Bloque fuera de secuencia en WRQ  |  block_number_received < block_number_expected  |  Ignorando (recibido %u, esperado %u)\n", block_number_received, block_number_expected);
-                continue;
-            }
-
-            if (block_number_received > block_number_expected)
-            {
-                fprintf(stderr, "Bloque fuera de secuencia en WRQ  |  block_number_received > block_number_expected  |   Abortando (recibido %u, esperado %u)\n", block_number_received, block_number_expected);
-                fclose(fd);
-                remove(filename_buf);
-                aborted = 1;
-                break;
-            }
-
-            int cant_a_leer = n - 4; // 2 bytes opcode + 2 bytes bloque
-            uint8_t data[CANT_MAX_DATA];
-            memcpy(data, pkt.payload + 2 /*bloque*/, cant_a_leer);
-
-            size_t bytes_escritos = fwrite(data, 1, cant_a_leer, fd);
-            if (bytes_escritos != (size_t)cant_a_leer)
-            {
-                perror("fwrite");
-                fclose(fd);
-                remove(filename_buf);
-                aborted = 1;
-                break;
-            }
-
-            // Enviar ACK-N
-            uint16_t ack_block = htons(block_number_expected);
-            memcpy(ack_pkt.payload, &ack_block, 2);
-            sendto(sockfd, &ack_pkt, ack_len, 0, (struct sockaddr *)&client, client_len);
-
-            block_number_expected++;
+            perror("SO_REUSEPORT");
+            exit(EXIT_FAILURE);
         }
-
-        // Si no abortamos internamente, cerramos normalmente y damos el mensaje de fin
-        if (!aborted)
+        bind_socket(fd, puerto);
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        if ((workers[i].e = engine_create(fd, &c, (max_transfers + cant - 1) / cant)) == NULL)
         {
-            printf("Se llegó al final del archivo WRQ\n");
-            fclose(fd);
+            perror("engine_create");
+            exit(EXIT_FAILURE);
         }
-        break;
     }
 
-    default:
-        printf("Opcode desconocido: %u\n", opcode);
-        break;
+    for (int i = 0; i < cant; i++)
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        cpu_set_t cpu;
+        CPU_ZERO(&cpu);
+        CPU_SET(i % cpus, &cpu);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+        int r = pthread_create(&workers[i].hilo, &attr, correr_worker, &workers[i]);
+        pthread_attr_destroy(&attr);
+        if (r != 0)
+        {
+            log_error("pthread_create: %s", strerror(r));
+            exit(EXIT_FAILURE);
+        }
     }
+    for (int i = 0; i < cant; i++)
+        pthread_join(workers[i].hilo, NULL);
+}
+
+// "grupo:puerto" de -m
+static int parse_grupo(const char *s, transfer_config_t *cfg)
+{
+    char grupo[INET_ADDRSTRLEN];
+    const char *dos_puntos = strchr(s, ':');
+    if (dos_puntos == NULL || (size_t)(dos_puntos - s) >= sizeof(grupo))
+        return -1;
+    memcpy(grupo, s, dos_puntos - s);
+    grupo[dos_puntos - s] = '\0';
+    int puerto = atoi(dos_puntos + 1);
+    if (inet_pton(AF_INET, grupo, &cfg->mc_grupo) != 1 || !IN_MULTICAST(ntohl(cfg->mc_grupo.s_addr)) ||
+        puerto < 1 || puerto + MC_MAX_SESIONES > 65536)
+        return -1;
+    cfg->mc_puerto = puerto;
+    return 0;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Uso: %s [-f] [-g] [-z] [-n max_transferencias] [-c MB_de_cache] [-r reintentos] [-w]\n", prog);
+    fprintf(stderr, "       [-u] [-t workers] [-m grupo:puerto [-i ip]] <puerto> <timeout_inicial_en_segundos>\n");
+    fprintf(stderr, "Ejemplo: %s 69 0.5    (para 500 ms)\n", prog);
+    fprintf(stderr, "  -f  un proceso por pedido en vez de atender todo en un solo proceso\n");
+    fprintf(stderr, "  -t  hilos que atienden pedidos, cada uno en su core con su socket (1; 0 = uno por core)\n");
+    fprintf(stderr, "      -n y los puertos de -m se reparten entre ellos; la caché de -c es una para todos\n");
+    fprintf(stderr, "  -c  tope de la caché de archivos para RRQ (%d MB; 0 la desactiva, con -f no se usa)\n",
+            DEFAULT_CACHE_MB);
+    fprintf(stderr, "  -r  timeouts seguidos sin respuesta antes de abandonar una transferencia (%d)\n",
+            DEFAULT_MAX_RETRIES);
+    fprintf(stderr, "      el timeout se adapta al RTT de cada cliente y se duplica en cada reintento\n");
+    fprintf(stderr, "  -w  los WRQ escriben a disco desde un hilo aparte, sin demorar los ACKs (con -f no se usa)\n");
+    fprintf(stderr, "  -g  UDP_SEGMENT (GSO) para mandar cada lote de una ventana en una sola llamada\n");
+    fprintf(stderr, "  -z  MSG_ZEROCOPY para mandar bloques de %d bytes o más\n", ZEROCOPY_MIN_BLKSIZE);
+    fprintf(stderr, "  -u  io_uring en vez de epoll: la E/S de todas las transferencias en una syscall por vuelta\n");
+    fprintf(stderr, "      (hace falta kernel 6.1, si no sigue con epoll; deja sin efecto -z y con -f no se usa)\n");
+    fprintf(stderr, "  -m  acepta la opción multicast (RFC 2090): grupo y primer puerto de las sesiones\n");
+    fprintf(stderr, "  -i  IP de la interfaz por la que sale el multicast (127.0.0.1 para probar local)\n");
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    int modo_fork = 0;
+    int max_transfers = DEFAULT_MAX_TRANSFERS;
+    int workers = 1;
+    transfer_config_t cfg = {.cache_bytes = (size_t)DEFAULT_CACHE_MB << 20, .max_retries = DEFAULT_MAX_RETRIES,
+                             .mc_paso = 1};
+    int opt;
+    while ((opt = getopt(argc, argv, "c:fgi:m:n:r:t:uwz")) != -1)
     {
-        fprintf(stderr, "Uso: %s <puerto> <timeout_en_segundos>\n", argv[0]);
-        fprintf(stderr, "Ejemplo: %s 69 0.5    (para 500 ms)\n", argv[0]);
-        exit(EXIT_FAILURE);
+        switch (opt)
+        {
+        case 'f':
+            modo_fork = 1;
+            break;
+        case 'c':
+            cfg.cache_bytes = atoi(optarg) > 0 ? (size_t)atoi(optarg) << 20 : 0;
+            break;
+        case 'g':
+            cfg.gso = 1;
+            break;
+        case 'i':
+            if (inet_pton(AF_INET, optarg, &cfg.mc_interfaz) != 1)
+                usage(argv[0]);
+            break;
+        case 'm':
+            if (parse_grupo(optarg, &cfg) < 0)
+                usage(argv[0]);
+            break;
+        case 'n':
+            max_transfers = atoi(optarg);
+            break;
+        case 'r':
+            cfg.max_retries = atoi(optarg);
+            break;
+        case 't':
+            workers = atoi(optarg);
+            break;
+        case 'u':
+            cfg.uring = 1;
+            break;
+        case 'w':
+            cfg.escritor = 1;
+            break;
+        case 'z':
+            cfg.zerocopy = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
+    if (argc - optind != 2 || max_transfers < 1 || cfg.max_retries < 0 || workers < 0)
+        usage(argv[0]);
+    const char *puerto = argv[optind];
 
-    int socketfd = crear_socket();
-    bind_socket(socketfd, argv[1]);
-
-    // Parsear el string argv[2] como número de segundos (puede tener decimales)
-    double timeout_sec = atof(argv[2]);
-    if (timeout_sec < 0)
+    // Parsear el timeout como número de segundos (puede tener decimales)
+    double timeout_sec = atof(argv[optind + 1]);
+    if (timeout_sec <= 0)
     {
-        fprintf(stderr, "Timeout inválido: %s\n", argv[2]);
-        close(socketfd);
+        fprintf(stderr, "Timeout inválido: %s\n", argv[optind + 1]);
         exit(EXIT_FAILURE);
     }
+    cfg.timeout_ns = timeout_sec * 1e9;
 
-    // Separar parte entera y parte fraccional en microsegundos
-    struct timeval tv;
-    tv.tv_sec = (int)timeout_sec;
-    tv.tv_usec = (int)((timeout_sec - tv.tv_sec) * 1e6);
-
-    if (setsockopt(socketfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+    // nivel y formato: variables de entorno LOG_LEVEL y LOG_FORMAT
+    if (log_init(STDOUT_FILENO) < 0)
     {
-        perror("setsockopt SO_RCVTIMEO");
-        close(socketfd);
+        perror("log_init");
         exit(EXIT_FAILURE);
     }
 
-    printf("Servidor TFTP escuchando en puerto %s (timeout = %.6f s)\n", argv[1], timeout_sec);
-
-    // 3) Loop de recepción de paquetes
-    while (1)
+    if (workers == 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (modo_fork && workers > 1)
     {
-        tftp_packet_t pkt;
-        struct sockaddr_in client;
-        socklen_t client_len = sizeof(client);
-
-        // 3.1) Recibir un paquete completo
-        ssize_t n = recvfrom(socketfd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&client, &client_len);
-        if (n < 0)
-        {
-            // en este recv espera un RRQ o WRQ, entonces no tiene sentido imprimir que se le termino el timeout.
-            continue;
-        }
-
-        if (n < 2)
-        { // mínimo debe traer 2 bytes para el opcode
-            fprintf(stderr, "Paquete demasiado corto (%zd bytes)\n", n);
-            continue;
-        }
-
-        pid_t pid = fork();
-        if (pid < 0)
-        {
-            perror("fork");
-            continue;
-        }
-        else if (pid == 0)
-        {
-            // Proceso hijo: manejar al cliente
-            close(socketfd); // Cerramos el socket original si vas a crear uno nuevo
-
-            // Creamos un nuevo socket solo para este cliente (opcional pero recomendable)
-            int sock_cliente = crear_socket();
-
-            struct timeval tv;
-            tv.tv_sec = (int)timeout_sec;
-            tv.tv_usec = (int)((timeout_sec - tv.tv_sec) * 1e6);
-            setsockopt(sock_cliente, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        fprintf(stderr, "Con -f no se usan workers\n");
+        workers = 1;
+    }
+    char modo[32] = "un solo proceso";
+    if (modo_fork)
+        snprintf(modo, sizeof(modo), "un proceso por pedido");
+    else if (workers > 1)
+        snprintf(modo, sizeof(modo), "%d workers", workers);
+    if (cfg.uring && !modo_fork)
+        strncat(modo, " con io_uring", sizeof(modo) - strlen(modo) - 1);
+    log_info("Servidor TFTP escuchando en puerto %s (timeout inicial = %.6f s, %d reintentos, %s)", puerto,
+             timeout_sec, cfg.max_retries, modo);
+
+    if (workers > 1)
+    {
+        loop_workers(puerto, &cfg, max_transfers, workers);
+        return 1;
+    }
 
-            // Llamamos a una función que maneje RRQ o WRQ (ver más abajo)
-            manejar_cliente(sock_cliente, pkt, n, client, client_len, timeout_sec);
+    int socketfd = crear_socket();
+    bind_socket(socketfd, puerto);
 
-            close(sock_cliente);
-            exit(0); // Termina el hijo
-        }
-        else
-        {
-            // Padre: sigue esperando nuevos clientes
-            continue;
-        }
+    if (modo_fork)
+    {
+        // cada hijo atiende un solo cliente: no hay sesión a la que sumar a nadie
+        if (cfg.mc_puerto != 0)
+            log_warn("Con -f no se acepta la opción multicast");
+        cfg.mc_puerto = 0;
+        loop_fork(socketfd, &cfg);
+        return 0;
+    }
 
+    fcntl(socketfd, F_SETFL, O_NONBLOCK);
+    engine_t *e = engine_create(socketfd, &cfg, max_transfers);
+    if (e == NULL)
+    {
+        perror("engine_create");
         close(socketfd);
-        return 0;
+        exit(EXIT_FAILURE);
     }
-}
\ No newline at end of file
+    engine_run(e);
+    close(socketfd);
+    return 1;
+}
@@ -0,0 +1,70 @@
+#ifndef TFTP_H
+#define TFTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OPCODE_RRQ 1
+#define OPCODE_WRQ 2
+#define OPCODE_DATA 3
+#define OPCODE_ACK 4
+#define OPCODE_ERROR 5
+#define OPCODE_OACK 6 // RFC 2347: opcode(2) { opcion\0 valor\0 } *
+
+#define ERROR_FILE_NOT_FOUND 1
+#define ERROR_ACCESS_VIOLATION 2
+#define ERROR_DISK_FULL 3
+#define ERROR_ILLEGAL_OPERATION 4
+#define ERROR_UNKNOWN_TID 5
+#define ERROR_FILE_EXISTS 6
+#define ERROR_OPTION_NEGOTIATION 8
+
+// RRQ, WRQ, ACK y ERROR nunca pasan de 512 bytes (RFC 2347)
+#define TFTP_MAX_PAYLOAD_SIZE 514
+#define TFTP_HDR_SIZE 4 // opcode + bloque
+
+#define CANT_MAX_DATA 512 // blksize si el cliente no pide otro
+#define TFTP_MIN_BLKSIZE 8
+#define TFTP_MAX_BLKSIZE 65464 // RFC 2348: lo que entra en un datagrama UDP
+#define TFTP_MIN_TIMEOUT 1
+#define TFTP_MAX_TIMEOUT 255
+/* RFC 7440 permite hasta 65535; con menos de la mitad del espacio de números
+ * de bloque un ACK nunca es ambiguo después de dar la vuelta. */
+#define TFTP_MAX_WINDOWSIZE 1024
+
+typedef struct
+{
+    uint16_t opcode; /* 2 bytes en network byte order */
+    char payload[TFTP_MAX_PAYLOAD_SIZE];
+} tftp_packet_t;
+
+/* Opciones de un RRQ/WRQ. Las que el cliente no mandó o que no se pueden
+ * aceptar quedan con su flag en 0 y no van en el OACK. */
+typedef struct
+{
+    int has_blksize, has_tsize, has_timeout, has_windowsize, has_multicast;
+    size_t blksize;
+    uint64_t tsize;
+    int timeout;        // segundos
+    int windowsize;     // bloques en vuelo antes de esperar un ACK
+    char multicast[32]; // RFC 2090: el cliente lo manda vacío, el OACK lleva "grupo,puerto,mc"
+} tftp_options_t;
+
+/* Lee los pares opcion\0valor\0 de [p, end), lo que sigue al modo. Los
+ * nombres no distinguen mayúsculas; las opciones desconocidas se ignoran y
+ * un blksize o windowsize mayor que lo soportado se negocia a la baja.
+ * Devuelve la cantidad de opciones aceptadas o -1 si el paquete está mal
+ * formado. */
+int parse_options(const char *p, const char *end, tftp_options_t *o);
+
+// arma el OACK con las opciones aceptadas; devuelve su largo
+size_t build_oack(char *buf, size_t cap, const tftp_options_t *o);
+
+/* Número de bloque completo (64 bits, sin vueltas) que corresponde al número
+ * de 16 bits del paquete, tomando el más cercano a partir de ref. */
+static inline uint64_t block_unwrap(uint64_t ref, uint16_t wire)
+{
+    return ref + (uint16_t)(wire - (uint16_t)ref);
+}
+
+#endif
@@ -0,0 +1,1303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> // strcasecmp()
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h> // close(), pread()
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+
+#include "log.h"
+#include "transfer.h"
+
+// cotas del RTO calculado; la granularidad es la de la rueda de timers del engine
+#define RTO_MIN_NS 20000000ull
+#define RTO_MAX_NS 60000000000ull
+#define RTO_GRANULARIDAD_NS 4000000ull
+
+// lo más que se reserva por transferencia para leer o recibir un lote
+#define LOTE_MAX_BYTES (1 << 20)
+// ACKs que se leen juntos en un RRQ: llega uno por ventana
+#define LOTE_ACKS 8
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void enviar_error(int sockfd, const struct sockaddr_in *client, socklen_t client_len, uint16_t code, const char *msg)
+{
+    tftp_packet_t error_pkt;
+    error_pkt.opcode = htons(OPCODE_ERROR);
+
+    uint16_t error_code = htons(code);
+    memcpy(error_pkt.payload, &error_code, 2);
+
+    size_t msg_len = strlen(msg);
+    memcpy(error_pkt.payload + 2, msg, msg_len + 1); // con el terminador
+
+    // Longitud: opcode(2) + code(2) + msg + '\0'
+    ssize_t error_len = 2 + 2 + msg_len + 1;
+    sendto(sockfd, &error_pkt, error_len, 0, (const struct sockaddr *)client, client_len);
+}
+
+static uint64_t azar(transfer_t *t)
+{
+    // xorshift64: alcanza para desparejar timers
+    t->azar ^= t->azar << 13;
+    t->azar ^= t->azar >> 7;
+    t->azar ^= t->azar << 17;
+    return t->azar;
+}
+
+/* Se espera respuesta a lo recién mandado un RTO desde ahora. Después de un
+ * timeout se suma hasta un cuarto más al azar, para que las transferencias
+ * que perdieron paquetes a la vez no retransmitan todas juntas. */
+static void armar_timer(transfer_t *t)
+{
+    uint64_t espera = t->rto_ns;
+    if (t->adaptativo && t->retries > 0)
+        espera += azar(t) % (espera / 4 + 1);
+    t->deadline_ns = now_ns() + espera;
+}
+
+// lo que sale ahora se mide hasta que llegue la respuesta a bloque
+static void medir_desde(transfer_t *t, uint64_t bloque)
+{
+    t->midiendo = 1;
+    t->muestra_bloque = bloque;
+    t->muestra_ns = t->enviado_ns = now_ns();
+}
+
+/* Llegó la respuesta a lo que se estaba midiendo (RFC 6298): la primera
+ * muestra fija srtt y la mitad como variación, las siguientes se promedian
+ * con pesos 1/8 y 1/4. Con el timeout fijo igual se mide, para reconocer
+ * los ACKs repetidos. */
+static void cerrar_muestra(transfer_t *t)
+{
+    t->midiendo = 0;
+    uint64_t r = now_ns() - t->muestra_ns;
+    if (t->srtt_ns == 0)
+    {
+        t->srtt_ns = r;
+        t->rttvar_ns = r / 2;
+    }
+    else
+    {
+        uint64_t err = r > t->srtt_ns ? r - t->srtt_ns : t->srtt_ns - r;
+        t->rttvar_ns = (3 * t->rttvar_ns + err) / 4;
+        t->srtt_ns = (7 * t->srtt_ns + r) / 8;
+    }
+    if (!t->adaptativo)
+        return;
+    uint64_t var = 4 * t->rttvar_ns > RTO_GRANULARIDAD_NS ? 4 * t->rttvar_ns : RTO_GRANULARIDAD_NS;
+    t->rto_ns = t->srtt_ns + var;
+    if (t->rto_ns < RTO_MIN_NS)
+        t->rto_ns = RTO_MIN_NS;
+    if (t->rto_ns > RTO_MAX_NS)
+        t->rto_ns = RTO_MAX_NS;
+}
+
+/* Timeout: se retransmite con el doble de espera. Karn: no se mide lo
+ * retransmitido, porque no se sabe a cuál de los envíos contesta la
+ * respuesta; el RTO duplicado queda hasta medir algo mandado una sola vez. */
+static void retroceder(transfer_t *t)
+{
+    t->midiendo = 0;
+    if (t->adaptativo)
+        t->rto_ns = 2 * t->rto_ns < RTO_MAX_NS ? 2 * t->rto_ns : RTO_MAX_NS;
+}
+
+// encolado en el ring del engine: al completarse vuelve por transfer_on_enviado
+static int encolado(transfer_t *t, uring_op_t *op, uint64_t bloque)
+{
+    if (op == NULL)
+        return 0;
+    op->tipo = TRANSFER_OP_ENVIO;
+    op->duenio = t;
+    op->dato = bloque;
+    t->en_vuelo++;
+    return 1;
+}
+
+static void enviar(transfer_t *t, const void *buf, size_t len)
+{
+    // con io_uring sale junto con todo lo demás en el próximo io_uring_enter
+    if (t->uring && encolado(t, uring_enviar_copia(t->uring, t->sockfd, t->fijo, &t->peer, buf, len), 0))
+    {
+        t->io.tx_paquetes++;
+        return;
+    }
+    t->io.tx_syscalls++;
+    if (sendto(t->sockfd, buf, len, 0, (struct sockaddr *)&t->peer, t->peer_len) >= 0)
+        t->io.tx_paquetes++;
+}
+
+static void enviar_ack(transfer_t *t, uint64_t bloque)
+{
+    uint8_t ack[TFTP_HDR_SIZE];
+    uint16_t v = htons(OPCODE_ACK);
+    memcpy(ack, &v, 2);
+    v = htons((uint16_t)bloque);
+    memcpy(ack + 2, &v, 2);
+    enviar(t, ack, sizeof(ack));
+}
+
+/* ----- RRQ ----- */
+
+/* Opcode y número de cada uno de los 65536 bloques posibles, armados una sola
+ * vez. Como no cambian nunca, el kernel puede mandarlos por referencia
+ * (MSG_ZEROCOPY) sin que haga falta esperar el aviso para reusarlos. */
+static uint8_t cabeceras[65536][TFTP_HDR_SIZE];
+static pthread_once_t cabeceras_once = PTHREAD_ONCE_INIT;
+
+static void armar_cabeceras(void)
+{
+    for (uint32_t i = 0; i < 65536; i++)
+    {
+        uint16_t v = htons(OPCODE_DATA);
+        memcpy(cabeceras[i], &v, 2);
+        v = htons((uint16_t)i);
+        memcpy(cabeceras[i] + 2, &v, 2);
+    }
+}
+
+/* Bloques por syscall: hasta una ventana. Sin mapa se leen todos con una
+ * pread a pkt (en netascii se codifican ahí), que no pasa de
+ * LOTE_MAX_BYTES; con GSO tienen que entrar juntos en un datagrama. */
+static int rrq_lote(const transfer_t *t)
+{
+    size_t lote = t->opts.windowsize < UDP_LOTE_MAX ? t->opts.windowsize : UDP_LOTE_MAX;
+    if (t->mapa == NULL && lote * t->opts.blksize > LOTE_MAX_BYTES)
+        lote = LOTE_MAX_BYTES / t->opts.blksize;
+    if (t->gso && lote * (TFTP_HDR_SIZE + t->opts.blksize) > UDP_GSO_MAX)
+        lote = UDP_GSO_MAX / (TFTP_HDR_SIZE + t->opts.blksize);
+    return lote > 0 ? lote : 1;
+}
+
+/* netascii: codifica en pkt hasta cant bloques desde t->siguiente, a partir
+ * de donde quedó anotado que empieza el primero; cada uno deja anotado dónde
+ * empieza el que le sigue, así al volver atrás en la ventana sale igual. El
+ * archivo se lee con pread y no desde un mapa: si lo truncan en el medio,
+ * pread devuelve menos y no hay SIGBUS. Devuelve los bytes codificados, o -1
+ * si falló la lectura. */
+static ssize_t codificar_lote(transfer_t *t, int cant)
+{
+    size_t cantidad_bytes = t->opts.blksize;
+    int cap = t->opts.windowsize + 1;
+    netascii_pos_t pos = t->ascii_pos[t->siguiente % cap];
+
+    // cant bloques codificados nunca salen de más de cant * blksize bytes del archivo
+    ssize_t leidos = pread(t->fd, t->ascii_buf, cant * cantidad_bytes, (off_t)pos.offset);
+    if (leidos < 0)
+        return -1;
+
+    uint64_t desde = pos.offset;
+    size_t in = 0, total = 0;
+    for (int i = 0; i < cant; i++)
+    {
+        size_t usados;
+        size_t largo = netascii_codificar(t->ascii_buf + in, leidos - in, &usados, t->pkt + i * cantidad_bytes,
+                                          cantidad_bytes, &pos.pendiente);
+        in += usados;
+        total += largo;
+        pos.offset = desde + in;
+        t->ascii_pos[(t->siguiente + i + 1) % cap] = pos;
+        if (largo < cantidad_bytes)
+            break;
+    }
+    return total;
+}
+
+/* io_uring: encola cant bloques desde t->siguiente, cada uno con su
+ * cabecera y sus datos en iov (o todo el lote en uno con GSO). Se dan por
+ * mandados; si después falla alguno, transfer_on_enviado vuelve atrás. */
+static int encolar_lote(transfer_t *t, struct iovec *iov, int cant, size_t gso_size)
+{
+    int encolados = 0;
+    if (gso_size > 0 && cant > 1)
+    {
+        uring_op_t *op = uring_enviar(t->uring, t->sockfd, t->fijo, &t->destino, iov, 2 * cant, gso_size);
+        encolados = encolado(t, op, t->siguiente) ? cant : 0;
+    }
+    else
+        for (; encolados < cant; encolados++)
+        {
+            uring_op_t *op = uring_enviar(t->uring, t->sockfd, t->fijo, &t->destino, iov + 2 * encolados, 2, 0);
+            if (!encolado(t, op, t->siguiente + encolados))
+                break;
+        }
+    t->io.tx_paquetes += encolados;
+    if (encolados == 0)
+        errno = ENOMEM;
+    return encolados > 0 ? encolados : -1;
+}
+
+/* RFC 7440: se mandan hasta windowsize bloques y se espera un ACK. El
+ * cliente confirma el último bloque que recibió en orden; si no es el último
+ * de la ventana, se vuelve a mandar desde el siguiente. Los bloques se
+ * cuentan en 64 bits y en el paquete va el número módulo 65536, así que un
+ * archivo puede tener más de 65535 bloques. La ventana sale de a lotes de
+ * hasta t->lote bloques por syscall. Devuelve -1 si falló la lectura. */
+static int enviar_ventana(transfer_t *t)
+{
+    size_t cantidad_bytes = t->opts.blksize;
+    t->bloqueado = 0;
+    while (t->siguiente < t->base + t->opts.windowsize && (t->ultimo == 0 || t->siguiente <= t->ultimo))
+    {
+        uint64_t hasta = t->base + t->opts.windowsize;
+        if (t->ultimo != 0 && hasta > t->ultimo + 1)
+            hasta = t->ultimo + 1;
+        int cant = hasta - t->siguiente < (uint64_t)t->lote ? (int)(hasta - t->siguiente) : t->lote;
+        uint64_t offset = (t->siguiente - 1) * cantidad_bytes;
+
+        /* los datos salen directo de las páginas del archivo, o de una sola
+         * pread para todo el lote; en netascii, codificados en pkt */
+        const uint8_t *datos = t->mapa ? t->mapa + offset : t->pkt;
+        size_t disponibles = offset < t->tam_mapa ? t->tam_mapa - offset : 0;
+        if (t->mapa == NULL)
+        {
+            ssize_t leidos =
+                t->ascii ? codificar_lote(t, cant) : pread(t->fd, t->pkt, cant * cantidad_bytes, (off_t)offset);
+            if (leidos < 0)
+            {
+                log_error("%s: pread: %s", t->peer_str, strerror(errno));
+                enviar_error(t->sockfd, &t->peer, t->peer_len, 0, "Read error");
+                return -1;
+            }
+            disponibles = leidos;
+        }
+
+        // cabecera y datos de cada bloque; el primero corto es el último del archivo
+        struct iovec iov[2 * UDP_LOTE_MAX];
+        int corto = 0;
+        for (int i = 0; i < cant; i++)
+        {
+            size_t desde = i * cantidad_bytes;
+            size_t largo = disponibles > desde ? disponibles - desde : 0;
+            if (largo >= cantidad_bytes)
+                largo = cantidad_bytes;
+            else
+            {
+                cant = i + 1;
+                corto = 1;
+            }
+            iov[2 * i] = (struct iovec){.iov_base = cabeceras[(uint16_t)(t->siguiente + i)], .iov_len = TFTP_HDR_SIZE};
+            iov[2 * i + 1] = (struct iovec){.iov_base = (void *)(datos + desde), .iov_len = largo};
+        }
+
+        int flags = t->zerocopy ? MSG_ZEROCOPY : 0;
+        size_t gso_size = t->gso ? TFTP_HDR_SIZE + cantidad_bytes : 0;
+        /* con io_uring lo que sale de las páginas del archivo se encola; lo
+         * leído a pkt se manda en el momento, porque el lote siguiente lo pisa */
+        int enviados = t->uring && datos != t->pkt
+                           ? encolar_lote(t, iov, cant, gso_size)
+                           : udp_enviar_lote(t->sockfd, &t->destino, sizeof(t->destino), iov, 2, cant, flags,
+                                             gso_size, &t->io);
+        if (enviados < 0 && gso_size > 0 && (errno == EINVAL || errno == EIO))
+        {
+            // la interfaz no segmenta bloques de este tamaño: de acá en más, sendmmsg
+            log_debug("%s: UDP_SEGMENT: %s, sigo sin GSO", t->peer_str, strerror(errno));
+            t->gso = 0;
+            t->lote = rrq_lote(t);
+            continue;
+        }
+        if (enviados < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // buffer del socket lleno: el engine avisa cuando se puede seguir
+                t->bloqueado = 1;
+                break;
+            }
+            if (errno == EFAULT)
+            {
+                // alguien achicó el archivo mapeado mientras se mandaba
+                log_error("%s: el archivo cambió durante la transferencia", t->peer_str);
+                enviar_error(t->sockfd, &t->peer, t->peer_len, 0, "Read error");
+                return -1;
+            }
+            log_debug("%s: sendmmsg: %s", t->peer_str, strerror(errno));
+            break;
+        }
+        // sólo se mide un lote que sale por primera vez
+        if (t->siguiente > t->max_enviado)
+            medir_desde(t, t->siguiente + enviados - 1);
+        else
+            t->midiendo = 0;
+        t->siguiente += enviados;
+        t->enviado_ns = now_ns();
+        if (t->siguiente - 1 > t->max_enviado)
+            t->max_enviado = t->siguiente - 1;
+        if (corto && enviados == cant)
+            t->ultimo = t->siguiente - 1;
+        if (enviados < cant)
+        {
+            // sendmmsg cortó a mitad del lote: el próximo intento dice por qué
+            t->bloqueado = 1;
+            break;
+        }
+    }
+    armar_timer(t);
+    return 0;
+}
+
+/* ----- multicast (RFC 2090) ----- */
+
+// ip:puerto del cliente, para los logs
+static void fijar_peer(transfer_t *t, const struct sockaddr_in *peer)
+{
+    char ipstr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &peer->sin_addr, ipstr, sizeof(ipstr));
+    t->peer = *peer;
+    t->peer_len = sizeof(*peer);
+    snprintf(t->peer_str, sizeof(t->peer_str), "%s:%u", ipstr, ntohs(peer->sin_port));
+}
+
+static int mismo_peer(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// OACK con las opciones que pidió el cliente y "grupo,puerto,mc" de la sesión
+static size_t oack_multicast(const transfer_t *t, tftp_options_t o, int master, char *buf, size_t cap)
+{
+    char grupo[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &t->destino.sin_addr, grupo, sizeof(grupo));
+    snprintf(o.multicast, sizeof(o.multicast), "%s,%u,%d", grupo, ntohs(t->destino.sin_port), master);
+    o.tsize = t->opts.tsize;
+    return build_oack(buf, cap, &o);
+}
+
+static int buscar_miembro(const transfer_t *t, const struct sockaddr_in *peer)
+{
+    for (int i = 0; i < t->cant_miembros; i++)
+        if (mismo_peer(&t->miembros[i].peer, peer))
+            return i;
+    return -1;
+}
+
+static void sacar_miembro(transfer_t *t, int i)
+{
+    t->cant_miembros--;
+    memmove(&t->miembros[i], &t->miembros[i + 1], (t->cant_miembros - i) * sizeof(miembro_t));
+}
+
+/* Terminó el master (o dejó de contestar): el primero de la cola pasa a
+ * serlo con un OACK mc=1 y confirma lo último que tiene en orden; desde ahí
+ * se sigue mandando al grupo. Sin nadie en la cola se terminó la sesión. */
+static int promover(transfer_t *t)
+{
+    if (t->cant_miembros == 0)
+    {
+        log_info("%s: sesión multicast completa", t->peer_str);
+        return TRANSFER_DONE;
+    }
+    miembro_t m = t->miembros[0];
+    sacar_miembro(t, 0);
+    fijar_peer(t, &m.peer);
+    t->oack_len = oack_multicast(t, m.opts, 1, t->oack, sizeof(t->oack));
+    t->esperando_oack = 1;
+    t->retries = 0;
+    log_info("%s: pasa a ser el master de la sesión multicast", t->peer_str);
+    enviar(t, t->oack, t->oack_len);
+    medir_desde(t, 0);
+    armar_timer(t);
+    return TRANSFER_CONTINUE;
+}
+
+// la sesión en curso del mismo archivo con el mismo tamaño de bloque y de ventana
+static transfer_t *buscar_sesion(transfer_compartido_t *comp, const char *filename, const tftp_options_t *o)
+{
+    for (transfer_t *s = comp->sesiones; s; s = s->sesion_sig)
+        if (strcmp(s->filename, filename) == 0 && s->opts.has_blksize == o->has_blksize &&
+            s->opts.blksize == o->blksize && s->opts.has_windowsize == o->has_windowsize &&
+            s->opts.windowsize == o->windowsize)
+            return s;
+    return NULL;
+}
+
+/* Un cliente más para la sesión: recibe lo que se está mandando desde ahora
+ * y espera su turno de master para pedir lo que le falte. Si ya estaba (se
+ * repitió el RRQ) sólo se le vuelve a mandar su OACK. */
+static void sumar_miembro(transfer_t *s, const struct sockaddr_in *peer, const tftp_options_t *o)
+{
+    if (mismo_peer(&s->peer, peer))
+    {
+        enviar(s, s->oack, s->oack_len);
+        if (s->esperando_oack)
+            s->midiendo = 0;
+        return;
+    }
+    int i = buscar_miembro(s, peer);
+    if (i < 0)
+    {
+        if (s->cant_miembros == s->cap_miembros)
+        {
+            int cap = s->cap_miembros ? 2 * s->cap_miembros : 8;
+            miembro_t *m = realloc(s->miembros, cap * sizeof(miembro_t));
+            if (m == NULL)
+            {
+                log_error("realloc: %s", strerror(errno));
+                return;
+            }
+            s->miembros = m;
+            s->cap_miembros = cap;
+        }
+        i = s->cant_miembros++;
+        s->miembros[i] = (miembro_t){.peer = *peer, .opts = *o};
+        char ipstr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &peer->sin_addr, ipstr, sizeof(ipstr));
+        log_info("%s:%u se suma a la sesión multicast de \"%s\" (%d esperando)", ipstr, ntohs(peer->sin_port),
+                 s->filename, s->cant_miembros);
+    }
+    char oack[TFTP_MAX_PAYLOAD_SIZE];
+    size_t len = oack_multicast(s, s->miembros[i].opts, 0, oack, sizeof(oack));
+    s->io.tx_syscalls++;
+    if (sendto(s->sockfd, oack, len, 0, (const struct sockaddr *)peer, sizeof(*peer)) >= 0)
+        s->io.tx_paquetes++;
+}
+
+// elige un puerto que no use otra sesión y anota la transferencia en comp
+static int abrir_sesion(transfer_t *t, const char *filename)
+{
+    uint16_t puerto = 0;
+    for (int i = t->cfg->mc_primero; i < MC_MAX_SESIONES && puerto == 0; i += t->cfg->mc_paso)
+    {
+        puerto = t->cfg->mc_puerto + i;
+        for (transfer_t *s = t->comp->sesiones; s; s = s->sesion_sig)
+            if (ntohs(s->destino.sin_port) == puerto)
+                puerto = 0;
+    }
+    if (puerto == 0)
+    {
+        log_warn("%s: no queda un puerto libre para otra sesión multicast, se manda sólo a este cliente", t->peer_str);
+        return -1;
+    }
+    if (t->cfg->mc_interfaz.s_addr != INADDR_ANY &&
+        setsockopt(t->sockfd, IPPROTO_IP, IP_MULTICAST_IF, &t->cfg->mc_interfaz, sizeof(t->cfg->mc_interfaz)) < 0)
+    {
+        log_error("%s: IP_MULTICAST_IF: %s", t->peer_str, strerror(errno));
+        return -1;
+    }
+    t->destino = (struct sockaddr_in){.sin_family = AF_INET, .sin_addr = t->cfg->mc_grupo, .sin_port = htons(puerto)};
+    strncpy(t->filename, filename, sizeof(t->filename) - 1);
+    t->multicast = 1;
+    t->sesion_sig = t->comp->sesiones;
+    t->comp->sesiones = t;
+    return 0;
+}
+
+/* Un ACK que no avanza puede ser el cliente que, cansado de esperar, pide
+ * de nuevo la ventana; o un duplicado de la red, o la segunda respuesta a un
+ * bloque que se retransmitió. Contestar éstos con otra ventana es el
+ * "Sorcerer's Apprentice" de RFC 1123: cada DATA sale dos veces de ahí en
+ * más. Llegan a menos de un RTT de lo último mandado, así que sólo se
+ * retransmite por uno que llegue después; los más viejos se ignoran siempre. */
+static int ack_repetido(transfer_t *t, uint64_t confirmado, uint16_t ack_block)
+{
+    if (confirmado == t->base - 1 && now_ns() - t->enviado_ns >= t->srtt_ns + 4 * t->rttvar_ns)
+        return 0;
+    t->acks_repetidos++;
+    log_debug("%s: ACK %u repetido. Se ignora.", t->peer_str, ack_block);
+    return 1;
+}
+
+static int rrq_on_packet(transfer_t *t, const tftp_packet_t *ack_pkt, ssize_t ack_len)
+{
+    uint16_t opcode = ack_len >= 2 ? ntohs(ack_pkt->opcode) : 0;
+    // extrae los dos primeros bytes del payload que son el numero de bloque (o código de error)
+    uint16_t ack_block = 0;
+    if (ack_len >= 4)
+    {
+        memcpy(&ack_block, ack_pkt->payload, 2);
+        ack_block = ntohs(ack_block);
+    }
+
+    if (ack_len >= 4 && opcode == OPCODE_ERROR)
+    {
+        log_info("%s: el cliente abortó la transferencia (error %u)", t->peer_str, ack_block);
+        return t->multicast ? promover(t) : TRANSFER_DONE;
+    }
+    if (ack_len < 4 || opcode != OPCODE_ACK) // minimo 4 bytes y opcode 4, o sea, un ACK
+    {
+        log_warn("%s: ACK inválido o error de recepción", t->peer_str);
+        return t->multicast ? promover(t) : TRANSFER_DONE;
+    }
+
+    uint64_t confirmado;
+    if (t->multicast)
+    {
+        /* El master puede tener bloques que recibió antes, cuando era uno más
+         * de la sesión: su ACK (también el que contesta al OACK) puede estar
+         * muy atrás o adelante de lo último mandado. Se toma el número más
+         * cercano; ultimo se conoce desde el principio. */
+        confirmado = t->base - 1 + (int16_t)(ack_block - (uint16_t)(t->base - 1));
+        if (t->esperando_oack)
+        {
+            t->esperando_oack = 0;
+            t->retries = 0;
+            if (t->midiendo)
+                cerrar_muestra(t);
+        }
+        else if (confirmado < t->base && ack_repetido(t, confirmado, ack_block))
+            return TRANSFER_CONTINUE;
+        if (confirmado > t->ultimo)
+        {
+            log_debug("%s: ACK fuera del archivo (%u). Se ignora.", t->peer_str, ack_block);
+            return TRANSFER_CONTINUE;
+        }
+    }
+    else
+    {
+        if (t->esperando_oack)
+        {
+            if (ack_block != 0)
+            {
+                log_warn("%s: respuesta inválida al OACK", t->peer_str);
+                return TRANSFER_DONE;
+            }
+            t->esperando_oack = 0;
+            t->retries = 0;
+            if (t->midiendo)
+                cerrar_muestra(t);
+            return enviar_ventana(t) < 0 ? TRANSFER_DONE : TRANSFER_CONTINUE;
+        }
+
+        confirmado = block_unwrap(t->base - 1, ack_block);
+        if (confirmado >= t->siguiente)
+        {
+            // un ACK de antes de la ventana actual (o de algo nunca mandado)
+            log_debug("%s: ACK fuera de ventana (%u). Se ignora.", t->peer_str, ack_block);
+            return TRANSFER_CONTINUE;
+        }
+        if (confirmado < t->base && ack_repetido(t, confirmado, ack_block))
+            return TRANSFER_CONTINUE;
+    }
+
+    if (t->midiendo && confirmado >= t->muestra_bloque)
+        cerrar_muestra(t);
+
+    if (confirmado < t->siguiente - 1)
+        log_debug("%s: ACK %llu en medio de la ventana, retransmito desde el bloque %llu", t->peer_str,
+                  (unsigned long long)confirmado, (unsigned long long)(confirmado + 1));
+    if (confirmado >= t->base)
+        t->retries = 0;
+    t->base = confirmado + 1;
+    t->siguiente = t->base;
+    if (t->ultimo != 0 && confirmado == t->ultimo)
+    {
+        log_info("%s: transferencia completa", t->peer_str);
+        return t->multicast ? promover(t) : TRANSFER_DONE;
+    }
+    return enviar_ventana(t) < 0 ? TRANSFER_DONE : TRANSFER_CONTINUE;
+}
+
+static int rrq_on_timeout(transfer_t *t)
+{
+    t->retries++;
+    if (t->retries > t->cfg->max_retries)
+    {
+        log_warn("%s: máximo de %d reintentos alcanzado para bloque %llu. Cerrando conexión.", t->peer_str,
+                 t->cfg->max_retries, (unsigned long long)t->base);
+        return t->multicast ? promover(t) : TRANSFER_DONE;
+    }
+    retroceder(t);
+    if (t->esperando_oack)
+    {
+        log_debug("%s: timeout esperando ACK 0 (intento %d/%d), retransmito OACK con RTO de %llu ms", t->peer_str,
+                  t->retries, t->cfg->max_retries, (unsigned long long)(t->rto_ns / 1000000));
+        enviar(t, t->oack, t->oack_len);
+        armar_timer(t);
+        return TRANSFER_CONTINUE;
+    }
+    log_debug("%s: timeout esperando ACK %llu (intento %d/%d), retransmito desde el bloque %llu con RTO de %llu ms",
+              t->peer_str, (unsigned long long)(t->siguiente - 1), t->retries, t->cfg->max_retries,
+              (unsigned long long)t->base, (unsigned long long)(t->rto_ns / 1000000));
+    t->siguiente = t->base; // volver al último ACK
+    return enviar_ventana(t) < 0 ? TRANSFER_DONE : TRANSFER_CONTINUE;
+}
+
+/* Abre el archivo para esta transferencia sola. Con el archivo mapeado cada
+ * DATA se arma con sendmsg a partir de la cabecera y un puntero al mapa, sin
+ * copiarlo antes a un buffer propio. Si no se puede mapear (vacío, no
+ * regular, sin memoria) se usa pread; al volver atrás en la ventana se relee
+ * cualquier bloque igual. */
+static int rrq_abrir(transfer_t *t, const char *filename)
+{
+    t->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (t->fd < 0)
+    {
+        log_warn("%s: error al abrir el archivo RRQ: %s", t->peer_str, strerror(errno));
+        enviar_error(t->sockfd, &t->peer, t->peer_len, ERROR_FILE_NOT_FOUND, "File not found");
+        return -1;
+    }
+
+    // RFC 2349: en un RRQ el cliente manda tsize 0 y el servidor contesta el tamaño
+    struct stat st;
+    int hay_stat = fstat(t->fd, &st) == 0;
+    if (hay_stat)
+        t->opts.tsize = st.st_size;
+    else
+        t->opts.has_tsize = 0;
+
+    // netascii se lee con pread, ver codificar_lote
+    if (hay_stat && S_ISREG(st.st_mode) && st.st_size > 0 && !t->ascii)
+    {
+        void *mapa = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, t->fd, 0);
+        if (mapa != MAP_FAILED)
+        {
+            madvise(mapa, st.st_size, MADV_SEQUENTIAL);
+            t->mapa = mapa;
+            t->tam_mapa = st.st_size;
+        }
+        else
+            log_debug("%s: mmap: %s, se lee con pread", t->peer_str, strerror(errno));
+    }
+    return 0;
+}
+
+static int rrq_start(transfer_t *t, const char *filename, const char *mode, int cant_opciones)
+{
+    log_info("Paquete de %s RRQ → filename=\"%s\", mode=\"%s\", %d opcion(es), blksize=%zu, windowsize=%d",
+             t->peer_str, filename, mode, cant_opciones, t->opts.blksize, t->opts.windowsize);
+
+    /* Con caché, las lecturas del mismo archivo comparten un solo mapa; si no
+     * está ahí ni se puede cargar, esta transferencia lo abre por su cuenta. */
+    pthread_once(&cabeceras_once, armar_cabeceras);
+    if (t->comp && t->comp->cache && !t->ascii &&
+        (t->entrada = cache_obtener(t->comp->cache, filename, &t->mapa, &t->tam_mapa)) != NULL)
+        t->opts.tsize = t->tam_mapa;
+    else if (rrq_abrir(t, filename) < 0)
+        return -1;
+    /* En netascii tsize tendría que ser lo que se va a mandar, con los fines
+     * de línea ya traducidos, y eso obliga a leer todo el archivo antes de
+     * empezar: la opción no se contesta (RFC 2349 lo permite). */
+    if (t->ascii && t->opts.has_tsize)
+    {
+        t->opts.has_tsize = 0;
+        cant_opciones--;
+    }
+
+    /* RFC 2090: hace falta el archivo mapeado para saber de entrada cuál es
+     * el último bloque; si no, o sin lugar para otra sesión, se contesta como
+     * a un RRQ común. */
+    if (t->opts.has_multicast && (t->mapa == NULL || abrir_sesion(t, filename) < 0))
+    {
+        t->opts.has_multicast = 0;
+        cant_opciones--;
+    }
+    if (t->multicast)
+        t->ultimo = t->tam_mapa / t->opts.blksize + 1;
+
+    // GSO sólo sirve si entran al menos dos bloques en un datagrama
+    t->gso = t->gso && t->opts.windowsize > 1 && 2 * (TFTP_HDR_SIZE + t->opts.blksize) <= UDP_GSO_MAX;
+    t->lote = rrq_lote(t);
+    if (t->mapa == NULL)
+    {
+        t->pkt_cap = t->opts.blksize;
+        if ((t->pkt = malloc(t->lote * t->pkt_cap)) == NULL)
+        {
+            log_error("malloc: %s", strerror(errno));
+            return -1;
+        }
+    }
+    if (t->ascii)
+    {
+        // el bloque 1 empieza al principio del archivo, sin nada pendiente
+        t->ascii_pos = malloc((t->opts.windowsize + 1) * sizeof(netascii_pos_t));
+        t->ascii_buf = malloc(t->lote * t->opts.blksize);
+        if (t->ascii_pos == NULL || t->ascii_buf == NULL)
+        {
+            log_error("malloc: %s", strerror(errno));
+            return -1;
+        }
+        t->ascii_pos[1] = (netascii_pos_t){.offset = 0, .pendiente = -1};
+    }
+
+    // MSG_ZEROCOPY sólo desde el mapa: un buffer que se reusa no se puede prestar
+    int uno = 1;
+    t->zerocopy = t->zerocopy && t->mapa && t->opts.blksize >= ZEROCOPY_MIN_BLKSIZE &&
+                  setsockopt(t->sockfd, SOL_SOCKET, SO_ZEROCOPY, &uno, sizeof(uno)) == 0;
+
+    t->base = t->siguiente = 1;
+    if (cant_opciones > 0)
+    {
+        // el cliente confirma el OACK con un ACK 0 antes del primer DATA
+        t->oack_len = t->multicast ? oack_multicast(t, t->opts, 1, t->oack, sizeof(t->oack))
+                                   : build_oack(t->oack, sizeof(t->oack), &t->opts);
+        t->esperando_oack = 1;
+        enviar(t, t->oack, t->oack_len);
+        medir_desde(t, 0);
+        armar_timer(t);
+        return 0;
+    }
+    return enviar_ventana(t);
+}
+
+/* ----- WRQ ----- */
+
+static int wrq_abortar(transfer_t *t)
+{
+    // se borra el temporal: con el nombre pedido no queda nada a medias
+    salida_descartar(t->out);
+    t->out = NULL;
+    return TRANSFER_DONE;
+}
+
+// el ERROR que corresponde a un errno al crear o guardar el archivo
+static void enviar_error_salida(transfer_t *t, int err)
+{
+    if (err == EEXIST)
+        enviar_error(t->sockfd, &t->peer, t->peer_len, ERROR_FILE_EXISTS, "File already exists");
+    else if (err == ENOSPC || err == EDQUOT || err == EFBIG)
+        enviar_error(t->sockfd, &t->peer, t->peer_len, ERROR_DISK_FULL, "Disk full or allocation exceeded");
+    else
+        enviar_error(t->sockfd, &t->peer, t->peer_len, ERROR_ACCESS_VIOLATION, strerror(err));
+}
+
+// vuelve a confirmar el último bloque en orden (o el OACK si todavía no llegó DATA1)
+static void confirmar_ultimo(transfer_t *t)
+{
+    if (t->esperado == 1 && t->oack_len > 0)
+        enviar(t, t->oack, t->oack_len);
+    else
+        enviar_ack(t, t->esperado - 1);
+}
+
+// el último ACK sale con el archivo ya en su lugar; si no se pudo guardar, el cliente recibe un ERROR
+static int wrq_guardado(transfer_t *t, int r)
+{
+    if (r < 0)
+    {
+        log_error("%s: al guardar \"%s\": %s", t->peer_str, t->filename, strerror(errno));
+        enviar_error_salida(t, errno);
+        return TRANSFER_DONE;
+    }
+    enviar_ack(t, t->esperado);
+    log_info("%s: se llegó al final del archivo WRQ", t->peer_str);
+    return TRANSFER_DONE;
+}
+
+/* RFC 7440: el cliente manda windowsize bloques seguidos y se confirma el
+ * último. Si llega uno salteado o repetido se vuelve a confirmar el último
+ * recibido en orden, para que el cliente retome desde ahí: el primero
+ * enseguida y después uno cada windowsize, por si se pierde ese ACK sin
+ * inundar al cliente. Igual que en RRQ el número se cuenta en 64 bits. */
+static int wrq_on_packet(transfer_t *t, const uint8_t *pkt, ssize_t n)
+{
+    size_t cantidad_bytes = t->opts.blksize;
+    uint16_t opcode = 0;
+    if (n >= TFTP_HDR_SIZE)
+    {
+        memcpy(&opcode, pkt, 2);
+        opcode = ntohs(opcode);
+    }
+    if (opcode == OPCODE_ERROR)
+    {
+        log_info("%s: el cliente abortó la transferencia", t->peer_str);
+        return wrq_abortar(t);
+    }
+    // lo que llegue mientras se espera al escritor se vuelve a pedir después
+    if (t->esperando_disco || t->guardando)
+        return TRANSFER_CONTINUE;
+    if (opcode != OPCODE_DATA || n > (ssize_t)(TFTP_HDR_SIZE + cantidad_bytes))
+    {
+        log_warn("%s: esperaba un paquete de DATA y recibió otro opcode: %d (%zd bytes)", t->peer_str, opcode, n);
+        return wrq_abortar(t);
+    }
+
+    uint16_t block_number_received;
+    memcpy(&block_number_received, pkt + 2, 2);
+    block_number_received = ntohs(block_number_received);
+    // distancia hacia adelante desde el esperado; la mitad de arriba son bloques ya recibidos
+    uint16_t adelanto = block_number_received - (uint16_t)t->esperado;
+
+    if (adelanto != 0)
+    {
+        log_debug("%s: bloque %s en WRQ (recibido %u, esperado %llu)", t->peer_str,
+                  adelanto >= 0x8000 ? "repetido" : "salteado", block_number_received,
+                  (unsigned long long)t->esperado);
+        if (t->fuera_de_orden++ % t->opts.windowsize == 0)
+        {
+            confirmar_ultimo(t);
+            t->midiendo = 0;
+            t->en_ventana = 0;
+        }
+        return TRANSFER_CONTINUE;
+    }
+
+    int eof = n < (ssize_t)(TFTP_HDR_SIZE + cantidad_bytes);
+    const uint8_t *datos = pkt + TFTP_HDR_SIZE;
+    size_t cant_a_escribir = n - TFTP_HDR_SIZE; // 2 bytes opcode + 2 bytes bloque
+    int cr = t->ascii_cr;
+    if (t->ascii)
+    {
+        cant_a_escribir = netascii_decodificar(datos, cant_a_escribir, t->ascii_buf, &t->ascii_cr);
+        datos = t->ascii_buf;
+        // un CR al final del archivo no tiene con qué formar pareja: queda solo
+        if (eof && t->ascii_cr)
+            t->ascii_buf[cant_a_escribir++] = '\r';
+    }
+    int w = salida_escribir(t->out, datos, cant_a_escribir);
+    if (w < 0)
+    {
+        log_error("%s: pwrite: %s", t->peer_str, strerror(errno));
+        enviar_error_salida(t, errno);
+        return wrq_abortar(t);
+    }
+    if (w == SALIDA_LLENA)
+    {
+        // el disco va más lento que la red: el bloque queda sin confirmar hasta que se libere un buffer
+        log_debug("%s: sin buffer libre para DATA %llu, espero al escritor", t->peer_str,
+                  (unsigned long long)t->esperado);
+        t->ascii_cr = cr;
+        t->esperando_disco = 1;
+        t->midiendo = 0;
+        t->en_ventana = 0;
+        return TRANSFER_CONTINUE;
+    }
+
+    t->retries = 0;
+    t->fuera_de_orden = 0;
+    t->en_ventana++;
+    if (t->midiendo && t->esperado == t->muestra_bloque)
+        cerrar_muestra(t);
+
+    if (eof)
+    {
+        int r = salida_confirmar(t->out);
+        if (r == SALIDA_EN_CURSO)
+        {
+            // sin timer: el aviso del escritor llega siempre
+            t->guardando = 1;
+            t->deadline_ns = 0;
+            return TRANSFER_CONTINUE;
+        }
+        t->out = NULL;
+        return wrq_guardado(t, r);
+    }
+
+    // Enviar ACK-N al completar la ventana; se mide hasta el primero de la siguiente
+    if (t->en_ventana == t->opts.windowsize)
+    {
+        enviar_ack(t, t->esperado);
+        medir_desde(t, t->esperado + 1);
+        t->en_ventana = 0;
+    }
+    t->esperado++;
+    armar_timer(t);
+    return TRANSFER_CONTINUE;
+}
+
+static int wrq_on_timeout(transfer_t *t)
+{
+    // no llegó DATA-N en timeout: reenviar ACK-(N-1), o el OACK si era DATA1
+    t->retries++;
+    if (t->retries > t->cfg->max_retries)
+    {
+        log_warn("%s: máximo de %d reintentos esperando DATA %llu. Abortando.", t->peer_str, t->cfg->max_retries,
+                 (unsigned long long)t->esperado);
+        return wrq_abortar(t);
+    }
+    retroceder(t);
+    log_debug("%s: timeout esperando DATA %llu (intento %d/%d), retransmito ACK %llu con RTO de %llu ms",
+              t->peer_str, (unsigned long long)t->esperado, t->retries, t->cfg->max_retries,
+              (unsigned long long)(t->esperado - 1), (unsigned long long)(t->rto_ns / 1000000));
+    t->en_ventana = 0;
+    confirmar_ultimo(t);
+    armar_timer(t);
+    return TRANSFER_CONTINUE;
+}
+
+static int wrq_start(transfer_t *t, const char *filename, const char *mode, int cant_opciones)
+{
+    strncpy(t->filename, filename, sizeof(t->filename) - 1);
+    log_info("Paquete de %s WRQ → filename=\"%s\", mode=\"%s\", %d opcion(es), blksize=%zu, windowsize=%d",
+             t->peer_str, t->filename, mode, cant_opciones, t->opts.blksize, t->opts.windowsize);
+
+    /* RFC 2349: con tsize el cliente avisa el tamaño y se puede rechazar de
+     * entrada. Se mira el filesystem del directorio donde va a quedar, que
+     * no tiene por qué ser el del directorio actual. */
+    char dir[sizeof(t->filename)];
+    const char *barra = strrchr(t->filename, '/');
+    snprintf(dir, sizeof(dir), "%.*s", barra ? (int)(barra - t->filename + 1) : 1, barra ? t->filename : ".");
+    struct statvfs vfs;
+    if (t->opts.has_tsize && statvfs(dir, &vfs) == 0 && t->opts.tsize > (uint64_t)vfs.f_bavail * vfs.f_frsize)
+    {
+        enviar_error(t->sockfd, &t->peer, t->peer_len, ERROR_DISK_FULL, "Disk full or allocation exceeded");
+        log_warn("%s: WRQ de %llu bytes no entra en el disco", t->peer_str, (unsigned long long)t->opts.tsize);
+        return -1;
+    }
+
+    // un byte de más para reconocer un DATA más grande que el blksize negociado
+    t->pkt_cap = TFTP_HDR_SIZE + t->opts.blksize + 1;
+    t->lote = t->opts.windowsize < UDP_LOTE_MAX ? t->opts.windowsize : UDP_LOTE_MAX;
+    if (t->lote * t->pkt_cap > LOTE_MAX_BYTES)
+        t->lote = LOTE_MAX_BYTES / t->pkt_cap > 0 ? LOTE_MAX_BYTES / t->pkt_cap : 1;
+    if ((t->pkt = malloc(t->lote * t->pkt_cap)) == NULL)
+    {
+        log_error("malloc: %s", strerror(errno));
+        return -1;
+    }
+    // lo decodificado de un bloque, más un CR que venga del anterior
+    if (t->ascii && (t->ascii_buf = malloc(t->opts.blksize + 1)) == NULL)
+    {
+        log_error("malloc: %s", strerror(errno));
+        return -1;
+    }
+
+    // se escribe en un temporal que toma el nombre pedido recién al final, sin pisar uno que ya exista
+    t->out = salida_abrir(t->filename, t->opts.has_tsize ? t->opts.tsize : 0, t->comp ? t->comp->escritor : NULL, t);
+    if (t->out == NULL)
+    {
+        int err = errno;
+        log_warn("%s: error al abrir el archivo WRQ: %s", t->peer_str, err == EEXIST ? "ya existe" : strerror(err));
+        enviar_error_salida(t, err);
+        return -1;
+    }
+
+    /* Con opciones se contesta OACK y el cliente arranca con DATA1 igual que
+     * después de un ACK0; sin opciones, ACK0 como siempre. */
+    if (cant_opciones > 0)
+        t->oack_len = build_oack(t->oack, sizeof(t->oack), &t->opts);
+    t->esperado = 1;
+    confirmar_ultimo(t);
+    medir_desde(t, 1);
+    armar_timer(t);
+    return 0;
+}
+
+/* ----- comunes ----- */
+
+transfer_t *transfer_start(const tftp_packet_t *pkt, ssize_t n, const struct sockaddr_in *peer,
+                           socklen_t peer_len, const transfer_config_t *cfg, transfer_compartido_t *comp)
+{
+    uint16_t opcode = ntohs(pkt->opcode);
+    if (opcode != OPCODE_RRQ && opcode != OPCODE_WRQ)
+    {
+        char ipstr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &peer->sin_addr, ipstr, sizeof(ipstr));
+        log_debug("Paquete de %s:%u con opcode desconocido: %u", ipstr, ntohs(peer->sin_port), opcode);
+        return NULL;
+    }
+
+    transfer_t *t = calloc(1, sizeof(transfer_t));
+    if (t == NULL)
+    {
+        log_error("calloc: %s", strerror(errno));
+        return NULL;
+    }
+    t->fd = -1;
+    t->fijo = -1;
+    t->opcode = opcode;
+    fijar_peer(t, peer);
+    t->peer_len = peer_len;
+    t->destino = *peer;
+    t->cfg = cfg;
+    t->comp = comp;
+    t->zerocopy = cfg->zerocopy;
+    t->gso = cfg->gso;
+
+    // socket efímero: el puerto que elija el kernel es el TID del servidor
+    t->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (t->sockfd < 0)
+    {
+        log_error("socket: %s", strerror(errno));
+        free(t);
+        return NULL;
+    }
+
+    /* En RRQ/WRQ el payload es:
+     *   Filename\0Mode\0 { Opcion\0Valor\0 } *
+     * Nada garantiza los terminadores, así que se buscan dentro de lo recibido. */
+    const char *filename = pkt->payload;
+    const char *fin = pkt->payload + (n - 2);
+    const char *fin_filename = memchr(filename, '\0', fin - filename);
+    const char *mode = fin_filename ? fin_filename + 1 : NULL;
+    const char *fin_mode = mode && mode < fin ? memchr(mode, '\0', fin - mode) : NULL;
+    int cant_opciones = -1;
+    if (fin_mode)
+        cant_opciones = parse_options(fin_mode + 1, fin, &t->opts);
+    if (cant_opciones < 0)
+    {
+        log_warn("Pedido mal formado de %s", t->peer_str);
+        enviar_error(t->sockfd, &t->peer, t->peer_len, ERROR_ILLEGAL_OPERATION, "Malformed request");
+        transfer_free(t);
+        return NULL;
+    }
+    // RFC 1350: "mail" ya no se usa
+    if (strcasecmp(mode, "netascii") == 0)
+        t->ascii = 1;
+    else if (strcasecmp(mode, "octet") != 0)
+    {
+        log_warn("%s: modo no soportado: \"%s\"", t->peer_str, mode);
+        enviar_error(t->sockfd, &t->peer, t->peer_len, ERROR_ILLEGAL_OPERATION, "Unsupported mode");
+        transfer_free(t);
+        return NULL;
+    }
+    if (t->opts.has_multicast && opcode == OPCODE_RRQ && cfg->mc_puerto != 0 && comp && !t->ascii)
+    {
+        transfer_t *s = buscar_sesion(comp, filename, &t->opts);
+        if (s)
+        {
+            sumar_miembro(s, peer, &t->opts);
+            transfer_free(t);
+            return NULL;
+        }
+    }
+    else if (t->opts.has_multicast)
+    {
+        // sin grupo configurado (o en un WRQ, o en netascii) la opción no se acepta
+        t->opts.has_multicast = 0;
+        cant_opciones--;
+    }
+    /* RFC 2349: el timeout pedido reemplaza al del servidor en esta
+     * transferencia y no se adapta; si no, el del servidor es el RTO hasta
+     * la primera medición. */
+    t->adaptativo = !t->opts.has_timeout;
+    t->rto_ns = t->opts.has_timeout ? (uint64_t)t->opts.timeout * 1000000000 : cfg->timeout_ns;
+    t->azar = (now_ns() ^ (uintptr_t)t) | 1;
+
+    int r = opcode == OPCODE_RRQ ? rrq_start(t, filename, mode, cant_opciones)
+                                 : wrq_start(t, filename, mode, cant_opciones);
+    if (r < 0)
+    {
+        transfer_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+/* Los avisos de MSG_ZEROCOPY llegan por la cola de errores del socket (y la
+ * marcan con EPOLLERR hasta vaciarla). Cada uno cubre un rango de envíos;
+ * COPIED indica que el kernel terminó copiando, como pasa siempre en
+ * loopback. */
+static void leer_avisos_zerocopy(transfer_t *t)
+{
+    while (1)
+    {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+        struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof(control)};
+        if (recvmsg(t->sockfd, &msg, MSG_ERRQUEUE) < 0)
+            return;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR)
+                continue;
+            struct sock_extended_err ee;
+            memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+            if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            uint32_t cant = ee.ee_data - ee.ee_info + 1;
+            t->zc_envios += cant;
+            if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                t->zc_copiados += cant;
+        }
+    }
+}
+
+/* Un datagrama que llegó al socket de la transferencia. RFC 2090: los que no
+ * son master no confirman; un ERROR es que se van. */
+static int recibido(transfer_t *t, const uint8_t *buf, size_t n, const struct sockaddr_in *from)
+{
+    int m = t->multicast && !mismo_peer(from, &t->peer) ? buscar_miembro(t, from) : -1;
+    if (m >= 0)
+    {
+        uint16_t opcode = 0;
+        if (n >= 2)
+            memcpy(&opcode, buf, 2);
+        if (ntohs(opcode) == OPCODE_ERROR)
+        {
+            log_info("%s: un cliente dejó la sesión multicast", t->peer_str);
+            sacar_miembro(t, m);
+        }
+        return TRANSFER_CONTINUE;
+    }
+
+    // RFC 1350: un paquete de otro TID se rechaza sin cortar la transferencia
+    if (!mismo_peer(from, &t->peer))
+    {
+        log_debug("%s: paquete de un TID desconocido", t->peer_str);
+        enviar_error(t->sockfd, from, sizeof(*from), ERROR_UNKNOWN_TID, "Unknown transfer ID");
+        return TRANSFER_CONTINUE;
+    }
+
+    return t->opcode == OPCODE_WRQ ? wrq_on_packet(t, buf, n) : rrq_on_packet(t, (const tftp_packet_t *)buf, n);
+}
+
+int transfer_on_readable(transfer_t *t)
+{
+    if (t->zerocopy)
+        leer_avisos_zerocopy(t);
+    while (1)
+    {
+        // WRQ recibe un lote de DATA en pkt; a RRQ le llegan ACKs, alcanza con pocos
+        tftp_packet_t acks[LOTE_ACKS];
+        uint8_t *bufs = t->opcode == OPCODE_WRQ ? t->pkt : (uint8_t *)acks;
+        size_t cap = t->opcode == OPCODE_WRQ ? t->pkt_cap : sizeof(acks[0]);
+        int cant = t->opcode == OPCODE_WRQ ? t->lote : LOTE_ACKS;
+        size_t largos[UDP_LOTE_MAX];
+        struct sockaddr_in from[UDP_LOTE_MAX];
+
+        int n = udp_recibir_lote(t->sockfd, bufs, cap, cant, largos, from, &t->io);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return TRANSFER_CONTINUE;
+            log_error("%s: recvmmsg: %s", t->peer_str, strerror(errno));
+            return t->opcode == OPCODE_WRQ ? wrq_abortar(t) : TRANSFER_DONE;
+        }
+
+        for (int i = 0; i < n; i++)
+            if (recibido(t, bufs + i * cap, largos[i], &from[i]) == TRANSFER_DONE)
+                return TRANSFER_DONE;
+        // un lote incompleto vació el socket: no hace falta otra vuelta para ver EAGAIN
+        if (n < cant)
+            return TRANSFER_CONTINUE;
+    }
+}
+
+int transfer_preparar_rx(transfer_t *t)
+{
+    // WRQ recibe en los lugares de pkt, igual que con recvmmsg; RRQ, en unos pocos para ACKs
+    if (t->opcode == OPCODE_WRQ)
+    {
+        t->rx = t->pkt;
+        t->rx_cap = t->pkt_cap;
+        t->rx_cant = t->lote;
+        return 0;
+    }
+    t->rx_cap = sizeof(tftp_packet_t);
+    t->rx_cant = LOTE_ACKS;
+    t->rx = malloc(t->rx_cant * t->rx_cap);
+    return t->rx ? 0 : -1;
+}
+
+int transfer_on_datagrama(transfer_t *t, const uint8_t *buf, ssize_t n, const struct sockaddr_in *from)
+{
+    if (n < 0)
+    {
+        log_error("%s: recvmsg: %s", t->peer_str, strerror(-n));
+        return t->opcode == OPCODE_WRQ ? wrq_abortar(t) : TRANSFER_DONE;
+    }
+    t->io.rx_paquetes++;
+    return recibido(t, buf, n, from);
+}
+
+int transfer_on_enviado(transfer_t *t, uint64_t bloque, int res)
+{
+    // un ACK u OACK que no salió es como uno perdido: lo repite el timeout
+    if (res >= 0 || bloque == 0)
+        return TRANSFER_CONTINUE;
+    if (res == -EFAULT)
+    {
+        // alguien achicó el archivo mapeado mientras se mandaba
+        log_error("%s: el archivo cambió durante la transferencia", t->peer_str);
+        enviar_error(t->sockfd, &t->peer, t->peer_len, 0, "Read error");
+        return TRANSFER_DONE;
+    }
+
+    // buffer lleno o sin GSO se sigue en cuanto haya lugar; con otro error, cuando venza el timer
+    int seguir = res == -EAGAIN || res == -ENOBUFS;
+    if (t->gso && (res == -EINVAL || res == -EIO))
+    {
+        log_debug("%s: UDP_SEGMENT: %s, sigo sin GSO", t->peer_str, strerror(-res));
+        t->gso = 0;
+        t->lote = rrq_lote(t);
+        seguir = 1;
+    }
+    else if (!seguir)
+        log_debug("%s: sendmsg: %s", t->peer_str, strerror(-res));
+
+    // lo que no salió se vuelve a mandar, y no se mide
+    if (bloque >= t->base && bloque < t->siguiente)
+    {
+        t->siguiente = bloque;
+        t->midiendo = 0;
+        t->bloqueado |= seguir;
+    }
+    return TRANSFER_CONTINUE;
+}
+
+int transfer_on_writable(transfer_t *t)
+{
+    if (t->opcode == OPCODE_RRQ && t->bloqueado && !t->esperando_oack)
+        return enviar_ventana(t) < 0 ? TRANSFER_DONE : TRANSFER_CONTINUE;
+    return TRANSFER_CONTINUE;
+}
+
+int transfer_on_salida(transfer_t *t)
+{
+    if (t->guardando)
+    {
+        if (!salida_confirmada(t->out))
+            return TRANSFER_CONTINUE; // un buffer libre que se avisó antes del cierre
+        int r = salida_resultado(t->out);
+        t->out = NULL;
+        return wrq_guardado(t, r);
+    }
+    if (t->esperando_disco)
+    {
+        // el cliente sigue desde el bloque que no entró
+        t->esperando_disco = 0;
+        confirmar_ultimo(t);
+        medir_desde(t, t->esperado);
+        armar_timer(t);
+    }
+    return TRANSFER_CONTINUE;
+}
+
+int transfer_on_timeout(transfer_t *t)
+{
+    return t->opcode == OPCODE_WRQ ? wrq_on_timeout(t) : rrq_on_timeout(t);
+}
+
+void transfer_free(transfer_t *t)
+{
+    if (t->out)
+        wrq_abortar(t);
+    if (t->zerocopy)
+    {
+        leer_avisos_zerocopy(t);
+        log_debug("%s: %llu envíos con MSG_ZEROCOPY, %llu terminaron copiados", t->peer_str,
+                  (unsigned long long)t->zc_envios, (unsigned long long)t->zc_copiados);
+    }
+    log_debug("%s: %llu paquetes en %llu syscalls enviando, %llu en %llu recibiendo", t->peer_str,
+              (unsigned long long)t->io.tx_paquetes, (unsigned long long)t->io.tx_syscalls,
+              (unsigned long long)t->io.rx_paquetes, (unsigned long long)t->io.rx_syscalls);
+    if (t->srtt_ns > 0)
+        log_debug("%s: RTT %llu us (± %llu), RTO %llu us, %llu ACKs repetidos ignorados", t->peer_str,
+                  (unsigned long long)(t->srtt_ns / 1000), (unsigned long long)(t->rttvar_ns / 1000),
+                  (unsigned long long)(t->rto_ns / 1000), (unsigned long long)t->acks_repetidos);
+    if (t->multicast)
+    {
+        transfer_t **p = &t->comp->sesiones;
+        while (*p != t)
+            p = &(*p)->sesion_sig;
+        *p = t->sesion_sig;
+        free(t->miembros);
+    }
+    if (t->entrada)
+        cache_soltar(t->comp->cache, t->entrada);
+    else if (t->mapa)
+        munmap((void *)t->mapa, t->tam_mapa);
+    if (t->fd >= 0)
+        close(t->fd);
+    close(t->sockfd);
+    free(t->ascii_pos);
+    free(t->ascii_buf);
+    if (t->rx != t->pkt)
+        free(t->rx);
+    free(t->pkt);
+    free(t);
+}
@@ -0,0 +1,207 @@
+#ifndef TFTP_TRANSFER_H
+#define TFTP_TRANSFER_H
+
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "tftp.h"
+#include "udp.h"
+#include "cache.h"
+#include "salida.h"
+#include "netascii.h"
+#include "uring.h"
+
+/* Estado de una transferencia RRQ o WRQ. No bloquea nunca: cada una tiene su
+ * socket efímero no bloqueante (el TID del servidor) y el engine la llama
+ * cuando hay algo para leer, cuando se puede volver a escribir o cuando
+ * venció su deadline. Lo que ocupa es esta estructura y un buffer de
+ * blksize (en RRQ, el archivo mapeado); un proceso por transferencia ya no
+ * hace falta. */
+
+#define TRANSFER_CONTINUE 0
+#define TRANSFER_DONE 1
+
+// qué es cada operación de io_uring de una transferencia (tipo de uring_op_t)
+#define TRANSFER_OP_ENVIO 1
+#define TRANSFER_OP_RECEPCION 2
+#define TRANSFER_OP_ESCRITURA 3
+
+// MSG_ZEROCOPY sólo compensa el costo de los avisos con bloques grandes
+#define ZEROCOPY_MIN_BLKSIZE 8192
+
+// lo que fija el servidor para todas las transferencias
+typedef struct
+{
+    uint64_t timeout_ns; // RTO inicial, hasta tener una medición del RTT
+    int max_retries;     // timeouts seguidos sin avanzar antes de abandonar
+    int zerocopy; // MSG_ZEROCOPY en RRQ con blksize >= ZEROCOPY_MIN_BLKSIZE
+    int gso;      // UDP_SEGMENT: cada lote de una ventana RRQ en un solo sendmsg
+    size_t cache_bytes; // presupuesto de la caché de archivos del engine, 0 = sin caché
+    cache_t *cache;     // la de todos los workers; si es NULL el engine crea la suya con cache_bytes
+    int escritor;       // WRQ: los buffers llenos se escriben desde un hilo aparte
+    int uring;          // el engine atiende con io_uring en vez de epoll y syscalls sueltas
+
+    /* RFC 2090: los RRQ con la opción multicast se mandan al grupo, una
+     * sesión por archivo en mc_puerto, mc_puerto + 1, ... Sin mc_puerto la
+     * opción no se acepta. Con varios workers cada uno usa sus puertos:
+     * mc_puerto + mc_primero, + mc_paso, ... */
+    struct in_addr mc_grupo;
+    uint16_t mc_puerto;
+    int mc_primero, mc_paso;
+    struct in_addr mc_interfaz; // por dónde salen; INADDR_ANY = la ruta por defecto
+} transfer_config_t;
+
+// sesiones multicast que pueden estar abiertas a la vez, cada una con su puerto
+#define MC_MAX_SESIONES 64
+
+typedef struct transfer transfer_t;
+
+// lo que comparten las transferencias de un engine
+typedef struct
+{
+    cache_t *cache;
+    escritor_t *escritor; // NULL: cada WRQ escribe en el hilo del engine
+    transfer_t *sesiones; // RRQ multicast en curso, para sumar a los que piden lo mismo
+} transfer_compartido_t;
+
+// un cliente de una sesión multicast que todavía no es el master
+typedef struct
+{
+    struct sockaddr_in peer;
+    tftp_options_t opts; // lo que pidió, para su OACK cuando le toque
+} miembro_t;
+
+struct transfer
+{
+    int sockfd;
+    struct sockaddr_in peer;
+    socklen_t peer_len;
+    char peer_str[INET_ADDRSTRLEN + 6]; // ip:puerto, para los logs
+
+    uint16_t opcode; // OPCODE_RRQ u OPCODE_WRQ
+    tftp_options_t opts;
+    int retries; // timeouts seguidos sin avanzar
+
+    /* Timer de retransmisión (Jacobson/Karn): el RTO sale del RTT medido
+     * entre lo que se manda y la respuesta que lo confirma, y se duplica en
+     * cada timeout hasta la próxima medición. Con la opción timeout de RFC
+     * 2349 queda fijo en lo que pidió el cliente. */
+    int adaptativo;
+    uint64_t srtt_ns, rttvar_ns, rto_ns;
+    int midiendo;            // hay una medición en curso
+    uint64_t muestra_bloque; // la cierra el ACK de este bloque (RRQ) o este DATA (WRQ)
+    uint64_t muestra_ns;     // cuándo salió lo que se está midiendo
+    uint64_t azar;           // estado del jitter
+
+    char oack[TFTP_MAX_PAYLOAD_SIZE];
+    size_t oack_len;
+    uint8_t *pkt;   // lote de DATA que se lee (RRQ sin mapa) o se recibe (WRQ)
+    size_t pkt_cap; // lugar para uno; pkt tiene lote
+    int lote;       // paquetes por syscall
+    int gso;
+    udp_stats_t io;
+
+    /* RRQ: el archivo mapeado, propio o de la caché (entrada); si no se pudo
+     * mapear se lee con pread a pkt */
+    int fd;
+    const uint8_t *mapa;
+    size_t tam_mapa;
+    cache_entrada_t *entrada;
+
+    /* RRQ multicast: peer es el master, el único que confirma. Los DATA van a
+     * destino, que es el grupo (o peer sin multicast); los demás clientes
+     * esperan su turno en miembros. */
+    struct sockaddr_in destino;
+    int multicast;
+    const transfer_config_t *cfg;
+    miembro_t *miembros;
+    int cant_miembros, cap_miembros;
+    transfer_compartido_t *comp;
+    struct transfer *sesion_sig;
+    int zerocopy;
+    uint64_t zc_envios, zc_copiados; // avisos de MSG_ZEROCOPY recibidos
+    int esperando_oack; // OACK mandado, falta el ACK 0
+    uint64_t base;      // primer bloque sin ACK
+    uint64_t siguiente; // próximo bloque a mandar
+    uint64_t ultimo;    // el bloque corto del final, 0 mientras no se leyó
+    uint64_t max_enviado;    // el más alto mandado: lo que no pase de ahí es retransmisión
+    uint64_t enviado_ns;     // cuándo salió el último lote
+    uint64_t acks_repetidos; // ignorados por no avanzar
+    int bloqueado;      // el socket se llenó a mitad de una ventana
+
+    /* netascii: RRQ codifica cada lote en pkt desde donde empieza su primer
+     * bloque, que queda anotado en ascii_pos (por número de bloque módulo
+     * windowsize + 1) para poder volver atrás en la ventana; WRQ decodifica
+     * cada bloque en ascii_buf antes de escribirlo. */
+    int ascii;
+    netascii_pos_t *ascii_pos;
+    uint8_t *ascii_buf; // RRQ sin mapa: lo leído del archivo; WRQ: lo decodificado
+    int ascii_cr;       // WRQ: el bloque anterior terminó en CR
+
+    // WRQ
+    salida_t *out;
+    char filename[TFTP_MAX_PAYLOAD_SIZE];
+    int esperando_disco; // el escritor no tenía lugar para esperado: se pide de nuevo con su novedad
+    int guardando;       // el escritor está bajando el archivo al disco y renombrándolo
+    uint64_t esperado;
+    int en_ventana;     // bloques en orden desde el último ACK
+    int fuera_de_orden; // salteados o repetidos desde el último avance
+
+    // del engine: deadline y lugar en la rueda de timers
+    uint64_t deadline_ns; // 0 = sin timer
+    uint64_t timer_tick;
+    struct transfer *timer_prev, *timer_next;
+    uint32_t eventos; // los registrados en epoll
+
+    /* Con io_uring el engine pone su ring al adoptarla y desde ahí los
+     * envíos se encolan en él. Lo que está en vuelo apunta a la
+     * transferencia y a sus buffers, así que se libera recién cuando vuelve
+     * todo. */
+    uring_t *uring;
+    int fijo;     // lugar del socket en la tabla de archivos fijos, -1 si no tiene
+    int en_vuelo; // operaciones encoladas que todavía no se completaron
+    int esperando_escritura;
+    int terminada;
+    uint8_t *rx; // rx_cant buffers de rx_cap bytes para las recepciones encoladas
+    size_t rx_cap;
+    int rx_cant;
+};
+
+uint64_t now_ns(void);
+
+void enviar_error(int sockfd, const struct sockaddr_in *client, socklen_t client_len, uint16_t code, const char *msg);
+
+/* Arranca la transferencia pedida por el RRQ/WRQ pkt de n bytes: abre el
+ * archivo (o lo toma de la caché de comp) y el socket y manda la primera
+ * respuesta. Un RRQ multicast de un archivo que ya se está mandando se suma
+ * a esa sesión. Devuelve NULL si no hay una transferencia nueva (se sumó,
+ * se rechazó con un ERROR o falló). cfg y comp tienen que durar lo que
+ * dure la transferencia. */
+transfer_t *transfer_start(const tftp_packet_t *pkt, ssize_t n, const struct sockaddr_in *peer,
+                           socklen_t peer_len, const transfer_config_t *cfg, transfer_compartido_t *comp);
+
+// lee todo lo pendiente en el socket; TRANSFER_DONE si terminó
+int transfer_on_readable(transfer_t *t);
+
+// el socket volvió a tener lugar después de un EAGAIN
+int transfer_on_writable(transfer_t *t);
+
+/* io_uring: prepara rx, rx_cap y rx_cant para dejar recepciones encoladas
+ * (-1 si no hay memoria); cada datagrama que llega, o -errno si falló la
+ * recepción, va a transfer_on_datagrama. */
+int transfer_preparar_rx(transfer_t *t);
+int transfer_on_datagrama(transfer_t *t, const uint8_t *buf, ssize_t n, const struct sockaddr_in *from);
+
+// io_uring: se completó un envío encolado desde el bloque (0 si no era DATA), res como en un CQE
+int transfer_on_enviado(transfer_t *t, uint64_t bloque, int res);
+
+// WRQ: el escritor avisó una novedad de out (ver escritor_novedad)
+int transfer_on_salida(transfer_t *t);
+
+// venció deadline_ns sin noticias del cliente
+int transfer_on_timeout(transfer_t *t);
+
+void transfer_free(transfer_t *t);
+
+#endif
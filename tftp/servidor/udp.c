@@ -0,0 +1,102 @@
+#define _GNU_SOURCE // sendmmsg, recvmmsg
+#include <string.h>
+#include <errno.h>
+#include <netinet/udp.h> // UDP_SEGMENT
+
+#include "udp.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+static int enviar_gso(int fd, struct msghdr *msg, int cant, int flags, size_t gso_size)
+{
+    char control[CMSG_SPACE(sizeof(uint16_t))] = {0};
+    msg->msg_control = control;
+    msg->msg_controllen = sizeof(control);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segmento = gso_size;
+    memcpy(CMSG_DATA(cm), &segmento, sizeof(segmento));
+
+    // todo o nada: el kernel parte el datagrama después de aceptarlo entero
+    ssize_t r = sendmsg(fd, msg, flags);
+    msg->msg_control = NULL;
+    msg->msg_controllen = 0;
+    return r < 0 ? -1 : cant;
+}
+
+int udp_enviar_lote(int fd, const struct sockaddr_in *dst, socklen_t dst_len, struct iovec *iov, int iovlen,
+                    int cant, int flags, size_t gso_size, udp_stats_t *st)
+{
+    struct mmsghdr msgs[UDP_LOTE_MAX];
+    if (cant > UDP_LOTE_MAX)
+        cant = UDP_LOTE_MAX;
+    for (int i = 0; i < cant; i++)
+        msgs[i].msg_hdr = (struct msghdr){.msg_name = (void *)dst, .msg_namelen = dst_len,
+                                          .msg_iov = iov + i * iovlen, .msg_iovlen = iovlen};
+
+    int r;
+    while (1)
+    {
+        if (gso_size > 0 && cant > 1)
+        {
+            msgs[0].msg_hdr.msg_iovlen = iovlen * cant;
+            r = enviar_gso(fd, &msgs[0].msg_hdr, cant, flags, gso_size);
+            msgs[0].msg_hdr.msg_iovlen = iovlen;
+        }
+        else
+            r = sendmmsg(fd, msgs, cant, flags);
+        st->tx_syscalls++;
+        /* Sin memoria para fijar las páginas, o un datagrama ocupa más páginas
+         * de las que se pueden prestar: se manda copiando. */
+        if (r < 0 && (flags & MSG_ZEROCOPY) && (errno == ENOBUFS || errno == EMSGSIZE))
+        {
+            flags &= ~MSG_ZEROCOPY;
+            continue;
+        }
+        if (r < 0 && errno == EINTR)
+            continue;
+        break;
+    }
+    if (r > 0)
+        st->tx_paquetes += r;
+    return r;
+}
+
+int udp_recibir_lote(int fd, uint8_t *bufs, size_t cap, int cant, size_t *largos, struct sockaddr_in *from,
+                     udp_stats_t *st)
+{
+    struct mmsghdr msgs[UDP_LOTE_MAX];
+    struct iovec iov[UDP_LOTE_MAX];
+    if (cant > UDP_LOTE_MAX)
+        cant = UDP_LOTE_MAX;
+    for (int i = 0; i < cant; i++)
+    {
+        iov[i] = (struct iovec){.iov_base = bufs + i * cap, .iov_len = cap};
+        msgs[i].msg_hdr = (struct msghdr){.msg_name = &from[i], .msg_namelen = sizeof(from[i]),
+                                          .msg_iov = &iov[i], .msg_iovlen = 1};
+    }
+
+    int r;
+    do
+        r = recvmmsg(fd, msgs, cant, MSG_DONTWAIT, NULL);
+    while (r < 0 && errno == EINTR);
+    st->rx_syscalls++;
+    if (r <= 0)
+        return r;
+    st->rx_paquetes += r;
+    for (int i = 0; i < r; i++)
+        largos[i] = msgs[i].msg_len;
+    return r;
+}
+
+void udp_stats_sumar(udp_stats_t *total, const udp_stats_t *s)
+{
+    total->tx_syscalls += s->tx_syscalls;
+    total->tx_paquetes += s->tx_paquetes;
+    total->rx_syscalls += s->rx_syscalls;
+    total->rx_paquetes += s->rx_paquetes;
+}
@@ -0,0 +1,39 @@
+#ifndef TFTP_UDP_H
+#define TFTP_UDP_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+/* E/S UDP por lotes: varios datagramas por syscall con sendmmsg/recvmmsg,
+ * o una ventana entera en un solo sendmsg con UDP_SEGMENT (GSO). Cada
+ * llamada suma en un udp_stats_t cuántas syscalls hizo y cuántos paquetes
+ * movió, para ver cuánto se está agrupando. */
+
+#define UDP_LOTE_MAX 64     // mensajes por llamada (también el máximo de segmentos GSO)
+#define UDP_GSO_MAX 65507   // lo que entra en un datagrama IPv4, sumando todos los segmentos
+
+typedef struct
+{
+    uint64_t tx_syscalls, tx_paquetes;
+    uint64_t rx_syscalls, rx_paquetes;
+} udp_stats_t;
+
+/* Manda cant datagramas a dst; el i-ésimo son los iovlen iovecs desde
+ * iov[i * iovlen]. Con gso_size > 0 van todos en un solo sendmsg, partidos
+ * por el kernel cada gso_size bytes (todos deben medir eso salvo el último).
+ * Si MSG_ZEROCOPY no puede prestar las páginas se reintenta copiando.
+ * Devuelve cuántos salieron, o -1 con errno si no salió ninguno. */
+int udp_enviar_lote(int fd, const struct sockaddr_in *dst, socklen_t dst_len, struct iovec *iov, int iovlen,
+                    int cant, int flags, size_t gso_size, udp_stats_t *st);
+
+/* Recibe hasta cant datagramas sin bloquear; el i-ésimo queda en
+ * bufs + i * cap, con su largo en largos[i] y el origen en from[i].
+ * Devuelve cuántos llegaron, o -1 con errno (EAGAIN si no había nada). */
+int udp_recibir_lote(int fd, uint8_t *bufs, size_t cap, int cant, size_t *largos, struct sockaddr_in *from,
+                     udp_stats_t *st);
+
+void udp_stats_sumar(udp_stats_t *total, const udp_stats_t *s);
+
+#endif
@@ -0,0 +1,456 @@
+#define _GNU_SOURCE // syscall()
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/udp.h> // UDP_SEGMENT
+
+#include "uring.h"
+
+#ifndef SIN_IO_URING
+#include <linux/io_uring.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+struct uring
+{
+    int fd;
+
+    // cola de envío: las entradas desde el head del kernel hasta tail todavía no se mandaron
+    unsigned *sq_head, *sq_tail, sq_mask, sq_entradas;
+    struct io_uring_sqe *sqes;
+    unsigned tail;
+
+    // cola de completadas
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_mapa, *cq_mapa;
+    size_t sq_tam, cq_tam, sqes_tam;
+
+    // lugares libres de la tabla de archivos fijos
+    int *libres;
+    int cant_libres;
+
+    uring_op_t *ops_libres;
+    uint64_t llamadas, operaciones;
+};
+
+static int sys_setup(unsigned entradas, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entradas, p);
+}
+
+static int sys_enter(int fd, unsigned enviar, unsigned min, unsigned flags, const void *arg, size_t arg_tam)
+{
+    return syscall(__NR_io_uring_enter, fd, enviar, min, flags, arg, arg_tam);
+}
+
+static int sys_register(int fd, unsigned opcode, const void *arg, unsigned cant)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, cant);
+}
+
+static int mapear(uring_t *u, const struct io_uring_params *p)
+{
+    u->sq_tam = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    u->cq_tam = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    // desde 5.4 las dos colas van en un solo mapa
+    if (p->features & IORING_FEAT_SINGLE_MMAP)
+        u->sq_tam = u->cq_tam = u->sq_tam > u->cq_tam ? u->sq_tam : u->cq_tam;
+
+    u->sq_mapa = mmap(NULL, u->sq_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_mapa == MAP_FAILED)
+        return -1;
+    u->cq_mapa = u->sq_mapa;
+    if (!(p->features & IORING_FEAT_SINGLE_MMAP))
+    {
+        u->cq_mapa =
+            mmap(NULL, u->cq_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_mapa == MAP_FAILED)
+            return -1;
+    }
+    u->sqes_tam = p->sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        return -1;
+
+    uint8_t *sq = u->sq_mapa, *cq = u->cq_mapa;
+    u->sq_head = (unsigned *)(sq + p->sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    u->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+    u->sq_entradas = *(unsigned *)(sq + p->sq_off.ring_entries);
+    u->tail = *u->sq_tail;
+    // la entrada i de la cola es siempre la sqe i
+    unsigned *array = (unsigned *)(sq + p->sq_off.array);
+    for (unsigned i = 0; i < u->sq_entradas; i++)
+        array[i] = i;
+
+    u->cq_head = (unsigned *)(cq + p->cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    u->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+// tabla de archivos fijos vacía; si no se puede registrar, las operaciones usan los fd
+static void registrar_archivos(uring_t *u, unsigned archivos)
+{
+    int *fds = malloc(archivos * sizeof(int));
+    u->libres = malloc(archivos * sizeof(int));
+    if (fds == NULL || u->libres == NULL)
+    {
+        free(fds);
+        return;
+    }
+    for (unsigned i = 0; i < archivos; i++)
+        fds[i] = -1;
+    if (sys_register(u->fd, IORING_REGISTER_FILES, fds, archivos) == 0)
+        for (unsigned i = 0; i < archivos; i++)
+            u->libres[u->cant_libres++] = archivos - 1 - i;
+    free(fds);
+}
+
+uring_t *uring_create(unsigned entradas, unsigned archivos)
+{
+    uring_t *u = calloc(1, sizeof(uring_t));
+    if (u == NULL)
+        return NULL;
+
+    /* Un solo hilo lo usa y sólo cosecha al entrar: así el kernel no
+     * interrumpe al engine para completar operaciones. Los envíos de una
+     * ventana ocupan muchas completadas por cada io_uring_enter. */
+    struct io_uring_params p = {
+        .flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                 IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        .cq_entries = 4 * entradas,
+    };
+    if ((u->fd = sys_setup(entradas, &p)) < 0)
+    {
+        free(u);
+        return NULL;
+    }
+    if (mapear(u, &p) < 0)
+    {
+        int err = errno;
+        uring_destroy(u);
+        errno = err;
+        return NULL;
+    }
+    if (archivos > 0)
+        registrar_archivos(u, archivos);
+    return u;
+}
+
+void uring_destroy(uring_t *u)
+{
+    // el kernel cancela lo que quedó en vuelo al cerrar el ring
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_tam);
+    if (u->cq_mapa && u->cq_mapa != MAP_FAILED && u->cq_mapa != u->sq_mapa)
+        munmap(u->cq_mapa, u->cq_tam);
+    if (u->sq_mapa && u->sq_mapa != MAP_FAILED)
+        munmap(u->sq_mapa, u->sq_tam);
+    close(u->fd);
+    while (u->ops_libres)
+    {
+        uring_op_t *op = u->ops_libres;
+        u->ops_libres = op->sig;
+        free(op);
+    }
+    free(u->libres);
+    free(u);
+}
+
+int uring_fijar(uring_t *u, int fd)
+{
+    if (u->cant_libres == 0)
+        return -1;
+    int fijo = u->libres[--u->cant_libres];
+    struct io_uring_files_update up = {.offset = fijo, .fds = (uintptr_t)&fd};
+    if (sys_register(u->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) != 1)
+    {
+        u->libres[u->cant_libres++] = fijo;
+        return -1;
+    }
+    return fijo;
+}
+
+void uring_soltar(uring_t *u, int fijo)
+{
+    if (fijo < 0)
+        return;
+    int nada = -1;
+    struct io_uring_files_update up = {.offset = fijo, .fds = (uintptr_t)&nada};
+    sys_register(u->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+    u->libres[u->cant_libres++] = fijo;
+}
+
+static uring_op_t *nueva_op(uring_t *u)
+{
+    uring_op_t *op = u->ops_libres;
+    if (op)
+        u->ops_libres = op->sig;
+    else if ((op = malloc(sizeof(uring_op_t))) == NULL)
+        return NULL;
+    op->tipo = 0;
+    op->duenio = NULL;
+    op->dato = 0;
+    op->res = 0;
+    return op;
+}
+
+void uring_liberar(uring_t *u, uring_op_t *op)
+{
+    op->sig = u->ops_libres;
+    u->ops_libres = op;
+}
+
+// la próxima entrada de la cola de envío; si está llena, se manda lo que hay sin esperar
+static struct io_uring_sqe *nueva_sqe(uring_t *u)
+{
+    if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entradas)
+    {
+        sys_enter(u->fd, u->tail - *u->sq_head, 0, 0, NULL, 0);
+        u->llamadas++;
+        if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entradas)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &u->sqes[u->tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void publicar(uring_t *u, struct io_uring_sqe *sqe, int fd, int fijo, uint64_t user_data)
+{
+    sqe->fd = fijo >= 0 ? fijo : fd;
+    if (fijo >= 0)
+        sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->user_data = user_data;
+    __atomic_store_n(u->sq_tail, ++u->tail, __ATOMIC_RELEASE);
+    u->operaciones++;
+}
+
+// op con su msghdr armado, en una sqe de opcode
+static uring_op_t *encolar_msg(uring_t *u, uring_op_t *op, int opcode, int fd, int fijo)
+{
+    struct io_uring_sqe *sqe = nueva_sqe(u);
+    if (sqe == NULL)
+    {
+        uring_liberar(u, op);
+        return NULL;
+    }
+    sqe->opcode = opcode;
+    sqe->addr = (uintptr_t)&op->msg;
+    sqe->len = 1;
+    publicar(u, sqe, fd, fijo, (uintptr_t)op);
+    return op;
+}
+
+uring_op_t *uring_enviar(uring_t *u, int fd, int fijo, const struct sockaddr_in *dst, const struct iovec *iov,
+                         int iovlen, size_t gso_size)
+{
+    uring_op_t *op = nueva_op(u);
+    if (op == NULL)
+        return NULL;
+    if (iovlen > 2 * UDP_LOTE_MAX)
+        iovlen = 2 * UDP_LOTE_MAX;
+    op->dir = *dst;
+    memcpy(op->iov, iov, iovlen * sizeof(struct iovec));
+    op->msg = (struct msghdr){.msg_name = &op->dir, .msg_namelen = sizeof(op->dir), .msg_iov = op->iov,
+                              .msg_iovlen = iovlen};
+    if (gso_size > 0)
+    {
+        memset(op->control, 0, sizeof(op->control));
+        op->msg.msg_control = op->control;
+        op->msg.msg_controllen = sizeof(op->control);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&op->msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segmento = gso_size;
+        memcpy(CMSG_DATA(cm), &segmento, sizeof(segmento));
+    }
+    return encolar_msg(u, op, IORING_OP_SENDMSG, fd, fijo);
+}
+
+uring_op_t *uring_enviar_copia(uring_t *u, int fd, int fijo, const struct sockaddr_in *dst, const void *buf,
+                               size_t len)
+{
+    if (len > URING_COPIA)
+        return NULL;
+    uring_op_t *op = nueva_op(u);
+    if (op == NULL)
+        return NULL;
+    memcpy(op->copia, buf, len);
+    op->dir = *dst;
+    op->iov[0] = (struct iovec){.iov_base = op->copia, .iov_len = len};
+    op->msg = (struct msghdr){.msg_name = &op->dir, .msg_namelen = sizeof(op->dir), .msg_iov = op->iov,
+                              .msg_iovlen = 1};
+    return encolar_msg(u, op, IORING_OP_SENDMSG, fd, fijo);
+}
+
+uring_op_t *uring_recibir(uring_t *u, int fd, int fijo, void *buf, size_t cap)
+{
+    uring_op_t *op = nueva_op(u);
+    if (op == NULL)
+        return NULL;
+    op->iov[0] = (struct iovec){.iov_base = buf, .iov_len = cap};
+    op->msg = (struct msghdr){.msg_name = &op->dir, .msg_namelen = sizeof(op->dir), .msg_iov = op->iov,
+                              .msg_iovlen = 1};
+    return encolar_msg(u, op, IORING_OP_RECVMSG, fd, fijo);
+}
+
+uring_op_t *uring_esperar(uring_t *u, int fd, int fijo, short eventos)
+{
+    uring_op_t *op = nueva_op(u);
+    if (op == NULL)
+        return NULL;
+    struct io_uring_sqe *sqe = nueva_sqe(u);
+    if (sqe == NULL)
+    {
+        uring_liberar(u, op);
+        return NULL;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = (unsigned short)eventos;
+    publicar(u, sqe, fd, fijo, (uintptr_t)op);
+    return op;
+}
+
+int uring_cancelar(uring_t *u, int fd, int fijo)
+{
+    struct io_uring_sqe *sqe = nueva_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fijo >= 0 ? fijo : fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    if (fijo >= 0)
+        sqe->cancel_flags |= IORING_ASYNC_CANCEL_FD_FIXED;
+    // su propia completada no es de nadie: uring_completada la saltea
+    sqe->user_data = 0;
+    __atomic_store_n(u->sq_tail, ++u->tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int uring_entrar(uring_t *u, uint64_t espera_ns)
+{
+    struct __kernel_timespec ts = {.tv_sec = espera_ns / 1000000000, .tv_nsec = espera_ns % 1000000000};
+    struct io_uring_getevents_arg arg = {.ts = espera_ns > 0 ? (uintptr_t)&ts : 0};
+    unsigned pendientes = u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    int r = sys_enter(u->fd, pendientes, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    u->llamadas++;
+    // ETIME: venció la espera; EBUSY: hay completadas para cosechar antes de mandar más
+    if (r < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+        return -1;
+    return 0;
+}
+
+uring_op_t *uring_completada(uring_t *u)
+{
+    while (1)
+    {
+        unsigned head = *u->cq_head;
+        if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+            return NULL;
+        struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+        uring_op_t *op = (uring_op_t *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+        if (op)
+        {
+            op->res = res;
+            return op;
+        }
+    }
+}
+
+uint64_t uring_llamadas(const uring_t *u)
+{
+    return u->llamadas;
+}
+
+uint64_t uring_operaciones(const uring_t *u)
+{
+    return u->operaciones;
+}
+
+#else
+
+// compilado sin io_uring: no se puede crear un ring, y sin ring no se llega al resto
+uring_t *uring_create(unsigned entradas, unsigned archivos)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_destroy(uring_t *u)
+{
+}
+
+int uring_fijar(uring_t *u, int fd)
+{
+    return -1;
+}
+
+void uring_soltar(uring_t *u, int fijo)
+{
+}
+
+void uring_liberar(uring_t *u, uring_op_t *op)
+{
+}
+
+int uring_cancelar(uring_t *u, int fd, int fijo)
+{
+    return -1;
+}
+
+int uring_entrar(uring_t *u, uint64_t espera_ns)
+{
+    return -1;
+}
+
+uring_op_t *uring_completada(uring_t *u)
+{
+    return NULL;
+}
+
+uint64_t uring_llamadas(const uring_t *u)
+{
+    return 0;
+}
+
+uint64_t uring_operaciones(const uring_t *u)
+{
+    return 0;
+}
+
+uring_op_t *uring_enviar(uring_t *u, int fd, int fijo, const struct sockaddr_in *dst, const struct iovec *iov,
+                         int iovlen, size_t gso_size)
+{
+    return NULL;
+}
+
+uring_op_t *uring_enviar_copia(uring_t *u, int fd, int fijo, const struct sockaddr_in *dst, const void *buf,
+                               size_t len)
+{
+    return NULL;
+}
+
+uring_op_t *uring_recibir(uring_t *u, int fd, int fijo, void *buf, size_t cap)
+{
+    return NULL;
+}
+
+uring_op_t *uring_esperar(uring_t *u, int fd, int fijo, short eventos)
+{
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef TFTP_URING_H
+#define TFTP_URING_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "udp.h"
+
+/* io_uring sin liburing, con lo justo para el engine: envíos y recepciones
+ * UDP (SENDMSG/RECVMSG) y esperas de POLLOUT que se encolan sin syscall y
+ * salen todas juntas en un io_uring_enter, que también espera y trae las
+ * completadas. Los sockets se pueden registrar en la tabla de archivos fijos
+ * del ring, así el kernel no los busca en cada operación. Cada operación es
+ * un uring_op_t con lo que el kernel lee o escribe mientras está en vuelo. */
+
+// lo más que se copia de un envío chico (ACK, ERROR) para no depender del buffer de quien lo manda
+#define URING_COPIA 128
+
+typedef struct uring uring_t;
+
+typedef struct uring_op uring_op_t;
+struct uring_op
+{
+    // de quien la encola: qué es y de quién
+    int tipo;
+    void *duenio;
+    uint64_t dato;
+
+    int res;                 // al completarse: bytes, o -errno
+    struct sockaddr_in dir;  // destino de un envío, origen de lo recibido
+    struct msghdr msg;
+    struct iovec iov[2 * UDP_LOTE_MAX];
+    char control[CMSG_SPACE(sizeof(uint16_t))]; // UDP_SEGMENT
+    uint8_t copia[URING_COPIA];
+    uring_op_t *sig; // libres
+};
+
+/* Un ring con lugar para entradas operaciones por io_uring_enter y una
+ * tabla de archivos fijos; NULL con errno si el kernel no lo soporta (hace
+ * falta 6.1), está deshabilitado o se compiló con SIN_IO_URING. Lo tiene que
+ * usar sólo el hilo que lo crea. */
+uring_t *uring_create(unsigned entradas, unsigned archivos);
+
+void uring_destroy(uring_t *u);
+
+// lugar de fd en la tabla de archivos fijos, o -1 si no hay (se sigue usando fd)
+int uring_fijar(uring_t *u, int fd);
+
+void uring_soltar(uring_t *u, int fijo);
+
+/* Encola un datagrama a dst con los iovlen iovecs de iov, o con gso_size >
+ * 0 un lote que el kernel parte cada gso_size bytes. Los iovecs se copian,
+ * lo que apuntan tiene que durar hasta que se complete. fijo es el lugar de
+ * fd en la tabla, o -1. NULL si no hay memoria para la operación. */
+uring_op_t *uring_enviar(uring_t *u, int fd, int fijo, const struct sockaddr_in *dst, const struct iovec *iov,
+                         int iovlen, size_t gso_size);
+
+// como uring_enviar con un solo buffer, que se copia si no pasa de URING_COPIA
+uring_op_t *uring_enviar_copia(uring_t *u, int fd, int fijo, const struct sockaddr_in *dst, const void *buf,
+                               size_t len);
+
+// encola la recepción de un datagrama en buf; el origen queda en dir
+uring_op_t *uring_recibir(uring_t *u, int fd, int fijo, void *buf, size_t cap);
+
+// se completa cuando fd tiene alguno de eventos (POLLOUT, ...)
+uring_op_t *uring_esperar(uring_t *u, int fd, int fijo, short eventos);
+
+/* Cancela lo que está en vuelo sobre fd (lo encolado antes sale igual).
+ * Cada operación se completa de todos modos, con -ECANCELED si llegó a
+ * tiempo. */
+int uring_cancelar(uring_t *u, int fd, int fijo);
+
+/* Manda lo encolado y espera que se complete algo, hasta espera_ns (0 = sin
+ * límite). -1 con errno si falló; vencer la espera no es un error. */
+int uring_entrar(uring_t *u, uint64_t espera_ns);
+
+// la próxima operación completada, o NULL; después de atenderla se devuelve con uring_liberar
+uring_op_t *uring_completada(uring_t *u);
+
+void uring_liberar(uring_t *u, uring_op_t *op);
+
+// llamadas a io_uring_enter y operaciones que pasaron por ellas
+uint64_t uring_llamadas(const uring_t *u);
+uint64_t uring_operaciones(const uring_t *u);
+
+#endif